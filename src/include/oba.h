@@ -1,6 +1,9 @@
 #ifndef oba_h
 #define oba_h
 
+#include <stdbool.h>
+#include <stddef.h>
+
 #define OBA_VERSION_STRING "0.0.1"
 
 // Public APIs for the Oba language -------------------------------------------
@@ -8,15 +11,107 @@
 typedef enum {
   OBA_RESULT_SUCCESS,
   OBA_RESULT_COMPILE_ERROR,
-  OBA_RESULT_RUNTIME_ERROR
-} ObaInterpretResult;
+  OBA_RESULT_RUNTIME_ERROR,
+
+  // The code ran out of fuel, and can be resumed by [obaResume].
+  OBA_RESULT_OUT_OF_FUEL,
 
-// Builtin represents a named C function that is callable from Oba source code.
-typedef struct Builtin Builtin;
+  // The code is waiting for I/O, and is resumed by [obaRunEventLoop].
+  OBA_RESULT_WAITING
+} ObaInterpretResult;
 
 // A single virtual machine for execute Oba code.
+//
+// VMs share no state with each other, so separate VMs can run on separate
+// threads at the same time. A VM must only be used by one thread at a time.
 typedef struct ObaVM ObaVM;
 
+// A C function that is callable from Oba source code.
+//
+// Its [argc] arguments are in slots 1 to [argc], and it returns the value it
+// stores in slot 0, which starts out as nil.
+typedef void (*ObaNativeFn)(ObaVM* vm, int argc);
+
+// A native, and the name of the global it is defined as.
+typedef struct Builtin {
+  const char* name;
+  ObaNativeFn function;
+} Builtin;
+
+// A fixed set of VMs for hosts that run scripts on many threads at once.
+typedef struct ObaVMPool ObaVMPool;
+
+// Compiled code shared by many VMs, on any threads.
+typedef struct ObaSharedCode ObaSharedCode;
+
+// A function looked up once by the host, to be called any number of times.
+typedef struct ObaHandle ObaHandle;
+
+// Waits for the I/O of many VMs on one thread.
+typedef struct ObaEventLoop ObaEventLoop;
+
+// Runs many scripts at once on a fixed set of threads.
+typedef struct ObaScheduler ObaScheduler;
+
+// A script spawned on an [ObaScheduler].
+typedef struct ObaTask ObaTask;
+
+// A queue of values sent from one or more VMs to another.
+typedef struct ObaChannel ObaChannel;
+
+// The source or bytecode of a module, returned by an [ObaLoadModuleFn].
+typedef struct ObaLoadModuleResult ObaLoadModuleResult;
+
+// Called once the VM no longer needs the source or bytecode in [result], which
+// was loaded for the module [name].
+typedef void (*ObaLoadModuleCompleteFn)(ObaVM* vm, const char* name,
+                                        ObaLoadModuleResult result);
+
+struct ObaLoadModuleResult {
+  // The module's source code, or NULL.
+  const char* source;
+
+  // The module's serialized bytecode, as returned by [obaCompileModule], and
+  // its length. Only used if [source] is NULL.
+  //
+  // Bytecode is run in place, so it must stay valid until [onComplete] is
+  // called, which is when the VM is freed.
+  const unsigned char* bytecode;
+  size_t length;
+
+  // Called once the VM is done with [source] or [bytecode], so the host can
+  // release them. May be NULL.
+  ObaLoadModuleCompleteFn onComplete;
+
+  // Data for [onComplete].
+  void* userData;
+};
+
+// Returns the name of the module that [name] refers to when [importer] imports
+// it. Modules are loaded once per name that this returns.
+//
+// The returned string must be allocated with malloc, and the VM frees it.
+// Returning NULL makes the import a runtime error.
+typedef char* (*ObaResolveModuleFn)(ObaVM* vm, const char* importer,
+                                    const char* name);
+
+// Returns the source or bytecode of the module [name], as resolved by the
+// [ObaResolveModuleFn].
+//
+// If both the source and the bytecode are NULL, the module is loaded as if
+// there were no loader: from the standard library built into the binary, or
+// from mod/<name>.oba.
+//
+// Modules are looked up as soon as a module importing them is compiled, so that
+// their source can be compiled in the background, and may be looked up even if
+// the import never runs. The resolver and loader are only ever called on the
+// thread running the VM.
+typedef ObaLoadModuleResult (*ObaLoadModuleFn)(ObaVM* vm, const char* name);
+
+// Reads up to [size] bytes of source code into [buffer], and returns the number
+// of bytes read. Returning 0 ends the source.
+typedef size_t (*ObaReadFn)(void* userData, char* buffer, size_t size);
+
 // Creates a new Oba Virtual Machine.
 ObaVM* obaNewVM(Builtin*, int);
 
@@ -24,7 +119,341 @@ ObaVM* obaNewVM(Builtin*, int);
 // a call to [obaVM].
 void obaFreeVM(ObaVM*);
 
+// Creates a store of compiled code for VMs to share.
+ObaSharedCode* obaNewSharedCode(void);
+
+// Frees [code]. The modules that VMs still use are freed along with the last
+// of those VMs.
+void obaFreeSharedCode(ObaSharedCode* code);
+
+// Makes [vm] share the code of the modules it compiles through the compile
+// cache, which are imported modules and scripts run by [obaInterpretCached],
+// with every other VM using [code]. [code] must not be freed before [vm].
+//
+// A module is compiled once for all of them. Its functions, bytecode and
+// constants are held in memory once, and never change, so only closures,
+// upvalues and module variables are held by each VM. Because shared code never
+// changes, function bodies that would otherwise be compiled when first called
+// are compiled along with their module.
+void obaSetSharedCode(ObaVM* vm, ObaSharedCode* code);
+
+// Creates a pool of [size] VMs, each created with [builtins]. If [snapshot] is
+// not NULL, every VM starts from the heap saved there by [obaSaveSnapshot].
+// The VMs share their compiled code, as if by [obaSetSharedCode].
+//
+// Returns NULL if the snapshot cannot be loaded.
+ObaVMPool* obaNewVMPool(int size, Builtin* builtins, int builtinsLength,
+                        const char* snapshot);
+
+// Frees [pool] and its VMs. Every VM taken from it must have been released.
+void obaFreeVMPool(ObaVMPool* pool);
+
+// Takes a VM from [pool] for the calling thread, waiting until one is released
+// if all of them are in use.
+//
+// Returns NULL if the pool has no VMs left, which only happens if its snapshot
+// could no longer be loaded when VMs were released.
+ObaVM* obaAcquireVM(ObaVMPool* pool);
+
+// Returns [vm], which was taken from [pool] by [obaAcquireVM], to the pool.
+//
+// The pool replaces it with a new VM in the state the pool was created with,
+// so nothing the last script did is seen by the next one.
+void obaReleaseVM(ObaVMPool* pool, ObaVM* vm);
+
+// Sets the functions [vm] uses to resolve and load imported modules. Either may
+// be NULL. By default, modules are registered under the name they are imported
+// by, and loaded from the standard library or mod/<name>.oba.
+void obaSetModuleHandlers(ObaVM* vm, ObaResolveModuleFn resolveModuleFn,
+                          ObaLoadModuleFn loadModuleFn);
+
+// Associates [userData] with [vm], for use in the host's callbacks.
+void obaSetUserData(ObaVM* vm, void* userData);
+
+// Returns the data associated with [vm] by [obaSetUserData].
+void* obaGetUserData(ObaVM* vm);
+
+// Compiles [source] as the module [name], and returns its serialized bytecode
+// for an [ObaLoadModuleFn] to return. Stores its length in [length].
+//
+// The bytecode can only be loaded by a build of Oba with the same bytecode
+// version. It must be freed with free(). Returns NULL if [source] does not
+// compile.
+unsigned char* obaCompileModule(ObaVM* vm, const char* name,
+                                const char* source, size_t* length);
+
 // Runs [source], a string of Oba source code.
 ObaInterpretResult obaInterpret(ObaVM* vm, const char* source);
 
+// Runs [source] like [obaInterpret], reusing the bytecode compiled for the same
+// source by an earlier run if it is in the compile cache.
+//
+// This is meant for running whole files. Imported modules always use the
+// cache.
+ObaInterpretResult obaInterpretCached(ObaVM* vm, const char* source);
+
+// Runs source code read from [read] as it is compiled, rather than from a
+// string.
+//
+// The source is read in chunks of a fixed size, which are freed once the
+// top-level statements in them have been compiled, so a large script never has
+// to be held in memory all at once. [userData] is passed to [read]. The
+// bytecode is not cached.
+ObaInterpretResult obaInterpretStream(ObaVM* vm, ObaReadFn read,
+                                      void* userData);
+
+// Replaces the code of the module [name], which [vm] has already imported,
+// with [source], and runs its body again.
+//
+// The new body runs in an empty module. Only once it has finished without an
+// error are the module's variables replaced by the ones it defined, all at
+// once. From then on, members looked up in the module are the new ones.
+// Functions taken from the module before it was reloaded, such as those bound
+// to variables elsewhere, keep running their old code, although the variables
+// they use are read from the new module. If the body does not finish, because
+// of an error or because it runs out of fuel or waits, the module is left as
+// it was.
+//
+// Must not be called while [vm] is running code. Returns a runtime error,
+// without running [source], if [vm] has code that ran out of fuel or is
+// waiting, since running it would abandon that code.
+ObaInterpretResult obaReloadModule(ObaVM* vm, const char* name,
+                                   const char* source);
+
+// Limits the code [vm] runs to [fuel] more backward jumps and calls, so that
+// a script that never ends cannot hold the thread running it. A negative
+// [fuel] removes the limit, which is the default.
+//
+// Code that runs out of fuel stops where it is, and the script or [obaCall]
+// running it returns [OBA_RESULT_OUT_OF_FUEL]. Straight-line code uses no
+// fuel, so every loop iteration and call is counted but nothing else is.
+// Functions called by natives cannot be stopped and resumed, so running out of
+// fuel in one is a runtime error.
+//
+// Fuel is only counted by builds of Oba with OBA_FUEL defined, which the
+// Makefile's fuel=on option does. Other builds ignore the limit.
+void obaSetFuel(ObaVM* vm, long long fuel);
+
+// Returns the fuel [vm] has left, or -1 if it has no limit.
+long long obaGetFuel(ObaVM* vm);
+
+// Continues running the code that last ran out of fuel in [vm], after the host
+// has given it more with [obaSetFuel], and returns how it ended, which may be
+// running out of fuel again.
+//
+// Running another script or calling another function abandons the code that
+// ran out of fuel.
+ObaInterpretResult obaResume(ObaVM* vm);
+
+// Saves the heap of [vm] to the file at [path] as a snapshot: the variables of
+// the last script it ran, and every module, function and value they refer to.
+//
+// Returns false if [vm] has not run a script or the file cannot be written.
+bool obaSaveSnapshot(ObaVM* vm, const char* path);
+
+// Restores the heap saved to [path] by [obaSaveSnapshot] into [vm], a VM that
+// was created with the same builtins and has not loaded a snapshot yet. Every
+// script that [vm] runs afterwards starts with the saved variables, so it can
+// use modules the snapshot imported without importing them again.
+//
+// Returns false if the file cannot be read, or was saved by a build of Oba with
+// a different layout.
+bool obaLoadSnapshot(ObaVM* vm, const char* path);
+
+// Slots ----------------------------------------------------------------------
+
+// The host and natives exchange values with the VM through slots, which are
+// values on the VM's stack numbered from 0. Slots are read and written in
+// place, so values are never converted to or from source text.
+//
+// A native's slots are its arguments, from 1, and its result, in slot 0. When
+// the VM is not running, they are the arguments and result of [obaCall].
+
+// The types of value a slot can hold.
+typedef enum {
+  OBA_TYPE_NIL,
+  OBA_TYPE_BOOL,
+  OBA_TYPE_NUMBER,
+  OBA_TYPE_STRING,
+
+  // A function, module or other value the host cannot read.
+  OBA_TYPE_UNKNOWN
+} ObaType;
+
+// Makes sure there are at least [count] slots. New slots hold nil.
+//
+// Returns false if the stack has no room for them.
+bool obaEnsureSlots(ObaVM* vm, int count);
+
+// Returns the number of slots.
+int obaGetSlotCount(ObaVM* vm);
+
+// Returns the type of the value in [slot].
+ObaType obaGetSlotType(ObaVM* vm, int slot);
+
+// Stores nil in [slot].
+void obaSetSlotNil(ObaVM* vm, int slot);
+
+// Stores [value] in [slot].
+void obaSetSlotBool(ObaVM* vm, int slot, bool value);
+
+// Returns the bool in [slot], which must hold a bool.
+bool obaGetSlotBool(ObaVM* vm, int slot);
+
+// Stores [value] in [slot].
+void obaSetSlotNumber(ObaVM* vm, int slot, double value);
+
+// Copies the value in slot [from] to [slot].
+void obaCopySlot(ObaVM* vm, int slot, int from);
+
+// Returns the number in [slot], which must hold a number.
+double obaGetSlotNumber(ObaVM* vm, int slot);
+
+// Stores a new string in [slot] holding the [length] bytes at [chars], which
+// may contain null bytes. The bytes are copied once, into the string.
+void obaSetSlotString(ObaVM* vm, int slot, const char* chars, size_t length);
+
+// Returns the characters of the string in [slot], which must hold a string,
+// and stores their number in [length] unless it is NULL.
+//
+// The characters are not copied. They belong to the VM, are followed by a null
+// byte, and must not be modified.
+const char* obaGetSlotString(ObaVM* vm, int slot, size_t* length);
+
+// Calling Oba functions from C -----------------------------------------------
+
+// Returns a handle to the function [name] defined in [module], or NULL if
+// there is none. [module] is the name a module was imported by, or "main" for
+// the script [vm] ran last.
+//
+// The function is looked up once, so calling it through the handle costs no
+// more than a call from Oba code. The handle calls the same function even if
+// the variable is later redefined or its module is reloaded.
+ObaHandle* obaGetFunction(ObaVM* vm, const char* module, const char* name);
+
+// Frees [handle]. Handles that are not released are freed along with the VM.
+void obaReleaseHandle(ObaVM* vm, ObaHandle* handle);
+
+// Calls the function [handle] refers to with the arguments in slots 1 to its
+// arity, and stores its result in slot 0. The slots after the arguments are
+// discarded.
+//
+// Like [obaCallSlot], this can be called by natives. A native's own arguments
+// are then replaced by the function's.
+ObaInterpretResult obaCall(ObaVM* vm, ObaHandle* handle);
+
+// Calls the function in [slot] with the [argCount] values in the slots after
+// it as arguments, and stores its result in [slot]. The slots after [slot] are
+// discarded.
+//
+// Natives call functions they are passed this way, so a native loop can call
+// back into Oba code, which can in turn call natives. Every such call shares
+// the VM's stack. If a call fails with a runtime error, every call in progress
+// fails along with it, so a native that sees an error must return at once,
+// without using its slots. [obaInterpret] and the functions like it must not
+// be called by natives.
+ObaInterpretResult obaCallSlot(ObaVM* vm, int slot, int argCount);
+
+// Reports a runtime error with [message] from a native. The script stops when
+// the native returns, as if the error happened in Oba code, so the native must
+// return at once, without using its slots.
+void obaRuntimeError(ObaVM* vm, const char* message);
+
+// Event loop -----------------------------------------------------------------
+
+// An event loop lets one thread run many scripts that spend most of their time
+// waiting, such as for input or in sleep. A VM attached to a loop does not
+// block when one of those natives is called from Oba code. Instead, the code
+// is suspended and the script or [obaCall] running it returns
+// [OBA_RESULT_WAITING]. The loop resumes it once what it waits for is ready.
+//
+// Only code that could be resumed is suspended, like code that runs out of
+// fuel. Natives called by functions that a native called block as usual.
+//
+// The loop and the VMs attached to it must only be used by one thread, and
+// the loop is Linux only, since it is built on epoll and timerfd.
+
+// Creates an event loop, or returns NULL if it cannot be created.
+ObaEventLoop* obaNewEventLoop(void);
+
+// Frees [loop]. VMs still waiting on it are detached from it, and stay
+// suspended until the host runs other code in them or resumes them with
+// [obaResume], which ends their waits early: sleeping returns at once, and
+// reading input returns nil. Other VMs attached to [loop] must be detached
+// before they run code again.
+void obaFreeEventLoop(ObaEventLoop* loop);
+
+// Attaches [vm] to [loop], or detaches it if [loop] is NULL. Must not be called
+// while [vm] is waiting.
+void obaSetEventLoop(ObaVM* vm, ObaEventLoop* loop);
+
+// Waits until one of the VMs waiting on [loop] can continue, resumes it, and
+// returns it. How its code ended is stored in [result], which is
+// [OBA_RESULT_WAITING] again if it is waiting for something else.
+//
+// Returns NULL if no VM is waiting on [loop].
+ObaVM* obaRunEventLoop(ObaEventLoop* loop, ObaInterpretResult* result);
+
+// Scheduler ------------------------------------------------------------------
+
+// A scheduler runs scripts, called tasks, on a fixed set of threads, so that
+// thousands of them can be run at once without a thread for each. Every task
+// runs in a VM of its own, created when it starts and freed when it finishes,
+// so tasks share nothing but their compiled code, as if by [obaSetSharedCode].
+//
+// Each thread runs the tasks it spawned, and takes tasks from the others once
+// it has none left, so a task may start on one thread and continue on another.
+// A task that joins another is suspended until the other finishes, and its
+// thread runs other tasks meanwhile. Builds with OBA_FUEL defined also suspend
+// a task after every ten thousand calls and loop iterations, so that a long
+// task does not hold up the ones queued behind it.
+
+// Creates a scheduler that runs tasks on [threads] threads, in VMs created
+// with [builtins]. The threads are started when the first task is spawned. If
+// [threads] is 0, tasks only run on the threads that join them.
+ObaScheduler* obaNewScheduler(int threads, Builtin* builtins,
+                              int builtinsLength);
+
+// Frees [scheduler] and stops its threads, once every task spawned on it has
+// finished. The calling thread runs tasks until then.
+void obaFreeScheduler(ObaScheduler* scheduler);
+
+// Lets the code [vm] runs spawn tasks on [scheduler] through the task module,
+// or stops it from spawning tasks if [scheduler] is NULL. Tasks can always
+// spawn more tasks on their own scheduler.
+void obaSetScheduler(ObaVM* vm, ObaScheduler* scheduler);
+
+// Queues [source] to run as a task on [scheduler], and returns the task, which
+// must be passed to [obaJoin].
+ObaTask* obaSpawn(ObaScheduler* scheduler, const char* source);
+
+// Waits for [task] to finish, running other tasks on the calling thread until
+// it has, then frees it and returns how its script ended.
+ObaInterpretResult obaJoin(ObaScheduler* scheduler, ObaTask* task);
+
+// Channels -------------------------------------------------------------------
+
+// A channel passes values between VMs, such as the stages of a pipeline of
+// tasks, through the channel module. Any number of VMs can send on a channel,
+// but only the first VM to receive from it can receive. Freeing that VM closes
+// the channel, and sending on it or receiving from it is then a runtime error,
+// including for the VMs already waiting to send.
+//
+// Strings are passed without copying their characters, which the sending and
+// receiving VMs share. Nil, booleans and numbers are copied, and channels are
+// passed by reference. Other values cannot be sent.
+
+// Creates a channel that holds up to [capacity] values, which must be from 1
+// to 1048576, or returns NULL if it is not. The host holds a reference to the
+// channel, which it drops with [obaReleaseChannel].
+ObaChannel* obaNewChannel(int capacity);
+
+// Drops a reference to [channel], which is freed along with the values in it
+// once no host or VM holds one.
+void obaReleaseChannel(ObaChannel* channel);
+
+// Stores a handle to [channel] in [slot], which holds a reference of its own,
+// so a VM can be given a channel as the argument or result of a call.
+void obaSetSlotChannel(ObaVM* vm, int slot, ObaChannel* channel);
+
 #endif
@@ -1,5 +1,8 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/sysinfo.h>
 
 #include <oba.h>
 
@@ -80,12 +83,85 @@ static char* readFile(const char* filename) {
   return buffer;
 }
 
-static void runFile(const char* filename) {
-  char* source = readFile(filename);
+// Returns the file at [filename] if it is a pipe or some other stream whose
+// size is not known up front, which is the case for "-", standard input.
+// Returns NULL if it is a regular file.
+static FILE* openStream(const char* filename) {
+  if (strcmp(filename, "-") == 0)
+    return stdin;
+
+  FILE* file = fopen(filename, "rb");
+  if (file == NULL) {
+    fprintf(stderr, "Could not open file \"%s\".\n", filename);
+    exit(EXIT_IO_ERROR);
+  }
+
+  struct stat info;
+  if (fstat(fileno(file), &info) == 0 && S_ISREG(info.st_mode)) {
+    fclose(file);
+    return NULL;
+  }
+  return file;
+}
+
+static size_t readStream(void* userData, char* buffer, size_t size) {
+  return fread(buffer, sizeof(char), size, (FILE*)userData);
+}
+
+// Runs the file at [filename].
+//
+// Streams are compiled as they are read, so that generated scripts can be piped
+// in without being held in memory all at once. Other files are read in full,
+// and their bytecode is cached.
+//
+// If [loadSnapshot] is not NULL, the VM starts from the heap saved there. If
+// [saveSnapshot] is not NULL, the heap is saved there once the file has run.
+static void runFile(const char* filename, const char* loadSnapshot,
+                    const char* saveSnapshot) {
+  FILE* stream = openStream(filename);
+  char* source = stream == NULL ? readFile(filename) : NULL;
   ObaVM* vm = obaNewVM(NULL, 0);
-  ObaInterpretResult result = interpret(vm, source);
-  free(source);
+  if (loadSnapshot != NULL && !obaLoadSnapshot(vm, loadSnapshot)) {
+    fprintf(stderr, "Could not load snapshot \"%s\".\n", loadSnapshot);
+    exit(EXIT_IO_ERROR);
+  }
+
+  // Input is read by the event loop, which bypasses stdin's buffer, so a
+  // script read from standard input reads the rest of it through stdio.
+  ObaEventLoop* loop = stream != stdin ? obaNewEventLoop() : NULL;
+  obaSetEventLoop(vm, loop);
+
+  // Tasks run on a thread for each core, which are only started once the
+  // script spawns one.
+  ObaScheduler* scheduler = obaNewScheduler(get_nprocs(), NULL, 0);
+  obaSetScheduler(vm, scheduler);
+
+  ObaInterpretResult result;
+  if (stream != NULL) {
+    result = obaInterpretStream(vm, readStream, stream);
+    if (ferror(stream)) {
+      fprintf(stderr, "Could not read file \"%s\".\n", filename);
+      exit(EXIT_IO_ERROR);
+    }
+    if (stream != stdin)
+      fclose(stream);
+  } else {
+    result = obaInterpretCached(vm, source);
+    free(source);
+  }
+  while (result == OBA_RESULT_WAITING) {
+    obaRunEventLoop(loop, &result);
+  }
+
+  if (result == OBA_RESULT_SUCCESS && saveSnapshot != NULL &&
+      !obaSaveSnapshot(vm, saveSnapshot)) {
+    fprintf(stderr, "Could not save snapshot \"%s\".\n", saveSnapshot);
+    exit(EXIT_IO_ERROR);
+  }
   obaFreeVM(vm);
+  obaFreeScheduler(scheduler);
+  if (loop != NULL)
+    obaFreeEventLoop(loop);
 
   if (result == OBA_RESULT_COMPILE_ERROR)
     exit(EXIT_COMPILE_ERROR);
@@ -93,14 +169,33 @@ static void runFile(const char* filename) {
     exit(EXIT_RUNTIME_ERROR);
 }
 
+static void usage(void) {
+  fprintf(stderr, "Usage: oba [path | -]\n");
+  fprintf(stderr, "       oba [--snapshot file] [--save-snapshot file] path\n");
+  exit(EXIT_FAILURE);
+}
+
 int main(int argc, char** argv) {
-  if (argc == 1) {
+  const char* loadSnapshot = NULL;
+  const char* saveSnapshot = NULL;
+
+  int arg = 1;
+  for (; arg + 1 < argc; arg += 2) {
+    if (strcmp(argv[arg], "--snapshot") == 0) {
+      loadSnapshot = argv[arg + 1];
+    } else if (strcmp(argv[arg], "--save-snapshot") == 0) {
+      saveSnapshot = argv[arg + 1];
+    } else {
+      break;
+    }
+  }
+
+  if (arg == argc && loadSnapshot == NULL && saveSnapshot == NULL) {
     repl();
-  } else if (argc == 2) {
-    runFile(argv[1]);
+  } else if (arg + 1 == argc) {
+    runFile(argv[arg], loadSnapshot, saveSnapshot);
   } else {
-    fprintf(stderr, "Usage: oba [path]\n");
-    exit(EXIT_FAILURE);
+    usage();
   }
   return EXIT_SUCCESS;
 }
@@ -1,61 +1,225 @@
 #ifndef oba_builtin_h
 #define oba_builtin_h
 
+#include <errno.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdio.h>
 #include <time.h>
 #include <unistd.h>
 
 #include "oba.h"
 #include "oba_value.h"
+#include "oba_vm.h"
 
-// TODO(kendal): Support error reporting in natives.
+static void sleepNative(ObaVM* vm, int argc) {
+  // Assume argc == 1
+  double seconds = obaGetSlotNumber(vm, 1);
+  obaSetSlotNumber(vm, 0, 0);
+  if (!(seconds > 0) || waitForTimer(vm, seconds))
+    return;
 
-Value sleepNative(ObaVM* vm, int argc, Value* argv) {
-  // Assume argc == 1 and argv != NULL
-  Value seconds = argv[0];
-  unsigned int remaining = (unsigned int)AS_NUMBER(seconds);
-  while (remaining > 0)
-    remaining = sleep(remaining);
-  return OBA_NUMBER(0);
+  struct timespec remaining;
+  remaining.tv_sec = (time_t)seconds;
+  remaining.tv_nsec = (long)((seconds - (double)remaining.tv_sec) * 1e9);
+  while (nanosleep(&remaining, &remaining) == -1 && errno == EINTR)
+    ;
 }
 
-Value nowNative(ObaVM* vm, int argc, Value* argv) {
-  return OBA_NUMBER((double)clock() / CLOCKS_PER_SEC);
+// The time that time::now counts from, which is when the process created its
+// first VM.
+static struct timespec startTime;
+static pthread_once_t startTimeOnce = PTHREAD_ONCE_INIT;
+
+static void readStartTime(void) { clock_gettime(CLOCK_MONOTONIC, &startTime); }
+
+static void nowNative(ObaVM* vm, int argc) {
+  // Elapsed rather than processor time, so that it keeps counting while a task
+  // waits or moves to another thread.
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  obaSetSlotNumber(vm, 0,
+                   (double)(now.tv_sec - startTime.tv_sec) +
+                       (double)(now.tv_nsec - startTime.tv_nsec) / 1e9);
 }
 
-Value readByteNative(ObaVM* vm, int argc, Value* argv) {
+static void readByteNative(ObaVM* vm, int argc) {
+  if (waitForInput(vm, false))
+    return;
+
   int c;
   if ((c = getchar()) == EOF) {
-    return NIL_VAL;
+    return;
   }
   const char byte = (const char)c;
-  return OBJ_VAL(copyString(vm, &byte, 1));
+  obaSetSlotString(vm, 0, &byte, 1);
 }
 
-Value readLineNative(ObaVM* vm, int argc, Value* argv) {
+static void readLineNative(ObaVM* vm, int argc) {
+  if (waitForInput(vm, true))
+    return;
+
   char* line = NULL;
-  size_t length;
-  if (getline(&line, &length, stdin) == -1) {
-    return NIL_VAL;
+  size_t capacity;
+  ssize_t length = getline(&line, &capacity, stdin);
+  if (length == -1) {
+    free(line);
+    return;
     // TODO: if (feof(stdin)) { /* nil */ }  else { /* error */ }
   }
-  Value value = OBJ_VAL(copyString(vm, line, length));
+  obaSetSlotString(vm, 0, line, (size_t)length);
   free(line);
-  return value;
 }
 
-Value printNative(ObaVM* vm, int argc, Value* argv) {
-  // Assume argc == 1 and argv != NULL
-  printValue(argv[0]);
+static void printNative(ObaVM* vm, int argc) {
+  // Assume argc == 1
+  // Hold the lock so that lines printed by VMs on other threads do not
+  // interleave with this one.
+  flockfile(stdout);
+  printValue(vm->apiStack[1]);
   printf("\n");
-  return NIL_VAL;
+  funlockfile(stdout);
+}
+
+static void fiberNewNative(ObaVM* vm, int argc) {
+  // Assume argc == 1
+  Value function = vm->apiStack[1];
+  if (!IS_CLOSURE(function) || AS_CLOSURE(function)->function->arity > 1) {
+    obaRuntimeError(vm, "Expected a function that takes at most one argument");
+    return;
+  }
+  vm->apiStack[0] = OBJ_VAL(newFiber(vm, AS_CLOSURE(function)));
+}
+
+static void fiberResumeNative(ObaVM* vm, int argc) {
+  // Assume argc == 2
+  Value fiber = vm->apiStack[1];
+  if (!IS_FIBER(fiber)) {
+    obaRuntimeError(vm, "Expected a fiber");
+    return;
+  }
+  // The result is whatever the fiber yields or returns.
+  resumeFiber(vm, AS_FIBER(fiber), vm->apiStack[2]);
+}
+
+static void fiberYieldNative(ObaVM* vm, int argc) {
+  // Assume argc == 1
+  // The result is whatever the fiber is next resumed with.
+  yieldFiber(vm, vm->apiStack[1]);
+}
+
+static void fiberDoneNative(ObaVM* vm, int argc) {
+  // Assume argc == 1
+  Value fiber = vm->apiStack[1];
+  if (!IS_FIBER(fiber)) {
+    obaRuntimeError(vm, "Expected a fiber");
+    return;
+  }
+  obaSetSlotBool(vm, 0, isFiberDone(vm, AS_FIBER(fiber)));
+}
+
+// Spawns the script in slot 1 as a task with [argument], which it takes over.
+static void spawn(ObaVM* vm, Message argument) {
+  Value source = vm->apiStack[1];
+  if (!IS_STRING(source)) {
+    freeMessage(&argument);
+    obaRuntimeError(vm, "Expected the source of a script");
+    return;
+  }
+  ObjTask* task = spawnTask(vm, AS_CSTRING(source), argument);
+  if (task == NULL) {
+    obaRuntimeError(vm, "Tasks cannot be spawned without a scheduler");
+    return;
+  }
+  vm->apiStack[0] = OBJ_VAL(task);
+}
+
+static void taskSpawnNative(ObaVM* vm, int argc) {
+  // Assume argc == 1
+  Message argument;
+  argument.type = MESSAGE_NIL;
+  spawn(vm, argument);
+}
+
+static void taskSpawnWithNative(ObaVM* vm, int argc) {
+  // Assume argc == 2
+  Message argument;
+  if (!newMessage(vm->apiStack[2], &argument)) {
+    obaRuntimeError(vm, "Only nil, booleans, numbers, strings and channels can "
+                        "be sent");
+    return;
+  }
+  spawn(vm, argument);
+}
+
+static void taskArgumentNative(ObaVM* vm, int argc) {
+  // Assume argc == 0
+  vm->apiStack[0] = taskArgument(vm);
+}
+
+static void taskJoinNative(ObaVM* vm, int argc) {
+  // Assume argc == 1
+  Value task = vm->apiStack[1];
+  if (!IS_TASK(task)) {
+    obaRuntimeError(vm, "Expected a task");
+    return;
+  }
+  joinTask(vm, AS_TASK(task)->task);
+}
+
+static void channelNewNative(ObaVM* vm, int argc) {
+  // Assume argc == 1
+  Value value = vm->apiStack[1];
+  double capacity = IS_NUMBER(value) ? AS_NUMBER(value) : 0;
+  ObaChannel* channel = NULL;
+  if (capacity >= 1 && capacity <= INT_MAX && capacity == (int)capacity) {
+    channel = obaNewChannel((int)capacity);
+  }
+  if (channel == NULL) {
+    obaRuntimeError(vm, "Expected a capacity from 1 to 1048576");
+    return;
+  }
+  obaSetSlotChannel(vm, 0, channel);
+  obaReleaseChannel(channel);
+}
+
+static void channelSendNative(ObaVM* vm, int argc) {
+  // Assume argc == 2
+  Value channel = vm->apiStack[1];
+  if (!IS_CHANNEL(channel)) {
+    obaRuntimeError(vm, "Expected a channel");
+    return;
+  }
+  sendMessage(vm, AS_CHANNEL(channel)->channel, vm->apiStack[2]);
+}
+
+static void channelReceiveNative(ObaVM* vm, int argc) {
+  // Assume argc == 1
+  Value channel = vm->apiStack[1];
+  if (!IS_CHANNEL(channel)) {
+    obaRuntimeError(vm, "Expected a channel");
+    return;
+  }
+  receiveMessage(vm, AS_CHANNEL(channel)->channel);
 }
 
-Builtin __builtins__[] = {
+static const Builtin __builtins__[] = {
     {"__native_sleep", &sleepNative},
     {"__native_now", &nowNative},
     {"__native_read_byte", &readByteNative},
     {"__native_read_line", &readLineNative},
     {"__native_print", &printNative},
+    {"__native_fiber_new", &fiberNewNative},
+    {"__native_fiber_resume", &fiberResumeNative},
+    {"__native_fiber_yield", &fiberYieldNative},
+    {"__native_fiber_done", &fiberDoneNative},
+    {"__native_task_spawn", &taskSpawnNative},
+    {"__native_task_join", &taskJoinNative},
+    {"__native_task_spawn_with", &taskSpawnWithNative},
+    {"__native_task_argument", &taskArgumentNative},
+    {"__native_channel_new", &channelNewNative},
+    {"__native_channel_send", &channelSendNative},
+    {"__native_channel_receive", &channelReceiveNative},
     {NULL, NULL}, // Sentinel to mark the end of the array.
 };
 
@@ -0,0 +1,590 @@
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "oba_bytecode.h"
+#include "oba_common.h"
+#include "oba_compiler.h"
+#include "oba_debug.h"
+#include "oba_vm.h"
+
+// Identifies a serialized module.
+static const uint8_t MAGIC[4] = {'O', 'B', 'A', 'C'};
+
+// The number of instructions in the instruction set, which must match.
+#define OPCODE_COUNT (OP_EXIT + 1)
+
+// The build options, which the compile cache keeps apart. The peephole
+// optimizations change the code the compiler emits, debug builds verify every
+// function they compile, and each of the others changes how the code is run.
+#ifdef OBA_PEEPHOLE
+#define PEEPHOLE_NAME "peephole"
+#else
+#define PEEPHOLE_NAME "plain"
+#endif
+
+#ifdef OBA_COMPUTED_GOTO
+#define COMPUTED_GOTO_NAME " computed-goto"
+#else
+#define COMPUTED_GOTO_NAME ""
+#endif
+
+#ifdef OBA_FUEL
+#define FUEL_NAME " fuel"
+#else
+#define FUEL_NAME ""
+#endif
+
+#ifdef DEBUG_MODE
+#define DEBUG_NAME " debug"
+#else
+#define DEBUG_NAME ""
+#endif
+
+#ifdef DEBUG_TRACE_EXECUTION
+#define TRACE_NAME " trace"
+#else
+#define TRACE_NAME ""
+#endif
+
+#define BUILD_NAME                                                             \
+  PEEPHOLE_NAME COMPUTED_GOTO_NAME FUEL_NAME DEBUG_NAME TRACE_NAME
+
+// The largest length of a string constant or code array.
+#define MAX_SERIALIZED_LENGTH (1 << 30)
+
+// The kind of each serialized constant.
+typedef enum {
+  CONSTANT_NIL,
+  CONSTANT_FALSE,
+  CONSTANT_TRUE,
+  CONSTANT_NUMBER,
+  CONSTANT_STRING,
+  CONSTANT_FUNCTION,
+} ConstantTag;
+
+// Buffers ---------------------------------------------------------------------
+
+void initByteBuffer(ByteBuffer* buffer) {
+  buffer->bytes = NULL;
+  buffer->count = 0;
+  buffer->capacity = 0;
+}
+
+void freeByteBuffer(ByteBuffer* buffer) {
+  FREE_ARRAY(uint8_t, buffer->bytes, buffer->capacity);
+  initByteBuffer(buffer);
+}
+
+void writeBytes(ByteBuffer* buffer, const void* bytes, size_t length) {
+  if (length == 0)
+    return;
+
+  if (buffer->capacity < buffer->count + length) {
+    size_t oldCap = buffer->capacity;
+    size_t newCap = GROW_CAPACITY(oldCap);
+    while (newCap < buffer->count + length) {
+      newCap *= 2;
+    }
+    buffer->bytes = GROW_ARRAY(uint8_t, buffer->bytes, oldCap, newCap);
+    buffer->capacity = newCap;
+  }
+
+  memcpy(buffer->bytes + buffer->count, bytes, length);
+  buffer->count += length;
+}
+
+static void writeByte(ByteBuffer* buffer, uint8_t byte) {
+  writeBytes(buffer, &byte, 1);
+}
+
+static void writeUint32(ByteBuffer* buffer, uint32_t value) {
+  for (int i = 0; i < 4; i++) {
+    writeByte(buffer, (value >> (8 * i)) & 0xff);
+  }
+}
+
+static void writeUint64(ByteBuffer* buffer, uint64_t value) {
+  for (int i = 0; i < 8; i++) {
+    writeByte(buffer, (value >> (8 * i)) & 0xff);
+  }
+}
+
+// Writing ---------------------------------------------------------------------
+
+static void writeString(ByteBuffer* buffer, ObjString* string) {
+  writeUint32(buffer, string->length);
+  writeBytes(buffer, string->chars, string->length + 1);
+}
+
+static void writeFunction(ByteBuffer* buffer, ObjFunction* function);
+
+static void writeConstant(ByteBuffer* buffer, Value value) {
+  switch (value.type) {
+  case VAL_NIL:
+    writeByte(buffer, CONSTANT_NIL);
+    return;
+  case VAL_BOOL:
+    writeByte(buffer, AS_BOOL(value) ? CONSTANT_TRUE : CONSTANT_FALSE);
+    return;
+  case VAL_NUMBER: {
+    uint64_t bits;
+    double number = AS_NUMBER(value);
+    memcpy(&bits, &number, sizeof(bits));
+    writeByte(buffer, CONSTANT_NUMBER);
+    writeUint64(buffer, bits);
+    return;
+  }
+  case VAL_OBJ:
+    break;
+  }
+
+  // The compiler only creates constants for strings and functions.
+  if (IS_STRING(value)) {
+    writeByte(buffer, CONSTANT_STRING);
+    writeString(buffer, AS_STRING(value));
+  } else {
+    ASSERT(IS_FUNCTION(value), "Constant should be a string or function");
+    writeByte(buffer, CONSTANT_FUNCTION);
+    writeFunction(buffer, AS_FUNCTION(value));
+  }
+}
+
+static void writeFunction(ByteBuffer* buffer, ObjFunction* function) {
+  // Only the top-level function of a module has no name.
+  writeByte(buffer, function->name != NULL);
+  if (function->name != NULL) {
+    writeString(buffer, function->name);
+  }
+
+  writeUint32(buffer, function->arity);
+
+  // A function that has not been compiled yet is stored as its source.
+  writeByte(buffer, function->source != NULL);
+  if (function->source != NULL) {
+    writeString(buffer, function->source);
+    writeUint32(buffer, function->line);
+    return;
+  }
+
+  writeUint32(buffer, function->upvalueCount);
+  writeUint32(buffer, function->maxSlots);
+
+  // Upvalue descriptors are operands of OP_CLOSURE, so they are part of the
+  // code.
+  Chunk* chunk = &function->chunk;
+  writeUint32(buffer, chunk->count);
+  writeBytes(buffer, chunk->code, chunk->count);
+
+  writeUint32(buffer, chunk->constants.count);
+  for (int i = 0; i < chunk->constants.count; i++) {
+    writeConstant(buffer, chunk->constants.values[i]);
+  }
+}
+
+void serializeModule(ByteBuffer* buffer, ObjFunction* function) {
+  writeBytes(buffer, MAGIC, sizeof(MAGIC));
+  writeUint32(buffer, BYTECODE_VERSION);
+  writeUint32(buffer, OPCODE_COUNT);
+  writeFunction(buffer, function);
+}
+
+unsigned char* obaCompileModule(ObaVM* vm, const char* name,
+                                const char* source, size_t* length) {
+  ObjModule* module = newModule(vm, copyString(vm, name, (int)strlen(name)));
+
+  // The module is not run by [vm], so the modules it imports are not
+  // prefetched.
+  ValueArray imports = vm->imports;
+  initValueArray(&vm->imports);
+  ObjFunction* function = obaCompile(vm, module, source);
+  freeValueArray(&vm->imports);
+  vm->imports = imports;
+  if (function == NULL)
+    return NULL;
+
+  // The buffer's bytes are allocated with realloc, so the host can free them.
+  ByteBuffer buffer;
+  initByteBuffer(&buffer);
+  serializeModule(&buffer, function);
+  *length = buffer.count;
+  return buffer.bytes;
+}
+
+// Reading ---------------------------------------------------------------------
+
+typedef struct {
+  ObaVM* vm;
+
+  // The module that the functions being read belong to.
+  ObjModule* module;
+
+  // Whether code and strings point into [bytes] instead of being copied.
+  bool inPlace;
+
+  const uint8_t* bytes;
+  size_t length;
+
+  // The offset of the next unread byte.
+  size_t offset;
+
+  // Whether the bytes turned out to be invalid.
+  bool hasError;
+} Reader;
+
+// Returns a pointer to the next [length] bytes, or NULL if there are not that
+// many left.
+static const uint8_t* readBytes(Reader* reader, size_t length) {
+  if (reader->hasError || reader->length - reader->offset < length) {
+    reader->hasError = true;
+    return NULL;
+  }
+
+  const uint8_t* bytes = reader->bytes + reader->offset;
+  reader->offset += length;
+  return bytes;
+}
+
+static uint8_t readByte(Reader* reader) {
+  const uint8_t* bytes = readBytes(reader, 1);
+  return bytes == NULL ? 0 : bytes[0];
+}
+
+static uint32_t readUint32(Reader* reader) {
+  const uint8_t* bytes = readBytes(reader, 4);
+  if (bytes == NULL)
+    return 0;
+
+  uint32_t value = 0;
+  for (int i = 0; i < 4; i++) {
+    value |= (uint32_t)bytes[i] << (8 * i);
+  }
+  return value;
+}
+
+static uint64_t readUint64(Reader* reader) {
+  const uint8_t* bytes = readBytes(reader, 8);
+  if (bytes == NULL)
+    return 0;
+
+  uint64_t value = 0;
+  for (int i = 0; i < 8; i++) {
+    value |= (uint64_t)bytes[i] << (8 * i);
+  }
+  return value;
+}
+
+// Reads a length, which must be at most [max].
+static int readLength(Reader* reader, uint32_t max) {
+  uint32_t length = readUint32(reader);
+  if (length > max) {
+    reader->hasError = true;
+    return 0;
+  }
+  return (int)length;
+}
+
+static ObjString* readString(Reader* reader) {
+  int length = readLength(reader, MAX_SERIALIZED_LENGTH);
+  const uint8_t* chars = readBytes(reader, length + 1);
+  if (chars == NULL || chars[length] != '\0') {
+    reader->hasError = true;
+    return NULL;
+  }
+
+  if (reader->inPlace) {
+    return borrowString(reader->vm, (const char*)chars, length);
+  }
+  return copyString(reader->vm, (const char*)chars, length);
+}
+
+static ObjFunction* readFunction(Reader* reader);
+
+static Value readConstant(Reader* reader) {
+  switch ((ConstantTag)readByte(reader)) {
+  case CONSTANT_NIL:
+    return NIL_VAL;
+  case CONSTANT_FALSE:
+    return OBA_BOOL(false);
+  case CONSTANT_TRUE:
+    return OBA_BOOL(true);
+  case CONSTANT_NUMBER: {
+    uint64_t bits = readUint64(reader);
+    double number;
+    memcpy(&number, &bits, sizeof(number));
+    return OBA_NUMBER(number);
+  }
+  case CONSTANT_STRING: {
+    ObjString* string = readString(reader);
+    return string == NULL ? NIL_VAL : OBJ_VAL(string);
+  }
+  case CONSTANT_FUNCTION: {
+    ObjFunction* function = readFunction(reader);
+    return function == NULL ? NIL_VAL : OBJ_VAL(function);
+  }
+  }
+
+  reader->hasError = true;
+  return NIL_VAL;
+}
+
+static ObjFunction* readFunction(Reader* reader) {
+  ObjFunction* function = newFunction(reader->vm, reader->module);
+  if (readByte(reader)) {
+    function->name = readString(reader);
+  }
+
+  function->arity = readLength(reader, UINT8_MAX);
+
+  // The body of a lazy function is compiled by the compiler, so it needs no
+  // verifying.
+  if (readByte(reader)) {
+    function->source = readString(reader);
+    function->line = readLength(reader, MAX_SERIALIZED_LENGTH);
+    if (function->source == NULL || function->name == NULL) {
+      reader->hasError = true;
+      return NULL;
+    }
+    return function;
+  }
+
+  function->upvalueCount = readLength(reader, UINT8_MAX);
+  function->maxSlots = readLength(reader, STACK_MAX);
+
+  Chunk* chunk = &function->chunk;
+  int codeLength = readLength(reader, MAX_SERIALIZED_LENGTH);
+  const uint8_t* code = readBytes(reader, codeLength);
+  if (code == NULL)
+    return NULL;
+
+  if (reader->inPlace) {
+    borrowChunkCode(chunk, code, codeLength);
+  } else {
+    chunk->code = ALLOCATE(uint8_t, codeLength);
+    chunk->count = codeLength;
+    chunk->capacity = codeLength;
+    memcpy(chunk->code, code, codeLength);
+  }
+
+  int constantCount = readLength(reader, UINT8_MAX + 1);
+  for (int i = 0; i < constantCount && !reader->hasError; i++) {
+    writeValueArray(&chunk->constants, readConstant(reader));
+  }
+  if (reader->hasError)
+    return NULL;
+
+  // Never run code that could read or jump outside of its frame.
+  if (verifyFunction(function) != NULL) {
+    reader->hasError = true;
+    return NULL;
+  }
+  return function;
+}
+
+ObjFunction* deserializeModule(ObaVM* vm, ObjModule* module,
+                               const uint8_t* bytes, size_t length,
+                               bool inPlace) {
+  Reader reader;
+  reader.vm = vm;
+  reader.module = module;
+  reader.inPlace = inPlace;
+  reader.bytes = bytes;
+  reader.length = length;
+  reader.offset = 0;
+  reader.hasError = false;
+
+  const uint8_t* magic = readBytes(&reader, sizeof(MAGIC));
+  if (magic == NULL || memcmp(magic, MAGIC, sizeof(MAGIC)) != 0 ||
+      readUint32(&reader) != BYTECODE_VERSION ||
+      readUint32(&reader) != OPCODE_COUNT) {
+    return NULL;
+  }
+
+  ObjFunction* function = readFunction(&reader);
+  if (reader.hasError || reader.offset != reader.length) {
+    return NULL;
+  }
+  return function;
+}
+
+// Compile cache ---------------------------------------------------------------
+
+// The longest path of a file in the compile cache.
+#define MAX_CACHE_PATH 4096
+
+uint64_t hashBytes(uint64_t hash, const void* bytes, size_t length) {
+  const uint8_t* data = (const uint8_t*)bytes;
+  for (size_t i = 0; i < length; i++) {
+    hash ^= data[i];
+    hash *= 1099511628211u;
+  }
+  return hash;
+}
+
+// Writes the directory of the compile cache to [path].
+// Returns false if the cache is turned off.
+static bool cacheDirectory(char* path, size_t size) {
+  const char* dir = getenv("OBA_CACHE_DIR");
+  if (dir != NULL) {
+    if (dir[0] == '\0')
+      return false;
+    return snprintf(path, size, "%s", dir) < (int)size;
+  }
+
+  dir = getenv("XDG_CACHE_HOME");
+  if (dir != NULL && dir[0] != '\0') {
+    return snprintf(path, size, "%s/oba", dir) < (int)size;
+  }
+
+  dir = getenv("HOME");
+  if (dir != NULL && dir[0] != '\0') {
+    return snprintf(path, size, "%s/.cache/oba", dir) < (int)size;
+  }
+  return false;
+}
+
+// Writes the path of the cache file for [source] compiled in [module] to
+// [path]. Returns false if the cache is turned off.
+static bool cachePath(ObjModule* module, const char* source, char* path,
+                      size_t size) {
+  char dir[MAX_CACHE_PATH];
+  if (!cacheDirectory(dir, sizeof(dir)))
+    return false;
+
+  // Function names include the module name, so it is part of the key. So are
+  // the build options.
+  uint32_t version = BYTECODE_VERSION;
+  uint64_t key = FNV_OFFSET_BASIS;
+  key = hashBytes(key, &version, sizeof(version));
+  key = hashBytes(key, BUILD_NAME, sizeof(BUILD_NAME));
+  key = hashBytes(key, module->name->chars, module->name->length + 1);
+  key = hashBytes(key, source, strlen(source));
+
+  return snprintf(path, size, "%s/%016llx.obc", dir, (unsigned long long)key) <
+         (int)size;
+}
+
+// Creates the directory containing [path] and any missing parents.
+static bool makeParentDirectories(const char* path) {
+  char dir[MAX_CACHE_PATH];
+  snprintf(dir, sizeof(dir), "%s", path);
+
+  for (char* c = dir + 1; *c != '\0'; c++) {
+    if (*c != '/')
+      continue;
+    *c = '\0';
+    if (mkdir(dir, 0755) != 0 && errno != EEXIST)
+      return false;
+    *c = '/';
+  }
+  return true;
+}
+
+// Maps the file at [path] read-only, and keeps it mapped until [vm] is freed.
+// Returns NULL if it cannot be mapped.
+static MappedImage* mapCacheFile(ObaVM* vm, const char* path) {
+  int fd = open(path, O_RDONLY);
+  if (fd < 0)
+    return NULL;
+
+  struct stat info;
+  void* bytes = MAP_FAILED;
+  if (fstat(fd, &info) == 0 && info.st_size > 0) {
+    bytes = mmap(NULL, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  }
+
+  // The mapping stays valid after the file is closed.
+  close(fd);
+  if (bytes == MAP_FAILED)
+    return NULL;
+
+  MappedImage* image = ALLOCATE(MappedImage, 1);
+  image->bytes = bytes;
+  image->length = info.st_size;
+  image->next = vm->images;
+  vm->images = image;
+  return image;
+}
+
+void unmapImages(ObaVM* vm) {
+  MappedImage* image = vm->images;
+  while (image != NULL) {
+    MappedImage* next = image->next;
+    munmap((void*)image->bytes, image->length);
+    FREE(MappedImage, image);
+    image = next;
+  }
+  vm->images = NULL;
+}
+
+// Writes [buffer] to the file at [path].
+//
+// The bytes are written to a temporary file which is then renamed, so that
+// other processes never see a partially written module. Every writer gets a
+// temporary file of its own, since VMs on other threads of the same process
+// may be caching the same module.
+static void writeCacheFile(const char* path, ByteBuffer* buffer) {
+  if (!makeParentDirectories(path))
+    return;
+
+  char temp[MAX_CACHE_PATH];
+  if (snprintf(temp, sizeof(temp), "%s.XXXXXX", path) >= (int)sizeof(temp))
+    return;
+
+  int fd = mkstemp(temp);
+  if (fd == -1)
+    return;
+  fchmod(fd, 0644);
+  FILE* file = fdopen(fd, "wb");
+  if (file == NULL) {
+    close(fd);
+    remove(temp);
+    return;
+  }
+
+  bool ok = fwrite(buffer->bytes, 1, buffer->count, file) == buffer->count;
+  ok = fclose(file) == 0 && ok;
+  if (!ok || rename(temp, path) != 0) {
+    remove(temp);
+  }
+}
+
+ObjFunction* compileCached(ObaVM* vm, ObjModule* module, const char* source) {
+  if (vm->sharedCode != NULL) {
+    ObjFunction* function = loadSharedModule(vm, module, source);
+    if (function != NULL)
+      return function;
+  }
+
+  char path[MAX_CACHE_PATH];
+  if (!cachePath(module, source, path, sizeof(path))) {
+    return obaCompile(vm, module, source);
+  }
+
+  // Even if the image turns out to be invalid, it stays mapped because objects
+  // read before the problem was found may point into it.
+  MappedImage* image = mapCacheFile(vm, path);
+  if (image != NULL) {
+    ObjFunction* function =
+        deserializeModule(vm, module, image->bytes, image->length, true);
+    if (function != NULL)
+      return function;
+  }
+
+  // Recompile if the cached module is missing, or was written by a different
+  // version of the VM.
+  ObjFunction* function = obaCompile(vm, module, source);
+  if (function != NULL) {
+    ByteBuffer buffer;
+    initByteBuffer(&buffer);
+    serializeModule(&buffer, function);
+    writeCacheFile(path, &buffer);
+    freeByteBuffer(&buffer);
+  }
+  return function;
+}
@@ -0,0 +1,90 @@
+#ifndef oba_bytecode_h
+#define oba_bytecode_h
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "oba_function.h"
+
+// The serialized form of a compiled module.
+//
+// A module is stored as a header followed by its top-level function. Each
+// function is stored with its name, arity, upvalue count, maximum stack depth,
+// code and constants. Functions nested in it are stored in place of the
+// constants that refer to them. Functions that have not been compiled yet are
+// stored as their source instead of their code. All integers are
+// little-endian.
+//
+// Code and the characters of strings are stored exactly as the VM uses them,
+// with a null byte after each string, so a module can run in place from a
+// read-only mapping of the file.
+//
+// Bump BYTECODE_VERSION whenever this layout or the meaning of any instruction
+// changes, so that older serialized modules are ignored instead of misread.
+#define BYTECODE_VERSION 3
+
+// A serialized module mapped into memory, which must stay mapped for as long as
+// the VM that loaded it.
+typedef struct MappedImage {
+  const uint8_t* bytes;
+  size_t length;
+  struct MappedImage* next;
+} MappedImage;
+
+// A growable buffer of serialized bytecode.
+typedef struct {
+  uint8_t* bytes;
+  size_t count;
+  size_t capacity;
+} ByteBuffer;
+
+void initByteBuffer(ByteBuffer*);
+void freeByteBuffer(ByteBuffer*);
+
+// Appends [length] [bytes] to [buffer].
+void writeBytes(ByteBuffer* buffer, const void* bytes, size_t length);
+
+// The hash of no bytes, where [hashBytes] starts.
+#define FNV_OFFSET_BASIS 14695981039346656037u
+
+// Returns a 64-bit FNV-1a hash of [length] [bytes], continuing from [hash].
+uint64_t hashBytes(uint64_t hash, const void* bytes, size_t length);
+
+// Appends the serialized form of [function], a module's top-level function, to
+// [buffer].
+void serializeModule(ByteBuffer* buffer, ObjFunction* function);
+
+// Reads a module's top-level function from the [length] [bytes] written by
+// [serializeModule], allocating it and everything it refers to in [vm].
+//
+// If [inPlace] is true, the code of each function and the characters of each
+// string constant are not copied, and point into [bytes] instead. The bytes
+// must then stay unchanged until the VM is freed.
+//
+// Every function is checked by the bytecode verifier. Returns NULL if the bytes
+// are not a valid module for this version of the VM.
+ObjFunction* deserializeModule(ObaVM* vm, ObjModule* module,
+                               const uint8_t* bytes, size_t length,
+                               bool inPlace);
+
+// Unmaps every image mapped by [compileCached] for [vm].
+void unmapImages(ObaVM* vm);
+
+// Compiles [source] as the body of [module], like [obaCompile].
+//
+// If an earlier run already compiled the same source for a module with the
+// same name, its serialized bytecode is mapped from the compile cache and run
+// in place instead. Processes running the same module share its pages.
+// Otherwise the result is added to the cache.
+//
+// The cache lives in $OBA_CACHE_DIR if it is set, $XDG_CACHE_HOME/oba or
+// $HOME/.cache/oba otherwise. Setting OBA_CACHE_DIR to an empty string turns
+// the cache off. Failing to read or write the cache is never an error. Builds
+// with different options keep their code apart.
+//
+// If [vm] shares code with other VMs, the module is only compiled by the first
+// of them to load it.
+ObjFunction* compileCached(ObaVM* vm, ObjModule* module, const char* source);
+
+#endif
@@ -0,0 +1,474 @@
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+
+#include "oba.h"
+#include "oba_channel.h"
+#include "oba_common.h"
+#include "oba_vm.h"
+
+// The most messages a channel can hold.
+#define MAX_CAPACITY (1 << 20)
+
+// The error for sending on, or receiving from, a channel that is closed.
+#define CLOSED_ERROR "The VM that received from the channel has been freed"
+
+// Keeps the position senders write from sharing a cache line with the one the
+// receiver writes.
+#define CACHE_LINE_SIZE 64
+
+// A place in a channel's queue.
+//
+// A slot whose [sequence] is twice a position in the queue is free for the
+// message at that position, and holds the message once [sequence] is one more.
+// Taking the message frees the slot for the message a lap of the queue later.
+// Doubling positions keeps a full slot from looking free for the next lap's
+// message, which in a channel that holds one message is the very next one.
+typedef struct {
+  atomic_size_t sequence;
+  Message message;
+} Slot;
+
+struct ObaChannel {
+  Slot* slots;
+  size_t capacity;
+
+  // The position of the next message sent, and of the next one received.
+  // Senders claim positions from [tail], while only the receiver moves
+  // [head].
+  char padding[CACHE_LINE_SIZE];
+  atomic_size_t tail;
+  char tailPadding[CACHE_LINE_SIZE];
+  atomic_size_t head;
+
+  // The VM that receives from the channel, once one has, and whether that VM
+  // has been freed, which closes the channel.
+  _Atomic(ObaVM*) receiver;
+  atomic_bool closed;
+
+  // Guards [parked], and is held while waiting on [ready].
+  pthread_mutex_t lock;
+
+  // Signaled when a message is sent or received, if [waiting] counts a VM that
+  // waits for the channel to have room or a message.
+  pthread_cond_t ready;
+  atomic_int waiting;
+
+  // The tasks suspended until the channel has room or a message.
+  ObaTask** parked;
+  int parkedCount;
+  int parkedCapacity;
+
+  // Each handle to the channel, and each message holding it, holds a
+  // reference, as does the host for each channel it creates.
+  atomic_int refCount;
+};
+
+// Queue -----------------------------------------------------------------------
+
+// Adds [message] to [channel]'s queue, or returns false if it is full.
+static bool enqueue(ObaChannel* channel, Message* message) {
+  size_t position = atomic_load_explicit(&channel->tail, memory_order_relaxed);
+  Slot* slot;
+  for (;;) {
+    slot = &channel->slots[position % channel->capacity];
+    size_t sequence =
+        atomic_load_explicit(&slot->sequence, memory_order_acquire);
+    intptr_t difference = (intptr_t)sequence - (intptr_t)(position * 2);
+    if (difference < 0)
+      return false;
+
+    // Another sender claimed the position first, so try the next one.
+    if (difference > 0) {
+      position = atomic_load_explicit(&channel->tail, memory_order_relaxed);
+      continue;
+    }
+    if (atomic_compare_exchange_weak_explicit(&channel->tail, &position,
+                                              position + 1,
+                                              memory_order_relaxed,
+                                              memory_order_relaxed)) {
+      break;
+    }
+  }
+
+  slot->message = *message;
+  atomic_store_explicit(&slot->sequence, position * 2 + 1,
+                        memory_order_release);
+  return true;
+}
+
+// Takes the oldest message from [channel]'s queue into [message], or returns
+// false if it is empty. Only called by the channel's receiver.
+static bool dequeue(ObaChannel* channel, Message* message) {
+  size_t position = atomic_load_explicit(&channel->head, memory_order_relaxed);
+  Slot* slot = &channel->slots[position % channel->capacity];
+  if (atomic_load_explicit(&slot->sequence, memory_order_acquire) !=
+      position * 2 + 1) {
+    return false;
+  }
+
+  *message = slot->message;
+  atomic_store_explicit(&slot->sequence, (position + channel->capacity) * 2,
+                        memory_order_release);
+  atomic_store_explicit(&channel->head, position + 1, memory_order_relaxed);
+  return true;
+}
+
+// Whether [channel] has room for a message, if [sending] is true, or has a
+// message to receive otherwise. A closed channel is always ready for a send,
+// which fails rather than waiting for room that will never come.
+static bool isReady(ObaChannel* channel, bool sending) {
+  if (sending && atomic_load(&channel->closed))
+    return true;
+
+  size_t position = atomic_load(sending ? &channel->tail : &channel->head);
+  Slot* slot = &channel->slots[position % channel->capacity];
+  size_t sequence = atomic_load(&slot->sequence);
+  if (sending)
+    return (intptr_t)sequence - (intptr_t)(position * 2) >= 0;
+  return sequence == position * 2 + 1;
+}
+
+// Waiting ---------------------------------------------------------------------
+
+// Wakes every VM waiting on [channel], after a message was sent or received.
+//
+// A VM only waits once it has counted itself in [waiting] and then seen that
+// the channel is not ready, so either it sees the message just sent or
+// received, or it is counted and woken.
+static void wakeWaiting(ObaChannel* channel) {
+  atomic_thread_fence(memory_order_seq_cst);
+  if (atomic_load(&channel->waiting) == 0)
+    return;
+
+  pthread_mutex_lock(&channel->lock);
+  ObaTask** parked = channel->parked;
+  int parkedCount = channel->parkedCount;
+  int parkedCapacity = channel->parkedCapacity;
+  channel->parked = NULL;
+  channel->parkedCount = 0;
+  channel->parkedCapacity = 0;
+  atomic_fetch_sub(&channel->waiting, parkedCount);
+  pthread_cond_broadcast(&channel->ready);
+  pthread_mutex_unlock(&channel->lock);
+
+  // Woken tasks that still cannot go on suspend again, so every one is woken
+  // rather than guessing which can.
+  for (int i = 0; i < parkedCount; i++) {
+    wakeTask(parked[i]);
+  }
+  FREE_ARRAY(ObaTask*, parked, parkedCapacity);
+}
+
+static bool trySend(ObaChannel* channel, Message* message) {
+  if (!enqueue(channel, message))
+    return false;
+  wakeWaiting(channel);
+  return true;
+}
+
+static bool tryReceive(ObaChannel* channel, Message* message) {
+  if (!dequeue(channel, message))
+    return false;
+  wakeWaiting(channel);
+  return true;
+}
+
+// Blocks the calling thread until [channel] is ready for [vm] to send on, if
+// [sending] is true, or receive from otherwise, or until it may be.
+static void waitUntilReady(ObaVM* vm, ObaChannel* channel, bool sending) {
+  // The thread may be the only one free to run the task that would make the
+  // channel ready.
+  if (vm->scheduler != NULL && runQueuedTask(vm->scheduler))
+    return;
+
+  pthread_mutex_lock(&channel->lock);
+  atomic_fetch_add(&channel->waiting, 1);
+  atomic_thread_fence(memory_order_seq_cst);
+  if (!isReady(channel, sending)) {
+    pthread_cond_wait(&channel->ready, &channel->lock);
+  }
+  atomic_fetch_sub(&channel->waiting, 1);
+  pthread_mutex_unlock(&channel->lock);
+}
+
+// Starts waiting for [channel] to be ready for [vm] to send [message] on, or
+// receive from if [sending] is false, once its native returns.
+static void suspendOn(ObaVM* vm, ObaChannel* channel, bool sending,
+                      Message* message) {
+  vm->channel = channel;
+  vm->sending = sending;
+  vm->message = *message;
+}
+
+void waitForChannel(ObaTask* task, ObaVM* vm) {
+  ObaChannel* channel = vm->channel;
+  pthread_mutex_lock(&channel->lock);
+  atomic_fetch_add(&channel->waiting, 1);
+  atomic_thread_fence(memory_order_seq_cst);
+  bool ready = isReady(channel, vm->sending);
+  if (ready) {
+    atomic_fetch_sub(&channel->waiting, 1);
+  } else {
+    if (channel->parkedCount + 1 > channel->parkedCapacity) {
+      int oldCapacity = channel->parkedCapacity;
+      channel->parkedCapacity = GROW_CAPACITY(oldCapacity);
+      channel->parked = GROW_ARRAY(ObaTask*, channel->parked, oldCapacity,
+                                   channel->parkedCapacity);
+    }
+    channel->parked[channel->parkedCount++] = task;
+  }
+  pthread_mutex_unlock(&channel->lock);
+
+  if (ready) {
+    wakeTask(task);
+  }
+}
+
+bool retryChannel(ObaVM* vm) {
+  ObaChannel* channel = vm->channel;
+  if (vm->sending && atomic_load(&channel->closed)) {
+    obaRuntimeError(vm, CLOSED_ERROR);
+    return true;
+  }
+
+  Value result = NIL_VAL;
+  if (vm->sending) {
+    if (!trySend(channel, &vm->message))
+      return false;
+  } else {
+    Message message;
+    if (!tryReceive(channel, &message))
+      return false;
+    result = messageValue(vm, &message);
+    freeMessage(&message);
+  }
+
+  vm->channel = NULL;
+  setSuspendedResult(vm, result);
+  return true;
+}
+
+void cancelChannel(ObaVM* vm) {
+  if (vm->sending) {
+    freeMessage(&vm->message);
+  }
+  vm->channel = NULL;
+}
+
+// Messages --------------------------------------------------------------------
+
+bool newMessage(Value value, Message* message) {
+  switch (value.type) {
+  case VAL_NIL:
+    message->type = MESSAGE_NIL;
+    return true;
+  case VAL_BOOL:
+    message->type = MESSAGE_BOOL;
+    message->as.boolean = AS_BOOL(value);
+    return true;
+  case VAL_NUMBER:
+    message->type = MESSAGE_NUMBER;
+    message->as.number = AS_NUMBER(value);
+    return true;
+  default:
+    break;
+  }
+
+  if (IS_STRING(value)) {
+    message->type = MESSAGE_STRING;
+    message->as.string = shareChars(AS_STRING(value));
+    message->hash = AS_STRING(value)->hash;
+    return true;
+  }
+  if (IS_CHANNEL(value)) {
+    message->type = MESSAGE_CHANNEL;
+    message->as.channel = AS_CHANNEL(value)->channel;
+    atomic_fetch_add(&message->as.channel->refCount, 1);
+    return true;
+  }
+  return false;
+}
+
+Value messageValue(ObaVM* vm, Message* message) {
+  switch (message->type) {
+  case MESSAGE_NIL:
+    return NIL_VAL;
+  case MESSAGE_BOOL:
+    return OBA_BOOL(message->as.boolean);
+  case MESSAGE_NUMBER:
+    return OBA_NUMBER(message->as.number);
+  case MESSAGE_STRING:
+    return OBJ_VAL(newSharedString(vm, message->as.string, message->hash));
+  case MESSAGE_CHANNEL:
+    return OBJ_VAL(newChannelHandle(vm, message->as.channel));
+  }
+  return NIL_VAL;
+}
+
+void freeMessage(Message* message) {
+  if (message->type == MESSAGE_STRING) {
+    releaseChars(message->as.string);
+  } else if (message->type == MESSAGE_CHANNEL) {
+    obaReleaseChannel(message->as.channel);
+  }
+  message->type = MESSAGE_NIL;
+}
+
+// Sending and receiving -------------------------------------------------------
+
+ObjChannel* newChannelHandle(ObaVM* vm, ObaChannel* channel) {
+  ObjChannel* handle = ALLOCATE_OBJ(vm, ObjChannel, OBJ_CHANNEL);
+  handle->channel = channel;
+  atomic_fetch_add(&channel->refCount, 1);
+  return handle;
+}
+
+void sendMessage(ObaVM* vm, ObaChannel* channel, Value value) {
+  if (atomic_load(&channel->closed)) {
+    obaRuntimeError(vm, CLOSED_ERROR);
+    return;
+  }
+
+  Message message;
+  if (!newMessage(value, &message)) {
+    obaRuntimeError(vm,
+                    "Only nil, booleans, numbers, strings and channels can be "
+                    "sent");
+    return;
+  }
+
+  vm->apiStack[0] = NIL_VAL;
+  if (trySend(channel, &message))
+    return;
+
+  // Nothing but the receiver can make room, and it is waiting for this send.
+  if (atomic_load(&channel->receiver) == vm) {
+    freeMessage(&message);
+    obaRuntimeError(vm, "The channel is full, and only this VM receives from "
+                        "it");
+    return;
+  }
+
+  // Only a task's VM is resumed once the channel is ready, like a join.
+  if (vm->task != NULL && canSuspend(vm)) {
+    suspendOn(vm, channel, true, &message);
+    return;
+  }
+
+  while (!trySend(channel, &message)) {
+    if (atomic_load(&channel->closed)) {
+      freeMessage(&message);
+      obaRuntimeError(vm, CLOSED_ERROR);
+      return;
+    }
+    waitUntilReady(vm, channel, true);
+  }
+}
+
+// Records that [vm] receives from [channel], so that freeing [vm] closes it.
+static void startReceiving(ObaVM* vm, ObaChannel* channel) {
+  if (vm->receivingCount + 1 > vm->receivingCapacity) {
+    int oldCapacity = vm->receivingCapacity;
+    vm->receivingCapacity = GROW_CAPACITY(oldCapacity);
+    vm->receiving = GROW_ARRAY(ObaChannel*, vm->receiving, oldCapacity,
+                               vm->receivingCapacity);
+  }
+  vm->receiving[vm->receivingCount++] = channel;
+  atomic_fetch_add(&channel->refCount, 1);
+}
+
+void receiveMessage(ObaVM* vm, ObaChannel* channel) {
+  if (atomic_load(&channel->closed)) {
+    obaRuntimeError(vm, CLOSED_ERROR);
+    return;
+  }
+
+  ObaVM* receiver = atomic_load(&channel->receiver);
+  if (receiver == NULL &&
+      atomic_compare_exchange_strong(&channel->receiver, &receiver, vm)) {
+    receiver = vm;
+    startReceiving(vm, channel);
+  }
+  if (receiver != vm) {
+    obaRuntimeError(vm, "Only one VM can receive from a channel");
+    return;
+  }
+
+  Message message;
+  if (!tryReceive(channel, &message)) {
+    if (vm->task != NULL && canSuspend(vm)) {
+      message.type = MESSAGE_NIL;
+      suspendOn(vm, channel, false, &message);
+      return;
+    }
+
+    while (!tryReceive(channel, &message)) {
+      waitUntilReady(vm, channel, false);
+    }
+  }
+
+  vm->apiStack[0] = messageValue(vm, &message);
+  freeMessage(&message);
+}
+
+void stopReceiving(ObaVM* vm) {
+  for (int i = 0; i < vm->receivingCount; i++) {
+    // Nothing can receive what is sent from now on, so senders waiting for
+    // room are woken to fail.
+    ObaChannel* channel = vm->receiving[i];
+    atomic_store(&channel->receiver, NULL);
+    atomic_store(&channel->closed, true);
+    wakeWaiting(channel);
+    obaReleaseChannel(channel);
+  }
+  FREE_ARRAY(ObaChannel*, vm->receiving, vm->receivingCapacity);
+  vm->receiving = NULL;
+  vm->receivingCount = 0;
+  vm->receivingCapacity = 0;
+}
+
+// Channels --------------------------------------------------------------------
+
+ObaChannel* obaNewChannel(int capacity) {
+  if (capacity < 1 || capacity > MAX_CAPACITY)
+    return NULL;
+
+  ObaChannel* channel = ALLOCATE(ObaChannel, 1);
+  channel->capacity = (size_t)capacity;
+  channel->slots = ALLOCATE(Slot, capacity);
+  for (int i = 0; i < capacity; i++) {
+    atomic_init(&channel->slots[i].sequence, (size_t)i * 2);
+    channel->slots[i].message.type = MESSAGE_NIL;
+  }
+  atomic_init(&channel->tail, 0);
+  atomic_init(&channel->head, 0);
+  atomic_init(&channel->receiver, NULL);
+  atomic_init(&channel->closed, false);
+  pthread_mutex_init(&channel->lock, NULL);
+  pthread_cond_init(&channel->ready, NULL);
+  atomic_init(&channel->waiting, 0);
+  channel->parked = NULL;
+  channel->parkedCount = 0;
+  channel->parkedCapacity = 0;
+  atomic_init(&channel->refCount, 1);
+  return channel;
+}
+
+void obaReleaseChannel(ObaChannel* channel) {
+  if (atomic_fetch_sub(&channel->refCount, 1) > 1)
+    return;
+
+  // No VM can receive the messages still in the channel.
+  Message message;
+  while (dequeue(channel, &message)) {
+    freeMessage(&message);
+  }
+
+  ASSERT(channel->parkedCount == 0, "No task should be waiting on the channel");
+  FREE_ARRAY(ObaTask*, channel->parked, channel->parkedCapacity);
+  FREE_ARRAY(Slot, channel->slots, channel->capacity);
+  pthread_mutex_destroy(&channel->lock);
+  pthread_cond_destroy(&channel->ready);
+  FREE(ObaChannel, channel);
+}
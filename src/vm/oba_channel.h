@@ -0,0 +1,109 @@
+#ifndef oba_channel_h
+#define oba_channel_h
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "oba.h"
+#include "oba_value.h"
+
+// Channels that pass values between VMs, which may run on different threads.
+//
+// A value sent on a channel is taken out of its VM as a [Message], which holds
+// nothing the VM owns. Nil, booleans and numbers are copied. Strings are never
+// changed once created, so a message holds a reference to their characters
+// rather than a copy, and the string the receiver gets shares them. Channels
+// are passed as references to the same channel. Nothing else can be sent.
+//
+// Any number of VMs can send on a channel, but only one receives from it, which
+// lets its messages be kept in a bounded queue that senders and the receiver
+// use without locking. Freeing that VM closes the channel, after which sending
+// on it or receiving from it is a runtime error. Only a VM that sends on a full channel, or receives from
+// an empty one, takes the channel's lock, to wait until it can. A task's VM is
+// suspended, like a task that joins another, and its thread runs other tasks
+// meanwhile. Other code blocks, running the tasks of its VM's scheduler if it
+// has one.
+//
+// See: http://www.1024cores.net/home/lock-free-algorithms/queues/bounded-mpmc-queue
+
+typedef enum {
+  MESSAGE_NIL,
+  MESSAGE_BOOL,
+  MESSAGE_NUMBER,
+  MESSAGE_STRING,
+  MESSAGE_CHANNEL,
+} MessageType;
+
+// A value on its way from one VM to another.
+typedef struct {
+  MessageType type;
+  union {
+    bool boolean;
+    double number;
+    SharedChars* string;
+    ObaChannel* channel;
+  } as;
+
+  // The hash of a [MESSAGE_STRING].
+  uint32_t hash;
+} Message;
+
+// A channel's handle in a VM that created it or was sent it.
+typedef struct {
+  Obj obj;
+  ObaChannel* channel;
+} ObjChannel;
+
+// Creates a handle in [vm] holding a new reference to [channel].
+ObjChannel* newChannelHandle(ObaVM* vm, ObaChannel* channel);
+
+// Stores [value] in [message] as a message holding references to what it
+// shares with [value].
+//
+// Returns false if [value] cannot be sent.
+bool newMessage(Value value, Message* message);
+
+// Returns a value in [vm] with the contents of [message], which keeps its
+// references.
+Value messageValue(ObaVM* vm, Message* message);
+
+// Drops the references held by [message].
+void freeMessage(Message* message);
+
+// Sends [value] on [channel] from the running native of [vm], and stores nil in
+// slot 0. If the channel is full, the code that called the native is suspended
+// until the channel has room, if [vm] runs a task, or the native waits for
+// room otherwise.
+//
+// Reports a runtime error if [value] cannot be sent, if the channel is closed,
+// or if the channel is full and only [vm] could make room in it.
+void sendMessage(ObaVM* vm, ObaChannel* channel, Value value);
+
+// Receives a value from [channel] into slot 0, from the running native of [vm].
+// If the channel is empty, the code that called the native is suspended until
+// it is not, if [vm] runs a task, or the native waits for a value otherwise.
+//
+// Reports a runtime error if another VM has received from [channel], or if it
+// is closed.
+void receiveMessage(ObaVM* vm, ObaChannel* channel);
+
+// Finishes the send or receive [vm] is suspended in, and sets its result.
+//
+// Returns false if the channel still has no room, or no value, in which case
+// [vm] stays suspended. A send on a channel that has been closed meanwhile
+// reports a runtime error, which ends the suspended code.
+bool retryChannel(ObaVM* vm);
+
+// Queues [task] to run again once the channel its VM is suspended on has room,
+// or a value to receive, which may already be the case.
+void waitForChannel(ObaTask* task, ObaVM* vm);
+
+// Stops waiting on the channel [vm] is suspended on, because the code waiting
+// has been abandoned.
+void cancelChannel(ObaVM* vm);
+
+// Closes the channels [vm] receives from, once [vm] is being freed, and wakes
+// the VMs waiting to send on them.
+void stopReceiving(ObaVM* vm);
+
+#endif
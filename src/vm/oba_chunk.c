@@ -1,4 +1,5 @@
 #include <stdint.h>
+#include <stdio.h>
 #include <stdlib.h>
 
 #include "oba_chunk.h"
@@ -8,16 +9,28 @@ void initChunk(Chunk* chunk) {
   chunk->capacity = 0;
   chunk->count = 0;
   chunk->code = NULL;
+  chunk->ownsCode = true;
   initValueArray(&chunk->constants);
 }
 
 void freeChunk(Chunk* chunk) {
-  FREE_ARRAY(uint8_t, chunk->code, chunk->capacity);
+  if (chunk->ownsCode) {
+    FREE_ARRAY(uint8_t, chunk->code, chunk->capacity);
+  }
   freeValueArray(&chunk->constants);
   initChunk(chunk);
 }
 
+void borrowChunkCode(Chunk* chunk, const uint8_t* code, int count) {
+  ASSERT(chunk->code == NULL, "Chunk should be empty");
+  chunk->code = (uint8_t*)code;
+  chunk->count = count;
+  chunk->capacity = count;
+  chunk->ownsCode = false;
+}
+
 void writeChunk(Chunk* chunk, uint8_t byte) {
+  ASSERT(chunk->ownsCode, "Cannot write to borrowed code");
   if (chunk->capacity <= chunk->count) {
     int oldCap = chunk->capacity;
     chunk->capacity = GROW_CAPACITY(oldCap);
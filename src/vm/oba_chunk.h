@@ -10,6 +10,10 @@ typedef struct {
   int count;
   uint8_t* code;
   ValueArray constants;
+
+  // Whether [code] was allocated by this chunk. Code loaded in place from a
+  // mapped bytecode image is borrowed, and cannot be written or freed.
+  bool ownsCode;
 } Chunk;
 
 void initChunk(Chunk*);
@@ -17,6 +21,9 @@ void initChunk(Chunk*);
 // Frees the memory held by a [Chunk] previously allocate with [initChunk].
 void freeChunk(Chunk*);
 
+// Points [chunk] at [count] bytes of [code] owned by something else.
+void borrowChunkCode(Chunk* chunk, const uint8_t* code, int count);
+
 // Writes a byte to the given [Chunk], allocating if necessary.
 void writeChunk(Chunk*, uint8_t);
 
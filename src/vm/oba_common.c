@@ -1,7 +1,8 @@
 #include "oba_common.h"
 
 void* reallocate(void* pointer, size_t oldSize, size_t newSize) {
-  if (newSize == 0 && pointer != NULL) {
+  // realloc(NULL, 0) may allocate, and nothing would free what it returns.
+  if (newSize == 0) {
     free(pointer);
     return NULL;
   }
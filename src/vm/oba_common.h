@@ -5,6 +5,8 @@
 
 #ifdef DEBUG_MODE
 
+#include <stdio.h>
+
 // Assertions represent checks for bug in Oba's implementation.
 //
 // A failed assertion aborts execution immediately, so assertions should not be
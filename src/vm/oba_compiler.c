@@ -7,6 +7,7 @@
 
 #include "oba_common.h"
 #include "oba_compiler.h"
+#include "oba_debug.h"
 #include "oba_function.h"
 #include "oba_token.h"
 #include "oba_vm.h"
@@ -28,6 +29,24 @@
 // instruction.
 #define MAX_JUMP UINT16_MAX
 
+// The maximum size in bytes of a function body that is copied into its callers
+// rather than called.
+//
+// Keep this small. Inlining trades code size for the cost of a call frame,
+// which is only a good deal for trampolines and one-line helpers.
+#define MAX_INLINE_SIZE 32
+
+// The minimum size in bytes of the source of a module-level function whose
+// code is only kept once it is first called. Its module checks it for errors,
+// but drops the code.
+//
+// Smaller bodies have little code to save, and may be small enough to inline.
+#define MIN_LAZY_SIZE 256
+
+// The number of bytes of source asked for at a time when compiling from an
+// [ObaReadFn].
+#define SOURCE_CHUNK_SIZE 16384
+
 // The compiler's view of a local value that is captured by a closure.
 typedef struct {
   // The stack slot of this upvalue.
@@ -37,6 +56,35 @@ typedef struct {
   bool isLocal;
 } Upvalue;
 
+// A set of locals, identified by their stack slot.
+typedef struct {
+  uint64_t bits[(MAX_LOCALS + 63) / 64];
+} LocalSet;
+
+// What the compiler knows about the type of a value before it is computed.
+//
+// Types are inferred in a single pass, so the type of a local is only a guess
+// until the end of its scope: Any later assignment might store something other
+// than a number. Every inference records the locals it assumed were numbers, so
+// it can be undone if one of them turns out not to be.
+typedef struct {
+  // Whether the value is always a number.
+  bool isNumber;
+
+  // The locals that [isNumber] depends on.
+  LocalSet dependencies;
+} StaticType;
+
+// An unchecked numeric instruction, emitted on the assumption that some locals
+// only ever hold numbers.
+typedef struct {
+  // The offset of the instruction in the chunk.
+  int offset;
+
+  // The locals that were assumed to be numbers.
+  LocalSet dependencies;
+} NumericOp;
+
 // A value that lives on the stack.
 typedef struct {
   Token token;
@@ -44,8 +92,42 @@ typedef struct {
 
   // Whether this local is captured by an upvalue.
   bool isCaptured;
+
+  // The type of every value assigned to this local so far.
+  StaticType type;
 } Local;
 
+// A function declared at the top level of a module.
+//
+// Module-level functions cannot be reassigned or redeclared, so a call to one
+// by name always reaches the same function. Small functions are inlined into
+// their callers.
+typedef struct {
+  Token name;
+
+  // The compiled function, or NULL if it is not a candidate for inlining.
+  ObjFunction* function;
+
+  // The number of stack slots in use when the function returns, including its
+  // parameters and the return value on top.
+  int returnSlots;
+} ModuleFunction;
+
+// A piece of source read from an [ObaReadFn].
+//
+// Tokens never span chunks: the part of a token that has been lexed when the
+// end of a chunk is reached is copied to the start of the next one.
+typedef struct SourceChunk {
+  struct SourceChunk* next;
+
+  // The chunk's source, terminated by a null byte, which is [length] bytes
+  // long and starts with [prefix] bytes copied from the previous chunk.
+  char* chars;
+  int length;
+  int prefix;
+  int capacity;
+} SourceChunk;
+
 typedef struct {
   ObaVM* vm;
   Token current;
@@ -55,13 +137,31 @@ typedef struct {
   // Code is not executed if this is true.
   bool hasError;
 
+  // Whether the source is only being checked for errors, in which case no code
+  // is emitted and no functions are created.
+  bool checkOnly;
+
   const char* tokenStart;
   const char* currentChar;
   const char* source;
 
+  // The chunks of source read from [read] that are still in use, oldest first,
+  // and the one being lexed. Both are NULL if the source is a string.
+  SourceChunk* chunks;
+  SourceChunk* chunk;
+
+  // Reads the rest of the source, or NULL once all of it has been read.
+  ObaReadFn read;
+  void* readData;
+
   // The module being parsed.
   ObjModule* module;
 
+  // The functions declared at the top level of the module so far.
+  ModuleFunction* functions;
+  int functionCount;
+  int functionCapacity;
+
   int currentLine;
 } Parser;
 
@@ -75,18 +175,54 @@ typedef struct Compiler {
   int currentDepth;
   Parser* parser;
 
+  // The number of stack slots in use by the code being compiled, relative to
+  // the function's first local.
+  //
+  // Statements always leave the stack as they found it, so this is the same at
+  // a given instruction no matter how it is reached.
+  int numSlots;
+
+  // The number of if and while statements enclosing the code being compiled.
+  int branchDepth;
+
+  // The offsets of the last two instructions emitted, most recent first, or -1
+  // if there are none that can be rewritten.
+  int instructions[2];
+
+  // The highest offset that a jump may land on. Instructions before it cannot
+  // be combined with the ones after it.
+  int jumpTarget;
+
+  // The static type of each value on the stack, indexed by slot.
+  //
+  // The extra element stands in for slots past the end of the VM's stack.
+  StaticType slotTypes[STACK_MAX + 1];
+
+  // The unchecked numeric instructions emitted so far.
+  NumericOp* numericOps;
+  int numericOpCount;
+  int numericOpCapacity;
+
   // A pointer to the VM, used to store objects allocated during compilation.
   ObaVM* vm;
 } Compiler;
 
 void initCompiler(ObaVM* vm, Compiler* compiler, Parser* parser,
-                  Compiler* parent) {
+                  Compiler* parent, ObjFunction* function) {
   compiler->vm = vm;
   compiler->parent = parent;
   compiler->parser = parser;
   compiler->localCount = 0;
   compiler->currentDepth = 0;
-  compiler->function = newFunction(vm, parser->module);
+  compiler->numSlots = 0;
+  compiler->branchDepth = 0;
+  compiler->instructions[0] = -1;
+  compiler->instructions[1] = -1;
+  compiler->jumpTarget = 0;
+  compiler->numericOps = NULL;
+  compiler->numericOpCount = 0;
+  compiler->numericOpCapacity = 0;
+  compiler->function = function;
 }
 
 static void printError(Compiler* compiler, const char* label,
@@ -96,8 +232,10 @@ static void printError(Compiler* compiler, const char* label,
                        compiler->parser->module->name->chars,
                        compiler->parser->currentLine);
   length += vsprintf(message + length, format, args);
-  ASSERT(length > MAX_ERROR_SIZE, "Error message should not exceed buffer");
-  fprintf(stderr, "%s\n", message);
+  ASSERT(length < MAX_ERROR_SIZE, "Error message should not exceed buffer");
+  if (compiler->vm->reportCompileErrors) {
+    fprintf(stderr, "%s\n", message);
+  }
 }
 
 static void lexError(Compiler* compiler, const char* format, ...) {
@@ -124,6 +262,7 @@ static void error(Compiler* compiler, const char* format, ...) {
 
 // Forward declarations because the grammar is recursive.
 static void ignoreNewlines(Compiler*);
+static bool isExpressionStatement(Compiler*);
 static void statement(Compiler*);
 static void grouping(Compiler*, bool);
 static void unaryOp(Compiler*, bool);
@@ -134,23 +273,343 @@ static void literal(Compiler*, bool);
 static void string(Compiler*, bool);
 static void matchExpr(Compiler*, bool);
 static void declaration(Compiler*);
+static bool canInline(ObjFunction*, Token, int);
 
 ObjFunction* endCompiler(Compiler* compiler, const char* debugName,
                          int debugNameLength);
+static bool checkFunctionBody(ObaVM* vm, ObjFunction* function);
+
+// Types ----------------------------------------------------------------------
+
+static void addToSet(LocalSet* set, int slot) {
+  set->bits[slot / 64] |= (uint64_t)1 << (slot % 64);
+}
+
+static bool setContains(LocalSet* set, int slot) {
+  return (set->bits[slot / 64] >> (slot % 64)) & 1;
+}
+
+static void unionSets(LocalSet* dest, LocalSet* src) {
+  for (size_t i = 0; i < sizeof(dest->bits) / sizeof(dest->bits[0]); i++) {
+    dest->bits[i] |= src->bits[i];
+  }
+}
+
+static bool isEmptySet(LocalSet* set) {
+  for (size_t i = 0; i < sizeof(set->bits) / sizeof(set->bits[0]); i++) {
+    if (set->bits[i] != 0)
+      return false;
+  }
+  return true;
+}
+
+static StaticType unknownType(void) {
+  StaticType type;
+  memset(&type, 0, sizeof(type));
+  return type;
+}
+
+static StaticType numberType(void) {
+  StaticType type = unknownType();
+  type.isNumber = true;
+  return type;
+}
+
+// Returns the static type of the value in stack [slot].
+static StaticType* slotType(Compiler* compiler, int slot) {
+  if (slot < 0 || slot >= STACK_MAX) {
+    compiler->slotTypes[STACK_MAX] = unknownType();
+    return &compiler->slotTypes[STACK_MAX];
+  }
+  return &compiler->slotTypes[slot];
+}
+
+// Returns the static type of the value [lookahead] slots from the top of the
+// stack, where 1 is the top.
+static StaticType* peekType(Compiler* compiler, int lookahead) {
+  return slotType(compiler, compiler->numSlots - lookahead);
+}
+
+static void setTopType(Compiler* compiler, StaticType type) {
+  *peekType(compiler, 1) = type;
+}
+
+// Returns the checked form of the unchecked numeric instruction [op].
+static OpCode checkedOp(OpCode op) {
+  switch (op) {
+  case OP_ADD_NN:
+    return OP_ADD;
+  case OP_MINUS_NN:
+    return OP_MINUS;
+  case OP_MULTIPLY_NN:
+    return OP_MULTIPLY;
+  case OP_DIVIDE_NN:
+    return OP_DIVIDE;
+  case OP_GT_NN:
+    return OP_GT;
+  case OP_LT_NN:
+    return OP_LT;
+  case OP_GTE_NN:
+    return OP_GTE;
+  case OP_LTE_NN:
+    return OP_LTE;
+  default:
+    return op;
+  }
+}
+
+static void addNumericOp(Compiler* compiler, int offset,
+                         LocalSet dependencies) {
+  // There is no code to patch.
+  if (compiler->parser->checkOnly)
+    return;
+
+  if (compiler->numericOpCapacity <= compiler->numericOpCount) {
+    int oldCap = compiler->numericOpCapacity;
+    compiler->numericOpCapacity = GROW_CAPACITY(oldCap);
+    compiler->numericOps = GROW_ARRAY(NumericOp, compiler->numericOps, oldCap,
+                                      compiler->numericOpCapacity);
+  }
+
+  NumericOp* op = &compiler->numericOps[compiler->numericOpCount++];
+  op->offset = offset;
+  op->dependencies = dependencies;
+}
+
+// Records that the local in [slot] may hold something other than a number.
+//
+// Any unchecked instruction or other local whose type was inferred from this
+// one is reverted to its checked form.
+static void demoteLocal(Compiler* compiler, int slot) {
+  Local* local = &compiler->locals[slot];
+  if (!local->type.isNumber)
+    return;
+  local->type.isNumber = false;
+
+  Chunk* chunk = &compiler->function->chunk;
+  for (int i = 0; i < compiler->numericOpCount; i++) {
+    NumericOp* op = &compiler->numericOps[i];
+    if (setContains(&op->dependencies, slot)) {
+      chunk->code[op->offset] = checkedOp(chunk->code[op->offset]);
+    }
+  }
+
+  // Values computed from this local that are still on the stack, such as the
+  // left operand of an assignment's enclosing expression.
+  for (int i = 0; i < compiler->numSlots && i < STACK_MAX; i++) {
+    if (setContains(&compiler->slotTypes[i].dependencies, slot)) {
+      compiler->slotTypes[i].isNumber = false;
+    }
+  }
+
+  for (int i = 0; i < compiler->localCount; i++) {
+    if (setContains(&compiler->locals[i].type.dependencies, slot)) {
+      demoteLocal(compiler, i);
+    }
+  }
+}
 
 // Bytecode -------------------------------------------------------------------
 
 static void emitByte(Compiler* compiler, int byte) {
+  if (compiler->parser->checkOnly)
+    return;
   writeChunk(&compiler->function->chunk, byte);
 }
 
+// Adds [delta] to the number of stack slots in use, keeping track of the most
+// the function will need.
+static void adjustSlots(Compiler* compiler, int delta) {
+  compiler->numSlots += delta;
+  if (compiler->numSlots > compiler->function->maxSlots) {
+    compiler->function->maxSlots = compiler->numSlots;
+  }
+}
+
+// Returns true iff [op] leaves a new value on top of the stack.
+static bool producesValue(OpCode op) {
+  switch (op) {
+  case OP_POP:
+  case OP_DEBUG:
+  case OP_DEFINE_GLOBAL:
+  case OP_SET_LOCAL:
+  case OP_SET_UPVALUE:
+  case OP_CLOSE_UPVALUE:
+  case OP_ERROR:
+  case OP_JUMP:
+  case OP_JUMP_IF_FALSE:
+  case OP_JUMP_IF_TRUE:
+  case OP_JUMP_IF_NOT_MATCH:
+  case OP_LOOP:
+  case OP_FOR_LOOP:
+  case OP_RETURN:
+  case OP_END_MODULE:
+  case OP_EXIT:
+    return false;
+  default:
+    return true;
+  }
+}
+
 static void emitOp(Compiler* compiler, OpCode code) {
+  compiler->instructions[1] = compiler->instructions[0];
+  compiler->instructions[0] = compiler->function->chunk.count;
+
   emitByte(compiler, code);
+  adjustSlots(compiler, stackEffects[code]);
+
+  // Callers that know more about the new value update its type afterwards.
+  if (producesValue(code)) {
+    setTopType(compiler, unknownType());
+  }
+}
+
+// Emits a call to the function below the [argCount] arguments on the stack.
+static void emitCall(Compiler* compiler, uint8_t argCount) {
+  emitOp(compiler, OP_CALL);
+  emitByte(compiler, argCount);
+  // The function and its arguments are replaced by the return value.
+  adjustSlots(compiler, -argCount);
+  setTopType(compiler, unknownType());
+}
+
+// Fused forms ----------------------------------------------------------------
+
+#ifdef OBA_PEEPHOLE
+
+// Returns the fused form of the binary operator [op] that reads its right
+// operand from a local, or from a constant if [isConstant] is true.
+//
+// Returns [op] itself if it has no fused form.
+static OpCode fusedForm(OpCode op, bool isConstant) {
+  switch (op) {
+  case OP_ADD:
+    return isConstant ? OP_ADD_LK : OP_ADD_LL;
+  case OP_MINUS:
+    return isConstant ? OP_MINUS_LK : OP_MINUS_LL;
+  case OP_MULTIPLY:
+    return isConstant ? OP_MULTIPLY_LK : OP_MULTIPLY_LL;
+  case OP_DIVIDE:
+    return isConstant ? OP_DIVIDE_LK : OP_DIVIDE_LL;
+  case OP_GT:
+    return isConstant ? OP_GT_LK : OP_GT_LL;
+  case OP_LT:
+    return isConstant ? OP_LT_LK : OP_LT_LL;
+  case OP_GTE:
+    return isConstant ? OP_GTE_LK : OP_GTE_LL;
+  case OP_LTE:
+    return isConstant ? OP_LTE_LK : OP_LTE_LL;
+  default:
+    return op;
+  }
+}
+
+#endif
+
+// Tries to replace the two instructions that pushed the operands of [op] with a
+// single fused form of it.
+//
+// Returns true iff the fused form was emitted.
+static bool emitFusedOp(Compiler* compiler, OpCode op) {
+#ifdef OBA_PEEPHOLE
+  Chunk* chunk = &compiler->function->chunk;
+  int left = compiler->instructions[1];
+  int right = compiler->instructions[0];
+
+  // A jump to the right operand or to [op] would skip the left operand.
+  if (left < 0 || left < compiler->jumpTarget || right != left + 2 ||
+      chunk->count != right + 2 || chunk->code[left] != OP_GET_LOCAL) {
+    return false;
+  }
+
+  // The right operand is read after the left one is pushed, so it must not be
+  // the slot the left one was pushed into.
+  uint8_t a = chunk->code[left + 1];
+  uint8_t b = chunk->code[right + 1];
+  bool isConstant = chunk->code[right] == OP_CONSTANT;
+  if (!isConstant &&
+      (chunk->code[right] != OP_GET_LOCAL || b >= compiler->numSlots - 2)) {
+    return false;
+  }
+
+  OpCode fusedOp = fusedForm(op, isConstant);
+  if (fusedOp == op) {
+    return false;
+  }
+
+  chunk->count = left;
+  compiler->instructions[0] = -1;
+  adjustSlots(compiler, -2);
+  emitOp(compiler, fusedOp);
+  emitByte(compiler, a);
+  emitByte(compiler, b);
+  return true;
+#else
+  (void)compiler;
+  (void)op;
+  return false;
+#endif
+}
+
+// Emits an instruction that discards the value on top of the stack.
+//
+// If the value was just stored in a local, the two are combined when using the
+// fused forms.
+static void emitPop(Compiler* compiler) {
+#ifdef OBA_PEEPHOLE
+  Chunk* chunk = &compiler->function->chunk;
+  int last = compiler->instructions[0];
+  if (last >= 0 && last >= compiler->jumpTarget &&
+      chunk->count == last + 2 && chunk->code[last] == OP_SET_LOCAL &&
+      chunk->code[last + 1] < compiler->numSlots - 1) {
+    chunk->code[last] = OP_STORE_LOCAL;
+    adjustSlots(compiler, -1);
+    return;
+  }
+#endif
+  emitOp(compiler, OP_POP);
+}
+
+// Emits the binary operator [op], or its unchecked form [numericOp] if both
+// operands are known to be numbers.
+//
+// Returns true iff the result is known to be a number.
+static bool emitBinaryOp(Compiler* compiler, OpCode op, OpCode numericOp) {
+  StaticType* a = peekType(compiler, 2);
+  StaticType* b = peekType(compiler, 1);
+  bool isNumeric = a->isNumber && b->isNumber;
+
+  LocalSet dependencies = a->dependencies;
+  unionSets(&dependencies, &b->dependencies);
+
+  // The fused forms check their operands themselves, so there is nothing to
+  // patch if the operands turn out not to be numbers.
+  if (!emitFusedOp(compiler, op)) {
+    if (!isNumeric) {
+      emitOp(compiler, op);
+      return false;
+    }
+    if (!isEmptySet(&dependencies)) {
+      addNumericOp(compiler, compiler->function->chunk.count, dependencies);
+    }
+    emitOp(compiler, numericOp);
+  }
+
+  if (!isNumeric) {
+    return false;
+  }
+
+  StaticType result = numberType();
+  result.dependencies = dependencies;
+  setTopType(compiler, result);
+  return true;
 }
 
 // Adds [value] the the Vm's constant pool.
 // Returns the address of the new constant within the pool.
 static int addConstant(Compiler* compiler, Value value) {
+  if (compiler->parser->checkOnly)
+    return 0;
   writeValueArray(&compiler->function->chunk.constants, value);
   return compiler->function->chunk.constants.count - 1;
 }
@@ -164,6 +623,10 @@ static void emitConstant(Compiler* compiler, Value value) {
   int constant = addConstant(compiler, value);
   emitOp(compiler, OP_CONSTANT);
   emitByte(compiler, constant);
+
+  if (IS_NUMBER(value)) {
+    setTopType(compiler, numberType());
+  }
 }
 
 static void emitBool(Compiler* compiler, Value value) {
@@ -175,7 +638,7 @@ static void emitError(Compiler* compiler, const char* format, ...) {
   va_start(args, format);
   char message[MAX_ERROR_SIZE];
   int length = vsprintf(message, format, args);
-  ASSERT(length > MAX_ERROR_SIZE, "Error message should not exceed buffer");
+  ASSERT(length < MAX_ERROR_SIZE, "Error message should not exceed buffer");
 
   Value error = OBJ_VAL(copyString(compiler->vm, message, length));
   emitOp(compiler, OP_ERROR);
@@ -184,6 +647,8 @@ static void emitError(Compiler* compiler, const char* format, ...) {
 
 static void patchJump(Compiler* compiler, int offset) {
   Chunk* chunk = &compiler->function->chunk;
+  if (compiler->parser->checkOnly)
+    return;
 
   // -2 to account for the placeholder bytes.
   int jump = chunk->count - offset - 2;
@@ -194,6 +659,7 @@ static void patchJump(Compiler* compiler, int offset) {
 
   chunk->code[offset] = (jump >> 8) & 0xff;
   chunk->code[offset + 1] = jump & 0xff;
+  compiler->jumpTarget = chunk->count;
 }
 
 static int emitJump(Compiler* compiler, OpCode op) {
@@ -233,6 +699,7 @@ static void addLocal(Compiler* compiler, Token name) {
   local->token = name;
   local->depth = -1;
   local->isCaptured = false;
+  local->type = unknownType();
 }
 
 static int addUpvalue(Compiler* compiler, int slot, bool isLocal) {
@@ -248,12 +715,60 @@ static void markInitialized(Compiler* compiler) {
   // the most recent one.
   Local* local = &compiler->locals[compiler->localCount - 1];
   local->depth = compiler->currentDepth;
+
+  // The local's initial value is in its slot.
+  local->type = *slotType(compiler, compiler->localCount - 1);
 }
 
 static bool identifiersMatch(Token a, Token b) {
   return a.length == b.length && memcmp(a.start, b.start, a.length) == 0;
 }
 
+// Finds the function named [name] declared at the top level of the module.
+// Returns NULL if there is none.
+static ModuleFunction* findModuleFunction(Compiler* compiler, Token name) {
+  Parser* parser = compiler->parser;
+  for (int i = 0; i < parser->functionCount; i++) {
+    if (identifiersMatch(parser->functions[i].name, name)) {
+      return &parser->functions[i];
+    }
+  }
+  return NULL;
+}
+
+static void addModuleFunction(Compiler* compiler, Token name,
+                              ObjFunction* function, int returnSlots) {
+  Parser* parser = compiler->parser;
+  if (parser->functionCapacity <= parser->functionCount) {
+    int oldCap = parser->functionCapacity;
+    parser->functionCapacity = GROW_CAPACITY(oldCap);
+    parser->functions = GROW_ARRAY(ModuleFunction, parser->functions, oldCap,
+                                   parser->functionCapacity);
+  }
+
+  // The source that [name] points into may be freed before the module is
+  // compiled.
+  ObjString* copy = copyString(compiler->vm, name.start, name.length);
+
+  ModuleFunction* entry = &parser->functions[parser->functionCount++];
+  entry->name = name;
+  entry->name.start = copy->chars;
+  entry->function = function;
+  entry->returnSlots = returnSlots;
+}
+
+// Reports an error if [name] is being declared at the top level of the module
+// and a function by that name already exists there.
+static void checkRedeclaration(Compiler* compiler, Token name) {
+  if (compiler->currentDepth > 0 || compiler->parent != NULL)
+    return;
+
+  if (findModuleFunction(compiler, name) != NULL) {
+    error(compiler, "Cannot redeclare module-level function %.*s", name.length,
+          name.start);
+  }
+}
+
 static int declareVariable(Compiler* compiler, Token name) {
   if (compiler->currentDepth == 0) {
     return declareGlobal(
@@ -321,6 +836,8 @@ static int resolveUpvalue(Compiler* compiler, Token name) {
   int local = resolveLocal(compiler->parent, name);
   if (local >= 0) {
     compiler->parent->locals[local].isCaptured = true;
+    // Closures can assign anything to the local.
+    demoteLocal(compiler->parent, local);
     return addUpvalue(compiler, local, true);
   }
 
@@ -376,7 +893,7 @@ typedef struct {
 #define INFIX(prec, fn)            { NULL, fn, prec, NULL }
 #define INFIX_OPERATOR(prec, name) { NULL, infixOp, prec, name }
 
-GrammarRule rules[] =  {
+static const GrammarRule rules[] =  {
   /* TOK_NOT       */ PREFIX(unaryOp),
   /* TOK_ASSIGN    */ INFIX_OPERATOR(PREC_ASSIGN, "="),
   /* TOK_GT        */ INFIX_OPERATOR(PREC_COND, ">"),
@@ -397,6 +914,7 @@ GrammarRule rules[] =  {
   /* TOK_MULTIPLY  */ INFIX_OPERATOR(PREC_PRODUCT, "*"),
   /* TOK_DIVIDE    */ INFIX_OPERATOR(PREC_PRODUCT, "/"),
   /* TOK_MEMBER    */ INFIX(PREC_MEMBER, member),
+  /* TOK_RANGE     */ UNUSED,
   /* TOK_IDENT     */ PREFIX(identifier),
   /* TOK_NUMBER    */ PREFIX(literal),
   /* TOK_STRING    */ PREFIX(string),
@@ -408,6 +926,8 @@ GrammarRule rules[] =  {
   /* TOK_IF        */ UNUSED,  
   /* TOK_ELSE      */ UNUSED,  
   /* TOK_WHILE     */ UNUSED,  
+  /* TOK_FOR       */ UNUSED,
+  /* TOK_IN        */ UNUSED,
   /* TOK_MATCH     */ PREFIX(matchExpr),
   /* TOK_FN        */ UNUSED,
   /* TOK_IMPORT    */ UNUSED,
@@ -416,7 +936,7 @@ GrammarRule rules[] =  {
 };
 
 // Gets the [GrammarRule] associated with tokens of [type].
-static GrammarRule* getRule(TokenType type) {
+static const GrammarRule* getRule(TokenType type) {
   return &rules[type];
 }
 
@@ -426,7 +946,7 @@ typedef struct {
   TokenType type;
 } Keyword;
 
-static Keyword keywords[] = {
+static const Keyword keywords[] = {
     {"debug",  5, TOK_DEBUG},
     {"false",  5, TOK_FALSE},
     {"let",    3, TOK_LET},
@@ -434,6 +954,8 @@ static Keyword keywords[] = {
     {"if",     2, TOK_IF},
     {"else",   4, TOK_ELSE},
     {"while",  5, TOK_WHILE},
+    {"for",    3, TOK_FOR},
+    {"in",     2, TOK_IN},
     {"match",  5, TOK_MATCH},
     {"fn",     2, TOK_FN},
     {"import", 6, TOK_IMPORT},
@@ -442,10 +964,133 @@ static Keyword keywords[] = {
 
 // clang-format on
 
+// Source ---------------------------------------------------------------------
+
+// Reads the chunk of source that follows the one being lexed, starting with
+// the first [prefix] bytes of the token being lexed. Returns NULL at the end of
+// the source.
+static SourceChunk* readChunk(Parser* parser, int prefix) {
+  if (parser->read == NULL)
+    return NULL;
+
+  char* chars = ALLOCATE(char, prefix + SOURCE_CHUNK_SIZE + 1);
+  memcpy(chars, parser->tokenStart, prefix);
+  size_t length =
+      parser->read(parser->readData, chars + prefix, SOURCE_CHUNK_SIZE);
+  if (length == 0) {
+    FREE_ARRAY(char, chars, prefix + SOURCE_CHUNK_SIZE + 1);
+    parser->read = NULL;
+    return NULL;
+  }
+
+  SourceChunk* chunk = ALLOCATE(SourceChunk, 1);
+  chunk->next = NULL;
+  chunk->chars = chars;
+  chunk->length = prefix + (int)length;
+  chunk->prefix = prefix;
+  chunk->capacity = prefix + SOURCE_CHUNK_SIZE + 1;
+  chunk->chars[chunk->length] = '\0';
+  return chunk;
+}
+
+static void freeSourceChunk(SourceChunk* chunk) {
+  FREE_ARRAY(char, chunk->chars, chunk->capacity);
+  FREE(SourceChunk, chunk);
+}
+
+static bool chunkContains(SourceChunk* chunk, const char* position) {
+  return position >= chunk->chars && position <= chunk->chars + chunk->length;
+}
+
+// Moves the lexer on to the next chunk of source once it reaches the end of
+// the current one. Returns the next character, which is '\0' at the end of the
+// source.
+static char nextSourceChunk(Parser* parser) {
+  SourceChunk* chunk = parser->chunk;
+
+  // A null byte before the end of a chunk ends the source, as it does when the
+  // source is a string.
+  if (chunk == NULL || parser->currentChar != chunk->chars + chunk->length)
+    return '\0';
+
+  int prefix = (int)(parser->currentChar - parser->tokenStart);
+  if (chunk->next == NULL) {
+    chunk->next = readChunk(parser, prefix);
+    if (chunk->next == NULL)
+      return '\0';
+  }
+
+  // The next chunk may have been read already, by looking ahead through source
+  // that is now being lexed again.
+  ASSERT(chunk->next->prefix == prefix, "Source should be lexed the same way");
+  parser->chunk = chunk->next;
+  parser->tokenStart = parser->chunk->chars;
+  parser->currentChar = parser->chunk->chars + prefix;
+  return *parser->currentChar;
+}
+
+// Frees the chunks of source that no token points into anymore.
+static void releaseSource(Parser* parser) {
+  while (parser->chunks != parser->chunk &&
+         !chunkContains(parser->chunks, parser->previous.start)) {
+    SourceChunk* next = parser->chunks->next;
+    freeSourceChunk(parser->chunks);
+    parser->chunks = next;
+  }
+}
+
+// Returns the first chunk of source that [position] points into, or NULL if
+// the source is a string.
+static SourceChunk* findChunk(Parser* parser, const char* position) {
+  SourceChunk* chunk = parser->chunks;
+  while (chunk != NULL && !chunkContains(chunk, position)) {
+    chunk = chunk->next;
+  }
+  return chunk;
+}
+
+// Returns the length of the source from [start] up to [end], leaving out the
+// bytes that each chunk repeats from the one before it.
+static int sourceLength(Parser* parser, const char* start, const char* end) {
+  SourceChunk* chunk = findChunk(parser, start);
+  if (chunk == NULL || chunkContains(chunk, end))
+    return (int)(end - start);
+
+  int length = (int)(chunk->chars + chunk->length - start);
+  for (chunk = chunk->next; !chunkContains(chunk, end); chunk = chunk->next) {
+    length += chunk->length - chunk->prefix;
+  }
+  return length + (int)(end - chunk->chars) - chunk->prefix;
+}
+
+// Copies the source from [start] up to [end] into a new string.
+static ObjString* copySource(Compiler* compiler, const char* start,
+                             const char* end) {
+  SourceChunk* chunk = findChunk(compiler->parser, start);
+  if (chunk == NULL || chunkContains(chunk, end))
+    return copyString(compiler->vm, start, (int)(end - start));
+
+  int length = sourceLength(compiler->parser, start, end);
+  char* chars = ALLOCATE(char, length + 1);
+  int copied = (int)(chunk->chars + chunk->length - start);
+  memcpy(chars, start, copied);
+  for (chunk = chunk->next; !chunkContains(chunk, end); chunk = chunk->next) {
+    memcpy(chars + copied, chunk->chars + chunk->prefix,
+           chunk->length - chunk->prefix);
+    copied += chunk->length - chunk->prefix;
+  }
+  memcpy(chars + copied, chunk->chars + chunk->prefix, length - copied);
+  chars[length] = '\0';
+  return takeString(compiler->vm, chars, length);
+}
+
 // Parsing --------------------------------------------------------------------
 
 static char peekChar(Compiler* compiler) {
-  return *compiler->parser->currentChar;
+  char c = *compiler->parser->currentChar;
+  if (c == '\0')
+    return nextSourceChunk(compiler->parser);
+  return c;
 }
 
 static char nextChar(Compiler* compiler) {
@@ -495,6 +1140,12 @@ static bool isNumber(char c) { return isdigit(c); }
 // Finishes lexing a string.
 static void readString(Compiler* compiler) {
   while (peekChar(compiler) != '"') {
+    if (peekChar(compiler) == '\0') {
+      lexError(compiler, "Unterminated string.");
+      compiler->parser->current.type = TOK_ERROR;
+      compiler->parser->current.length = 0;
+      return;
+    }
     nextChar(compiler);
   }
   nextChar(compiler);
@@ -533,6 +1184,13 @@ static void skipLineComment(Compiler* compiler) {
 }
 
 // Lexes the next token and stores it in [parser.current].
+// Reports [c] as a character that starts no token.
+static void invalidCharacter(Compiler* compiler, char c) {
+  lexError(compiler, "Invalid character '%c'.", c);
+  compiler->parser->current.type = TOK_ERROR;
+  compiler->parser->current.length = 0;
+}
+
 static void nextToken(Compiler* compiler) {
   compiler->parser->previous = compiler->parser->current;
 
@@ -615,7 +1273,15 @@ static void nextToken(Compiler* compiler) {
         makeToken(compiler, TOK_MEMBER);
         return;
       }
-      // Fallthrough to error handler.
+      invalidCharacter(compiler, c);
+      return;
+    case '.':
+      if (matchChar(compiler, '.')) {
+        makeToken(compiler, TOK_RANGE);
+        return;
+      }
+      invalidCharacter(compiler, c);
+      return;
     default:
       if (isName(c)) {
         readName(compiler);
@@ -625,9 +1291,7 @@ static void nextToken(Compiler* compiler) {
         readNumber(compiler);
         return;
       }
-      lexError(compiler, "Invalid character '%c'.", c);
-      compiler->parser->current.type = TOK_ERROR;
-      compiler->parser->current.length = 0;
+      invalidCharacter(compiler, c);
       return;
     }
   }
@@ -700,6 +1364,7 @@ static void variableDeclaration(Compiler* compiler) {
   // Get the name, but don't declare it yet; A variable should not be in scope
   // in its own initializer.
   Token name = compiler->parser->previous;
+  checkRedeclaration(compiler, name);
   int variable = declareVariable(compiler, name);
 
   // Compile the initializer.
@@ -752,50 +1417,145 @@ static void blockStmt(Compiler* compiler) {
 static void ifStmt(Compiler* compiler) {
   // Compile the conditional.
   expression(compiler);
+  compiler->branchDepth++;
 
   // Emit the jump instruction.
   // When the VM reaches this, the value of the conditional is on the top of the
   // stack, and it will jump based on that value's truthiness.
-  int offset = emitJump(compiler, OP_JUMP_IF_FALSE);
+  int elseOffset = emitJump(compiler, OP_JUMP_IF_FALSE);
+
+  // Pop the conditional before either branch, so that locals declared in them
+  // land in the slots the compiler assigned them.
+  emitOp(compiler, OP_POP);
+
   // Compile the "then" branch.
   statement(compiler);
-  patchJump(compiler, offset);
+  int endOffset = emitJump(compiler, OP_JUMP);
+  patchJump(compiler, elseOffset);
+
+  // The jump to the "else" branch skips the pop above.
+  adjustSlots(compiler, 1);
+  emitOp(compiler, OP_POP);
 
   // Compile the "else" branch.
   if (match(compiler, TOK_ELSE)) {
-    // At this point the value of the conditional is still on the stack. Skip
-    // the else clause if it was truthy.
-    offset = emitJump(compiler, OP_JUMP_IF_TRUE);
     statement(compiler);
-    patchJump(compiler, offset);
   }
-
-  // Don't forget to pop the conditional
-  emitOp(compiler, OP_POP);
+  patchJump(compiler, endOffset);
+  compiler->branchDepth--;
 }
 
 static void whileStmt(Compiler* compiler) {
   int loopStart = compiler->function->chunk.count;
+  compiler->jumpTarget = loopStart;
 
   // Compile the conditional.
   expression(compiler);
   int offset = emitJump(compiler, OP_JUMP_IF_FALSE);
-  statement(compiler);
 
-  // Pop the conditional before looping, since the value is recompiled each time
-  // based on the new stack contents.
+  // Pop the conditional before the body, so that locals declared in it land in
+  // the slots the compiler assigned them. It is recompiled each time based on
+  // the new stack contents.
   emitOp(compiler, OP_POP);
+  compiler->branchDepth++;
+  statement(compiler);
+  compiler->branchDepth--;
   emitLoop(compiler, loopStart);
   patchJump(compiler, offset);
+
+  // The jump out of the loop skips the pop above, so the conditional is still
+  // on the stack here.
+  adjustSlots(compiler, 1);
+  emitOp(compiler, OP_POP);
+}
+
+// Declares a local that holds loop state, with a name no variable can have.
+static void addHiddenLocal(Compiler* compiler, const char* name) {
+  Token token;
+  token.type = TOK_IDENT;
+  token.start = name;
+  token.length = (int)strlen(name);
+  token.line = compiler->parser->currentLine;
+  addLocal(compiler, token);
+  markInitialized(compiler);
+}
+
+static void forStmt(Compiler* compiler) {
+  enterScope(compiler);
+
+  consume(compiler, TOK_IDENT, "Expected a loop variable after 'for'");
+  Token name = compiler->parser->previous;
+  consume(compiler, TOK_IN, "Expected 'in' after loop variable");
+
+  // The counter and the limit live in hidden locals below the loop variable,
+  // so assigning to the loop variable does not change how many times the loop
+  // runs. Both bounds are evaluated once.
+  int base = compiler->localCount;
+  expression(compiler);
+  addHiddenLocal(compiler, "(for counter)");
+  consume(compiler, TOK_RANGE, "Expected '..' after the start of the range");
+  expression(compiler);
+  addHiddenLocal(compiler, "(for limit)");
+
+  // Skip the loop if the range is empty. Otherwise the counter is copied into
+  // the loop variable.
+  emitOp(compiler, OP_FOR_PREP);
+  emitByte(compiler, base);
+  emitByte(compiler, 0xff);
+  emitByte(compiler, 0xff);
+  int exitOffset = compiler->function->chunk.count - 2;
+
+  setTopType(compiler, numberType());
+  addLocal(compiler, name);
+  markInitialized(compiler);
+
+  int loopStart = compiler->function->chunk.count;
+  compiler->jumpTarget = loopStart;
+  compiler->branchDepth++;
+  statement(compiler);
+  compiler->branchDepth--;
+
+  // Advance the counter and jump back to the body while it is in range.
+  emitOp(compiler, OP_FOR_LOOP);
+  emitByte(compiler, base);
+  if (loopStart > MAX_JUMP) {
+    error(compiler, "Loop body too large");
+  }
+  emitByte(compiler, (loopStart >> 8) & 0xff);
+  emitByte(compiler, loopStart & 0xff);
+
+  // Discard the loop variable, which an empty range never pushes.
+  Local* local = &compiler->locals[--compiler->localCount];
+  emitOp(compiler, local->isCaptured ? OP_CLOSE_UPVALUE : OP_POP);
+  patchJump(compiler, exitOffset);
+
+  exitScope(compiler);
 }
 
 static void functionBlockBody(Compiler* compiler) {
   consume(compiler, TOK_LBRACK, "Expected '{' before function body");
   ignoreNewlines(compiler);
 
-  while (!match(compiler, TOK_RBRACK)) {
-    statement(compiler);
+  while (peek(compiler) != TOK_RBRACK && peek(compiler) != TOK_EOF) {
+    if (!isExpressionStatement(compiler)) {
+      statement(compiler);
+      ignoreNewlines(compiler);
+      continue;
+    }
+
+    // The value of the last expression in the body is the return value.
+    expression(compiler);
     ignoreNewlines(compiler);
+    if (peek(compiler) != TOK_RBRACK) {
+      emitPop(compiler);
+    }
+  }
+  consume(compiler, TOK_RBRACK, "Expected '}' at the end of function body");
+
+  // A body that ends in a statement with nothing on the stack returns nil,
+  // rather than reading below the frame.
+  if (compiler->numSlots == 0) {
+    emitConstant(compiler, NIL_VAL);
   }
 }
 
@@ -815,29 +1575,113 @@ static void functionBody(Compiler* compiler) {
 
 static void parameterList(Compiler* compiler) {
   while (match(compiler, TOK_IDENT)) {
+    // Arguments can be anything.
+    *slotType(compiler, compiler->numSlots) = unknownType();
     int local = declareVariable(compiler, compiler->parser->previous);
     defineVariable(compiler, local);
     compiler->function->arity++;
+    adjustSlots(compiler, 1);
   }
 }
 
+// Skips the block body of the function being compiled, so that its code can be
+// compiled when the function is first called. [start] is the token after the
+// function's name, where its source starts. The body is checked for errors by
+// [endLazyFunction].
+//
+// Returns false, having consumed nothing, if the body should be compiled now
+// instead.
+static bool deferFunctionBody(Compiler* compiler, Token start) {
+  Parser* parser = compiler->parser;
+  if (peek(compiler) != TOK_LBRACK)
+    return false;
+
+  // Only the extent of the body is needed, which is up to the matching brace.
+  Parser saved = *parser;
+  int depth = 0;
+  do {
+    nextToken(compiler);
+    if (parser->previous.type == TOK_LBRACK) {
+      depth++;
+    } else if (parser->previous.type == TOK_RBRACK) {
+      depth--;
+    }
+  } while (depth > 0 && parser->previous.type != TOK_EOF);
+
+  // Errors are reported by compiling the body now, unless the lexer has
+  // already reported them.
+  const char* end = parser->previous.start + parser->previous.length;
+  int length = sourceLength(parser, start.start, end);
+  if (!parser->hasError && (depth > 0 || length < MIN_LAZY_SIZE)) {
+    // The chunks of source read while looking ahead are kept, to be lexed
+    // again, but the reader is not asked for more once it has run out.
+    ObaReadFn read = parser->read;
+    *parser = saved;
+    parser->read = read;
+    return false;
+  }
+
+  compiler->function->source = copySource(compiler, start.start, end);
+  compiler->function->line = start.line;
+  return true;
+}
+
+// Finishes a function whose body was deferred by [deferFunctionBody].
+static ObjFunction* endLazyFunction(Compiler* compiler, Token name) {
+  FREE_ARRAY(NumericOp, compiler->numericOps, compiler->numericOpCapacity);
+  if (compiler->parser->hasError) {
+    return NULL;
+  }
+
+  // The body is parsed in full, so that its errors are reported with the rest
+  // of the module's, but none of its code is kept until it is called.
+  ObjFunction* function = compiler->function;
+  function->name = copyString(compiler->vm, name.start, name.length);
+  if (!checkFunctionBody(compiler->vm, function)) {
+    compiler->parser->hasError = true;
+    return NULL;
+  }
+  return function;
+}
+
 static void functionDefinition(Compiler* compiler) {
   if (!match(compiler, TOK_IDENT)) {
     error(compiler, "Expected an identifier");
     return;
   }
 
+  // A function that is only checked is never called, so it need not be
+  // allocated.
+  ObjFunction scratch;
+  ObjFunction* function = &scratch;
+  if (compiler->parser->checkOnly) {
+    initFunction(function, compiler->parser->module);
+  } else {
+    function = newFunction(compiler->vm, compiler->parser->module);
+  }
+
   Compiler fnCompiler;
-  initCompiler(compiler->vm, &fnCompiler, compiler->parser, compiler);
+  initCompiler(compiler->vm, &fnCompiler, compiler->parser, compiler,
+               function);
 
   Token name = compiler->parser->previous;
+  checkRedeclaration(compiler, name);
 
+  Token start = compiler->parser->current;
   enterScope(&fnCompiler);
   parameterList(&fnCompiler);
   ignoreNewlines(&fnCompiler);
-  functionBody(&fnCompiler);
 
-  ObjFunction* fn = endCompiler(&fnCompiler, name.start, name.length);
+  // A function at the top level of a module can only refer to globals, so
+  // its body can be compiled on its own later.
+  bool isLazy = compiler->parent == NULL && compiler->currentDepth == 0 &&
+                deferFunctionBody(&fnCompiler, start);
+  if (!isLazy) {
+    functionBody(&fnCompiler);
+  }
+
+  ObjFunction* fn = isLazy ? endLazyFunction(&fnCompiler, name)
+                           : endCompiler(&fnCompiler, name.start, name.length);
   if (fn == NULL)
     return;
 
@@ -849,6 +1693,34 @@ static void functionDefinition(Compiler* compiler) {
     emitByte(compiler, fnCompiler.upvalues[i].index);
   }
   defineVariable(compiler, declareVariable(compiler, name));
+
+  // Functions declared conditionally may not exist when they are called, so
+  // only those that are always declared are known statically.
+  bool isModuleFunction = compiler->parent == NULL &&
+                          compiler->currentDepth == 0 &&
+                          compiler->branchDepth == 0;
+  if (isModuleFunction) {
+    // +1 for the return value, which OP_RETURN has already popped.
+    int returnSlots = fnCompiler.numSlots + 1;
+    bool isInlinable = !isLazy && canInline(fn, name, returnSlots);
+    addModuleFunction(compiler, name, isInlinable ? fn : NULL, returnSlots);
+  }
+}
+
+// Returns true iff the next statement is an expression.
+static bool isExpressionStatement(Compiler* compiler) {
+  switch (peek(compiler)) {
+  case TOK_FN:
+  case TOK_LET:
+  case TOK_DEBUG:
+  case TOK_LBRACK:
+  case TOK_IF:
+  case TOK_WHILE:
+  case TOK_FOR:
+    return false;
+  default:
+    return true;
+  }
 }
 
 static void statement(Compiler* compiler) {
@@ -864,8 +1736,12 @@ static void statement(Compiler* compiler) {
     ifStmt(compiler);
   } else if (match(compiler, TOK_WHILE)) {
     whileStmt(compiler);
+  } else if (match(compiler, TOK_FOR)) {
+    forStmt(compiler);
   } else {
+    // The value of an expression statement is unused.
     expression(compiler);
+    emitPop(compiler);
   }
 }
 
@@ -880,8 +1756,20 @@ static void import(Compiler* compiler) {
       OBJ_VAL(copyString(compiler->vm, token.start + 1, token.length - 2));
   int constant = addConstant(compiler, value);
 
+  // Let the VM start on the module before the import runs.
+  writeValueArray(&compiler->vm->imports, value);
+
+  // The module is stored in a variable of the same name.
+  Token name = token;
+  name.start++;
+  name.length -= 2;
+  checkRedeclaration(compiler, name);
+
   emitOp(compiler, OP_IMPORT_MODULE);
   emitByte(compiler, (uint8_t)constant);
+
+  // Importing leaves the module's closure on the stack.
+  emitOp(compiler, OP_POP);
 }
 
 static void declaration(Compiler* compiler) {
@@ -926,6 +1814,10 @@ static void variable(Compiler* compiler, bool canAssign) {
     Value value = OBJ_VAL(copyString(compiler->vm, name.start, name.length));
     arg = addConstant(compiler, value);
     getOp = OP_GET_GLOBAL;
+
+    // Globals cannot be assigned, which is reported above. Any instruction will
+    // do, since code with errors never runs.
+    setOp = OP_GET_GLOBAL;
   }
 
   if (set) {
@@ -934,6 +1826,24 @@ static void variable(Compiler* compiler, bool canAssign) {
 
   emitOp(compiler, set ? setOp : getOp);
   emitByte(compiler, (uint8_t)arg);
+
+  if (getOp != OP_GET_LOCAL) {
+    return;
+  }
+
+  Local* local = &compiler->locals[arg];
+  if (set) {
+    StaticType* value = peekType(compiler, 1);
+    if (value->isNumber) {
+      unionSets(&local->type.dependencies, &value->dependencies);
+    } else {
+      demoteLocal(compiler, arg);
+    }
+  } else if (local->type.isNumber) {
+    StaticType type = local->type;
+    addToSet(&type.dependencies, arg);
+    setTopType(compiler, type);
+  }
 }
 
 static uint8_t argumentList(Compiler* compiler) {
@@ -954,11 +1864,265 @@ static void functionCall(Compiler* compiler, bool canAssign) {
   consume(compiler, TOK_LPAREN, "Expected '(' before parameter list");
   uint8_t argCount = argumentList(compiler);
   consume(compiler, TOK_RPAREN, "Expected ')' after parameter list");
-  emitOp(compiler, OP_CALL);
-  emitByte(compiler, argCount);
+  emitCall(compiler, argCount);
+}
+
+// Inlining -------------------------------------------------------------------
+
+// Returns the size in bytes of the instruction at [offset] if it can be copied
+// into another function, or 0 if it cannot.
+static int inlineInstructionSize(Chunk* chunk, int offset) {
+  switch ((OpCode)chunk->code[offset]) {
+  case OP_ADD:
+  case OP_MINUS:
+  case OP_MULTIPLY:
+  case OP_DIVIDE:
+  case OP_TRUE:
+  case OP_FALSE:
+  case OP_NOT:
+  case OP_GT:
+  case OP_LT:
+  case OP_GTE:
+  case OP_LTE:
+  case OP_EQ:
+  case OP_NEQ:
+  case OP_ADD_NN:
+  case OP_MINUS_NN:
+  case OP_MULTIPLY_NN:
+  case OP_DIVIDE_NN:
+  case OP_GT_NN:
+  case OP_LT_NN:
+  case OP_GTE_NN:
+  case OP_LTE_NN:
+  case OP_POP:
+  case OP_DEBUG:
+  case OP_RETURN:
+    return 1;
+  case OP_CONSTANT:
+  case OP_ERROR:
+  case OP_GET_GLOBAL:
+  case OP_GET_LOCAL:
+  case OP_SET_LOCAL:
+  case OP_STORE_LOCAL:
+  case OP_GET_IMPORTED_VARIABLE:
+  case OP_CALL:
+    return 2;
+  case OP_ADD_LL:
+  case OP_MINUS_LL:
+  case OP_MULTIPLY_LL:
+  case OP_DIVIDE_LL:
+  case OP_GT_LL:
+  case OP_LT_LL:
+  case OP_GTE_LL:
+  case OP_LTE_LL:
+  case OP_ADD_LK:
+  case OP_MINUS_LK:
+  case OP_MULTIPLY_LK:
+  case OP_DIVIDE_LK:
+  case OP_GT_LK:
+  case OP_LT_LK:
+  case OP_GTE_LK:
+  case OP_LTE_LK:
+    return 3;
+  case OP_JUMP:
+  case OP_JUMP_IF_FALSE:
+  case OP_JUMP_IF_TRUE:
+  case OP_JUMP_IF_NOT_MATCH:
+    // Jumps are relative, so they still land in the right place once copied.
+    return 3;
+  default:
+    // Everything else either refers to the function's own closure or frame,
+    // or uses an absolute code offset.
+    return 0;
+  }
+}
+
+// Returns true iff calls to [function], a module-level function named [name],
+// can be replaced with a copy of its body.
+static bool canInline(ObjFunction* function, Token name, int returnSlots) {
+  Chunk* chunk = &function->chunk;
+
+  // A function with nothing on the stack when it returns returns its own
+  // closure, which only exists if it is really called.
+  if (function->upvalueCount > 0 || returnSlots <= function->arity) {
+    return false;
+  }
+
+  // -2 for the trailing OP_RETURN and OP_EXIT.
+  if (chunk->count - 2 > MAX_INLINE_SIZE) {
+    return false;
+  }
+
+  for (int offset = 0; chunk->code[offset] != OP_RETURN;) {
+    int size = inlineInstructionSize(chunk, offset);
+    if (size == 0) {
+      return false;
+    }
+
+    // Inlining a recursive function would only unroll it once.
+    if (chunk->code[offset] == OP_GET_GLOBAL) {
+      ObjString* global =
+          AS_STRING(chunk->constants.values[chunk->code[offset + 1]]);
+      if (global->length == name.length &&
+          memcmp(global->chars, name.start, name.length) == 0) {
+        return false;
+      }
+    }
+    offset += size;
+  }
+  return true;
+}
+
+// Adds [value] to the constant pool unless it is already there.
+// Returns the address of the constant within the pool.
+static int addInlinedConstant(Compiler* compiler, Value value) {
+  ValueArray* constants = &compiler->function->chunk.constants;
+  for (int i = 0; i < constants->count; i++) {
+    if (constants->values[i].type == value.type &&
+        valuesEqual(constants->values[i], value)) {
+      return i;
+    }
+  }
+  return addConstant(compiler, value);
+}
+
+// Returns true iff [name] refers to a local or upvalue in the current scope.
+static bool isLocalName(Compiler* compiler, Token name) {
+  for (; compiler != NULL; compiler = compiler->parent) {
+    for (int i = 0; i < compiler->localCount; i++) {
+      if (identifiersMatch(compiler->locals[i].token, name)) {
+        return true;
+      }
+    }
+  }
+  return false;
+}
+
+// Finds the function that a call to [name] would reach, if it can be inlined.
+// Returns NULL otherwise.
+static ModuleFunction* findInlinable(Compiler* compiler, Token name) {
+  ModuleFunction* callee = findModuleFunction(compiler, name);
+  if (callee == NULL || callee->function == NULL) {
+    return NULL;
+  }
+  if (isLocalName(compiler, name)) {
+    return NULL;
+  }
+
+  // Make sure every slot used by the body is addressable from this function.
+  if (compiler->numSlots + callee->returnSlots + MAX_INLINE_SIZE >=
+      MAX_LOCALS) {
+    return NULL;
+  }
+  return callee;
+}
+
+// Compiles a call to [callee] by copying its body into the current function.
+//
+// The arguments are evaluated onto the stack as usual, where they become the
+// callee's parameters. Its locals are renumbered to sit on top of them, and its
+// return value replaces them when it is done.
+static void inlineCall(Compiler* compiler, ModuleFunction* callee) {
+  ObjFunction* function = callee->function;
+  Chunk* body = &function->chunk;
+  int base = compiler->numSlots;
+
+  consume(compiler, TOK_LPAREN, "Expected '(' before parameter list");
+  uint8_t argCount = argumentList(compiler);
+  consume(compiler, TOK_RPAREN, "Expected ')' after parameter list");
+
+  if (argCount != function->arity) {
+    // Fail the same way the call would have.
+    emitError(compiler, "Expected %d arguments but got %d", function->arity,
+              argCount);
+    compiler->numSlots = base + 1;
+    setTopType(compiler, unknownType());
+    return;
+  }
+
+  for (int offset = 0; body->code[offset] != OP_RETURN;) {
+    OpCode op = body->code[offset];
+    int size = inlineInstructionSize(body, offset);
+
+    switch (op) {
+    case OP_CONSTANT:
+    case OP_ERROR:
+    case OP_GET_GLOBAL:
+    case OP_GET_IMPORTED_VARIABLE: {
+      Value constant = body->constants.values[body->code[offset + 1]];
+      emitOp(compiler, op);
+      emitByte(compiler, addInlinedConstant(compiler, constant));
+      break;
+    }
+    case OP_GET_LOCAL:
+    case OP_SET_LOCAL:
+    case OP_STORE_LOCAL:
+      emitOp(compiler, op);
+      emitByte(compiler, base + body->code[offset + 1]);
+      break;
+    case OP_ADD_LL:
+    case OP_MINUS_LL:
+    case OP_MULTIPLY_LL:
+    case OP_DIVIDE_LL:
+    case OP_GT_LL:
+    case OP_LT_LL:
+    case OP_GTE_LL:
+    case OP_LTE_LL:
+      emitOp(compiler, op);
+      emitByte(compiler, base + body->code[offset + 1]);
+      emitByte(compiler, base + body->code[offset + 2]);
+      break;
+    case OP_ADD_LK:
+    case OP_MINUS_LK:
+    case OP_MULTIPLY_LK:
+    case OP_DIVIDE_LK:
+    case OP_GT_LK:
+    case OP_LT_LK:
+    case OP_GTE_LK:
+    case OP_LTE_LK: {
+      Value constant = body->constants.values[body->code[offset + 2]];
+      emitOp(compiler, op);
+      emitByte(compiler, base + body->code[offset + 1]);
+      emitByte(compiler, addInlinedConstant(compiler, constant));
+      break;
+    }
+    case OP_CALL:
+      emitCall(compiler, body->code[offset + 1]);
+      break;
+    default:
+      emitOp(compiler, op);
+      for (int i = 1; i < size; i++) {
+        emitByte(compiler, body->code[offset + i]);
+      }
+      break;
+    }
+    offset += size;
+  }
+
+  // Jumps copied from the body may land anywhere up to here.
+  compiler->jumpTarget = compiler->function->chunk.count;
+
+  // Replace the parameters and locals with the return value.
+  compiler->numSlots = base + callee->returnSlots;
+  if (callee->returnSlots > 1) {
+    emitOp(compiler, OP_SET_LOCAL);
+    emitByte(compiler, base);
+    for (int i = 1; i < callee->returnSlots; i++) {
+      emitPop(compiler);
+    }
+  }
+  setTopType(compiler, unknownType());
 }
 
 static void identifier(Compiler* compiler, bool canAssign) {
+  if (peek(compiler) == TOK_LPAREN) {
+    ModuleFunction* callee = findInlinable(compiler, compiler->parser->previous);
+    if (callee != NULL) {
+      inlineCall(compiler, callee);
+      return;
+    }
+  }
+
   variable(compiler, canAssign);
   if (peek(compiler) == TOK_LPAREN) {
     functionCall(compiler, canAssign);
@@ -1049,6 +2213,9 @@ static void matchExpr(Compiler* compiler, bool canAssign) {
 
   matchExprCase(compiler);
   consume(compiler, TOK_SEMICOLON, "Expected ';'");
+
+  // Each case leaves a value of a different type.
+  setTopType(compiler, unknownType());
 }
 
 static void literal(Compiler* compiler, bool canAssign) {
@@ -1068,7 +2235,7 @@ static void literal(Compiler* compiler, bool canAssign) {
 }
 
 static void unaryOp(Compiler* compiler, bool canAssign) {
-  GrammarRule* rule = getRule(compiler->parser->previous.type);
+  const GrammarRule* rule = getRule(compiler->parser->previous.type);
   TokenType opType = compiler->parser->previous.type;
 
   ignoreNewlines(compiler);
@@ -1086,7 +2253,7 @@ static void unaryOp(Compiler* compiler, bool canAssign) {
 }
 
 static void infixOp(Compiler* compiler, bool canAssign) {
-  GrammarRule* rule = getRule(compiler->parser->previous.type);
+  const GrammarRule* rule = getRule(compiler->parser->previous.type);
   TokenType opType = compiler->parser->previous.type;
 
   ignoreNewlines(compiler);
@@ -1096,28 +2263,38 @@ static void infixOp(Compiler* compiler, bool canAssign) {
 
   switch (opType) {
   case TOK_PLUS:
-    emitOp(compiler, OP_ADD);
+    // Strings can be added too.
+    emitBinaryOp(compiler, OP_ADD, OP_ADD_NN);
     return;
   case TOK_MINUS:
-    emitOp(compiler, OP_MINUS);
+    // The checked forms of the other arithmetic operators fail unless the
+    // result is a number.
+    if (!emitBinaryOp(compiler, OP_MINUS, OP_MINUS_NN))
+      setTopType(compiler, numberType());
     return;
   case TOK_MULTIPLY:
-    emitOp(compiler, OP_MULTIPLY);
+    if (!emitBinaryOp(compiler, OP_MULTIPLY, OP_MULTIPLY_NN))
+      setTopType(compiler, numberType());
     return;
   case TOK_DIVIDE:
-    emitOp(compiler, OP_DIVIDE);
+    if (!emitBinaryOp(compiler, OP_DIVIDE, OP_DIVIDE_NN))
+      setTopType(compiler, numberType());
     return;
   case TOK_GT:
-    emitOp(compiler, OP_GT);
+    emitBinaryOp(compiler, OP_GT, OP_GT_NN);
+    setTopType(compiler, unknownType());
     return;
   case TOK_LT:
-    emitOp(compiler, OP_LT);
+    emitBinaryOp(compiler, OP_LT, OP_LT_NN);
+    setTopType(compiler, unknownType());
     return;
   case TOK_GTE:
-    emitOp(compiler, OP_GTE);
+    emitBinaryOp(compiler, OP_GTE, OP_GTE_NN);
+    setTopType(compiler, unknownType());
     return;
   case TOK_LTE:
-    emitOp(compiler, OP_LTE);
+    emitBinaryOp(compiler, OP_LTE, OP_LTE_NN);
+    setTopType(compiler, unknownType());
     return;
   case TOK_EQ:
     emitOp(compiler, OP_EQ);
@@ -1135,10 +2312,21 @@ static void infixOp(Compiler* compiler, bool canAssign) {
 
 ObjFunction* endCompiler(Compiler* compiler, const char* debugName,
                          int debugNameLength) {
+  FREE_ARRAY(NumericOp, compiler->numericOps, compiler->numericOpCapacity);
+
+  if (compiler->function->maxSlots > STACK_MAX) {
+    error(compiler, "Too many values on the stack");
+  }
+
   if (compiler->parser->hasError) {
     return NULL;
   }
 
+  if (compiler->parser->checkOnly) {
+    compiler->parent->parser = compiler->parser;
+    return compiler->function;
+  }
+
   if (compiler->parent == NULL) {
     emitOp(compiler, OP_END_MODULE);
   } else {
@@ -1158,29 +2346,42 @@ ObjFunction* endCompiler(Compiler* compiler, const char* debugName,
   // It is only reached when the module we just compiled is not the "main"
   // module.
   emitOp(compiler, OP_EXIT);
-  return compiler->function;
-}
 
-ObjFunction* compile(ObaVM* vm, ObjModule* module, const char* source,
-                     Compiler* parent, const char* name, int nameLength) {
-  // Skip the UTF-8 BOM if there is one.
-  if (strncmp(source, "\xEF\xBB\xBF", 3) == 0)
-    source += 3;
+#ifdef DEBUG_MODE
+  const char* problem = verifyFunction(compiler->function);
+  ASSERT(problem == NULL, problem);
+#endif
 
-  Parser parser;
-  parser.module = module;
-  parser.source = source;
-  parser.tokenStart = source;
-  parser.currentChar = source;
-  parser.currentLine = 1;
-  parser.current.type = TOK_ERROR;
-  parser.current.start = source;
-  parser.current.length = 0;
-  parser.current.line = 0;
-  parser.hasError = false;
+  return compiler->function;
+}
 
+static void initParser(Parser* parser, ObjModule* module, const char* source,
+                       int line) {
+  parser->module = module;
+  parser->source = source;
+  parser->tokenStart = source;
+  parser->currentChar = source;
+  parser->currentLine = line;
+  parser->current.type = TOK_ERROR;
+  parser->current.start = source;
+  parser->current.length = 0;
+  parser->current.line = 0;
+  parser->hasError = false;
+  parser->checkOnly = false;
+  parser->functions = NULL;
+  parser->functionCount = 0;
+  parser->functionCapacity = 0;
+  parser->chunks = NULL;
+  parser->chunk = NULL;
+  parser->read = NULL;
+  parser->readData = NULL;
+}
+
+// Compiles the module that [parser] is positioned at the start of.
+static ObjFunction* compileModule(ObaVM* vm, Parser* parser, Compiler* parent,
+                                  const char* name, int nameLength) {
   Compiler compiler;
-  initCompiler(vm, &compiler, &parser, parent);
+  initCompiler(vm, &compiler, parser, parent, newFunction(vm, parser->module));
 
   nextToken(&compiler);
   ignoreNewlines(&compiler);
@@ -1192,11 +2393,119 @@ ObjFunction* compile(ObaVM* vm, ObjModule* module, const char* source,
       consume(&compiler, TOK_EOF, "Expected end of file.");
       break;
     }
+    releaseSource(parser);
   }
 
-  return endCompiler(&compiler, name, nameLength);
+  ObjFunction* function = endCompiler(&compiler, name, nameLength);
+  FREE_ARRAY(ModuleFunction, parser->functions, parser->functionCapacity);
+  while (parser->chunks != NULL) {
+    SourceChunk* next = parser->chunks->next;
+    freeSourceChunk(parser->chunks);
+    parser->chunks = next;
+  }
+  return function;
+}
+
+ObjFunction* compile(ObaVM* vm, ObjModule* module, const char* source,
+                     Compiler* parent, const char* name, int nameLength) {
+  // Skip the UTF-8 BOM if there is one.
+  if (strncmp(source, "\xEF\xBB\xBF", 3) == 0)
+    source += 3;
+
+  Parser parser;
+  initParser(&parser, module, source, 1);
+  return compileModule(vm, &parser, parent, name, nameLength);
 }
 
 ObjFunction* obaCompile(ObaVM* vm, ObjModule* module, const char* source) {
   return compile(vm, module, source, NULL, "(script)", 8);
 }
+
+ObjFunction* obaCompileStream(ObaVM* vm, ObjModule* module, ObaReadFn read,
+                              void* userData) {
+  Parser parser;
+  initParser(&parser, module, "", 1);
+  parser.read = read;
+  parser.readData = userData;
+
+  // Source that ends before it starts is compiled as the empty string.
+  SourceChunk* chunk = readChunk(&parser, 0);
+  if (chunk != NULL) {
+    parser.chunks = chunk;
+    parser.chunk = chunk;
+    parser.source = chunk->chars;
+    parser.tokenStart = chunk->chars;
+    parser.currentChar = chunk->chars;
+    parser.current.start = chunk->chars;
+
+    // Skip the UTF-8 BOM if there is one.
+    if (strncmp(chunk->chars, "\xEF\xBB\xBF", 3) == 0) {
+      parser.tokenStart += 3;
+      parser.currentChar += 3;
+    }
+  }
+  return compileModule(vm, &parser, NULL, "(script)", 8);
+}
+
+// Compiles the deferred body of [function] into its chunk, and returns false
+// if it has errors, in which case the chunk is left empty.
+//
+// If [checkOnly] is true, the body is only checked for errors, and [function]
+// is left as it is.
+static bool compileBody(ObaVM* vm, ObjFunction* function, bool checkOnly) {
+  Parser parser;
+  initParser(&parser, function->module, function->source->chars,
+             function->line);
+  parser.checkOnly = checkOnly;
+
+  // The function is compiled as if it were declared in an empty module, since
+  // it cannot see anything but globals anyway. Unlike the module it was
+  // declared in, no other functions are known to it, so it inlines nothing.
+  Compiler module;
+  initCompiler(vm, &module, &parser, NULL, NULL);
+
+  ObjFunction scratch;
+  ObjFunction* target = function;
+  int arity = function->arity;
+  if (checkOnly) {
+    initFunction(&scratch, function->module);
+    target = &scratch;
+  } else {
+    // The function's code may have been borrowed from a snapshot or image, but
+    // it is empty.
+    initChunk(&function->chunk);
+    function->arity = 0;
+  }
+
+  Compiler compiler;
+  initCompiler(vm, &compiler, &parser, &module, target);
+  nextToken(&compiler);
+  enterScope(&compiler);
+  parameterList(&compiler);
+  ignoreNewlines(&compiler);
+  functionBody(&compiler);
+
+  ObjString* name = function->name;
+  if (endCompiler(&compiler, name->chars, name->length) == NULL) {
+    if (!checkOnly) {
+      freeChunk(&function->chunk);
+      function->arity = arity;
+    }
+    return false;
+  }
+  return true;
+}
+
+// Reports the errors in the deferred body of [function], if any, without
+// compiling it.
+static bool checkFunctionBody(ObaVM* vm, ObjFunction* function) {
+  return compileBody(vm, function, true);
+}
+
+bool compileFunctionBody(ObaVM* vm, ObjFunction* function) {
+  if (!compileBody(vm, function, false))
+    return false;
+
+  function->source = NULL;
+  return true;
+}
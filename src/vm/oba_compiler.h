@@ -12,4 +12,15 @@
 // occurred while compiling. Code should not be executed if so.
 ObjFunction* obaCompile(ObaVM* vm, ObjModule* module, const char* source);
 
+// Compiles source read from [read] like [obaCompile], only holding on to the
+// source of the top-level statement being compiled, and of any function whose
+// body is left until it is called.
+ObjFunction* obaCompileStream(ObaVM* vm, ObjModule* module, ObaReadFn read,
+                              void* userData);
+
+// Compiles the body of [function], which was left until it is first called.
+// Returns false if an error occurred, in which case it has not been compiled
+// and should not be called.
+bool compileFunctionBody(ObaVM* vm, ObjFunction* function);
+
 #endif
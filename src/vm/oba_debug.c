@@ -1,5 +1,7 @@
+#include <stdbool.h>
 #include <stdio.h>
 
+#include "oba_common.h"
 #include "oba_debug.h"
 #include "oba_function.h"
 #include "oba_value.h"
@@ -24,6 +26,23 @@ static int byteInstruction(const char* name, Chunk* chunk, int offset) {
   return offset + 2;
 }
 
+static int localsInstruction(const char* name, Chunk* chunk, int offset) {
+  uint8_t a = chunk->code[offset + 1];
+  uint8_t b = chunk->code[offset + 2];
+  printf("%-16s %4d %4d\n", name, a, b);
+  return offset + 3;
+}
+
+static int localConstantInstruction(const char* name, Chunk* chunk,
+                                    int offset) {
+  uint8_t local = chunk->code[offset + 1];
+  uint8_t constant = chunk->code[offset + 2];
+  printf("%-16s %4d %4d '", name, local, constant);
+  printValue(chunk->constants.values[constant]);
+  printf("'\n");
+  return offset + 3;
+}
+
 static int jumpInstruction(const char* name, int sign, Chunk* chunk,
                            int offset) {
   uint16_t jump = (uint16_t)(chunk->code[offset + 1] << 8);
@@ -32,6 +51,16 @@ static int jumpInstruction(const char* name, int sign, Chunk* chunk,
   return offset + 3;
 }
 
+static int forInstruction(const char* name, int sign, Chunk* chunk,
+                          int offset) {
+  uint8_t slot = chunk->code[offset + 1];
+  uint16_t jump = (uint16_t)(chunk->code[offset + 2] << 8);
+  jump |= chunk->code[offset + 3];
+  int target = sign > 0 ? offset + 4 + jump : jump;
+  printf("%-16s %4d -> %d\n", name, slot, target);
+  return offset + 4;
+}
+
 int disassemble(Chunk* chunk, const char* name) {
   printf("== %s ==\n", name);
   for (int offset = 0; offset < chunk->count;) {
@@ -39,8 +68,16 @@ int disassemble(Chunk* chunk, const char* name) {
   }
 }
 
+int instructionStackEffect(Chunk* chunk, int offset) {
+  OpCode op = chunk->code[offset];
+  if (op == OP_CALL) {
+    return -chunk->code[offset + 1];
+  }
+  return stackEffects[op];
+}
+
 int disassembleInstruction(Chunk* chunk, int offset) {
-  printf("%04d ", offset);
+  printf("%04d %+3d ", offset, instructionStackEffect(chunk, offset));
 
   uint8_t instr = chunk->code[offset];
   switch (instr) {
@@ -74,12 +111,62 @@ int disassembleInstruction(Chunk* chunk, int offset) {
     return simpleInstruction("OP_EQ", chunk, offset);
   case OP_NEQ:
     return simpleInstruction("OP_NEQ", chunk, offset);
+  case OP_ADD_NN:
+    return simpleInstruction("OP_ADD_NN", chunk, offset);
+  case OP_MINUS_NN:
+    return simpleInstruction("OP_MINUS_NN", chunk, offset);
+  case OP_MULTIPLY_NN:
+    return simpleInstruction("OP_MULTIPLY_NN", chunk, offset);
+  case OP_DIVIDE_NN:
+    return simpleInstruction("OP_DIVIDE_NN", chunk, offset);
+  case OP_GT_NN:
+    return simpleInstruction("OP_GT_NN", chunk, offset);
+  case OP_LT_NN:
+    return simpleInstruction("OP_LT_NN", chunk, offset);
+  case OP_GTE_NN:
+    return simpleInstruction("OP_GTE_NN", chunk, offset);
+  case OP_LTE_NN:
+    return simpleInstruction("OP_LTE_NN", chunk, offset);
+  case OP_ADD_LL:
+    return localsInstruction("OP_ADD_LL", chunk, offset);
+  case OP_MINUS_LL:
+    return localsInstruction("OP_MINUS_LL", chunk, offset);
+  case OP_MULTIPLY_LL:
+    return localsInstruction("OP_MULTIPLY_LL", chunk, offset);
+  case OP_DIVIDE_LL:
+    return localsInstruction("OP_DIVIDE_LL", chunk, offset);
+  case OP_GT_LL:
+    return localsInstruction("OP_GT_LL", chunk, offset);
+  case OP_LT_LL:
+    return localsInstruction("OP_LT_LL", chunk, offset);
+  case OP_GTE_LL:
+    return localsInstruction("OP_GTE_LL", chunk, offset);
+  case OP_LTE_LL:
+    return localsInstruction("OP_LTE_LL", chunk, offset);
+  case OP_ADD_LK:
+    return localConstantInstruction("OP_ADD_LK", chunk, offset);
+  case OP_MINUS_LK:
+    return localConstantInstruction("OP_MINUS_LK", chunk, offset);
+  case OP_MULTIPLY_LK:
+    return localConstantInstruction("OP_MULTIPLY_LK", chunk, offset);
+  case OP_DIVIDE_LK:
+    return localConstantInstruction("OP_DIVIDE_LK", chunk, offset);
+  case OP_GT_LK:
+    return localConstantInstruction("OP_GT_LK", chunk, offset);
+  case OP_LT_LK:
+    return localConstantInstruction("OP_LT_LK", chunk, offset);
+  case OP_GTE_LK:
+    return localConstantInstruction("OP_GTE_LK", chunk, offset);
+  case OP_LTE_LK:
+    return localConstantInstruction("OP_LTE_LK", chunk, offset);
   case OP_DEFINE_GLOBAL:
     return constantInstruction("OP_DEFINE_GLOBAL", chunk, offset);
   case OP_GET_GLOBAL:
     return constantInstruction("OP_GET_GLOBAL", chunk, offset);
   case OP_SET_LOCAL:
     return byteInstruction("OP_SET_LOCAL", chunk, offset);
+  case OP_STORE_LOCAL:
+    return byteInstruction("OP_STORE_LOCAL", chunk, offset);
   case OP_GET_LOCAL:
     return byteInstruction("OP_GET_LOCAL", chunk, offset);
   case OP_SET_UPVALUE:
@@ -102,6 +189,11 @@ int disassembleInstruction(Chunk* chunk, int offset) {
     return jumpInstruction("OP_JUMP_IF_NOT_MATCH", 1, chunk, offset);
   case OP_LOOP:
     return jumpInstruction("OP_LOOP", -1, chunk, offset);
+  case OP_FOR_PREP:
+    return forInstruction("OP_FOR_PREP", 1, chunk, offset);
+  case OP_FOR_LOOP:
+    // Like OP_LOOP, the operand is the exact offset of the loop start.
+    return forInstruction("OP_FOR_LOOP", -1, chunk, offset);
   case OP_CALL:
     return constantInstruction("OP_CALL", chunk, offset);
   case OP_CLOSURE: {
@@ -115,7 +207,7 @@ int disassembleInstruction(Chunk* chunk, int offset) {
     for (int j = 0; j < function->upvalueCount; j++) {
       int isLocal = chunk->code[offset++];
       int slot = chunk->code[offset++];
-      printf("%04d      |              %s %d \n", offset - 2,
+      printf("%04d          |              %s %d \n", offset - 2,
              isLocal ? "local" : "upvalue", slot);
     }
     return offset;
@@ -135,3 +227,316 @@ int disassembleInstruction(Chunk* chunk, int offset) {
     return offset + 1;
   }
 }
+
+// Verification ---------------------------------------------------------------
+
+// Returns the size in bytes of the instruction at [offset], or 0 if it is
+// malformed.
+static int instructionSize(Chunk* chunk, int offset) {
+  switch ((OpCode)chunk->code[offset]) {
+  case OP_CONSTANT:
+  case OP_ERROR:
+  case OP_DEFINE_GLOBAL:
+  case OP_GET_GLOBAL:
+  case OP_GET_LOCAL:
+  case OP_SET_LOCAL:
+  case OP_STORE_LOCAL:
+  case OP_GET_UPVALUE:
+  case OP_SET_UPVALUE:
+  case OP_IMPORT_MODULE:
+  case OP_GET_IMPORTED_VARIABLE:
+  case OP_CALL:
+    return 2;
+  case OP_ADD_LL:
+  case OP_MINUS_LL:
+  case OP_MULTIPLY_LL:
+  case OP_DIVIDE_LL:
+  case OP_GT_LL:
+  case OP_LT_LL:
+  case OP_GTE_LL:
+  case OP_LTE_LL:
+  case OP_ADD_LK:
+  case OP_MINUS_LK:
+  case OP_MULTIPLY_LK:
+  case OP_DIVIDE_LK:
+  case OP_GT_LK:
+  case OP_LT_LK:
+  case OP_GTE_LK:
+  case OP_LTE_LK:
+  case OP_JUMP:
+  case OP_JUMP_IF_FALSE:
+  case OP_JUMP_IF_TRUE:
+  case OP_JUMP_IF_NOT_MATCH:
+  case OP_LOOP:
+    return 3;
+  case OP_FOR_PREP:
+  case OP_FOR_LOOP:
+    return 4;
+  case OP_CLOSURE: {
+    if (offset + 1 >= chunk->count)
+      return 0;
+    uint8_t constant = chunk->code[offset + 1];
+    if (constant >= chunk->constants.count ||
+        !IS_FUNCTION(chunk->constants.values[constant])) {
+      return 0;
+    }
+    return 2 + 2 * AS_FUNCTION(chunk->constants.values[constant])->upvalueCount;
+  }
+  default:
+    if (chunk->code[offset] > OP_EXIT)
+      return 0;
+    return 1;
+  }
+}
+
+// Returns the number of values the instruction at [offset] reads from the top
+// of the stack.
+static int stackInputs(Chunk* chunk, int offset) {
+  switch ((OpCode)chunk->code[offset]) {
+  case OP_CALL:
+    return chunk->code[offset + 1] + 1;
+  case OP_ADD:
+  case OP_MINUS:
+  case OP_MULTIPLY:
+  case OP_DIVIDE:
+  case OP_GT:
+  case OP_LT:
+  case OP_GTE:
+  case OP_LTE:
+  case OP_EQ:
+  case OP_NEQ:
+  case OP_ADD_NN:
+  case OP_MINUS_NN:
+  case OP_MULTIPLY_NN:
+  case OP_DIVIDE_NN:
+  case OP_GT_NN:
+  case OP_LT_NN:
+  case OP_GTE_NN:
+  case OP_LTE_NN:
+  case OP_JUMP_IF_NOT_MATCH:
+    return 2;
+  case OP_NOT:
+  case OP_POP:
+  case OP_DEBUG:
+  case OP_DEFINE_GLOBAL:
+  case OP_SET_LOCAL:
+  case OP_STORE_LOCAL:
+  case OP_SET_UPVALUE:
+  case OP_GET_IMPORTED_VARIABLE:
+  case OP_JUMP_IF_FALSE:
+  case OP_JUMP_IF_TRUE:
+  case OP_CLOSE_UPVALUE:
+  case OP_RETURN:
+    return 1;
+  default:
+    return 0;
+  }
+}
+
+// Checks the operands of the instruction at [offset], reached with [height]
+// values on the stack.
+static const char* verifyOperands(ObjFunction* function, int offset,
+                                  int height) {
+  Chunk* chunk = &function->chunk;
+  uint8_t operand = chunk->code[offset + 1];
+
+  switch ((OpCode)chunk->code[offset]) {
+  case OP_CONSTANT:
+    if (operand >= chunk->constants.count)
+      return "Constant out of range";
+    return NULL;
+  case OP_ERROR:
+  case OP_DEFINE_GLOBAL:
+  case OP_GET_GLOBAL:
+  case OP_IMPORT_MODULE:
+  case OP_GET_IMPORTED_VARIABLE:
+    if (operand >= chunk->constants.count ||
+        !IS_STRING(chunk->constants.values[operand])) {
+      return "Expected a string constant";
+    }
+    return NULL;
+  case OP_GET_LOCAL:
+  case OP_SET_LOCAL:
+    if (operand >= height)
+      return "Local out of range";
+    return NULL;
+  case OP_STORE_LOCAL:
+    // The value being stored is not one of the locals.
+    if (operand >= height - 1)
+      return "Local out of range";
+    return NULL;
+  case OP_ADD_LL:
+  case OP_MINUS_LL:
+  case OP_MULTIPLY_LL:
+  case OP_DIVIDE_LL:
+  case OP_GT_LL:
+  case OP_LT_LL:
+  case OP_GTE_LL:
+  case OP_LTE_LL:
+    if (operand >= height || chunk->code[offset + 2] >= height)
+      return "Local out of range";
+    return NULL;
+  case OP_ADD_LK:
+  case OP_MINUS_LK:
+  case OP_MULTIPLY_LK:
+  case OP_DIVIDE_LK:
+  case OP_GT_LK:
+  case OP_LT_LK:
+  case OP_GTE_LK:
+  case OP_LTE_LK:
+    if (operand >= height)
+      return "Local out of range";
+    if (chunk->code[offset + 2] >= chunk->constants.count)
+      return "Constant out of range";
+    return NULL;
+  case OP_FOR_PREP:
+    if (operand + 1 >= height)
+      return "Loop counter out of range";
+    return NULL;
+  case OP_FOR_LOOP:
+    if (operand + 2 >= height)
+      return "Loop counter out of range";
+    return NULL;
+  case OP_GET_UPVALUE:
+  case OP_SET_UPVALUE:
+    if (operand >= function->upvalueCount)
+      return "Upvalue out of range";
+    return NULL;
+  case OP_CLOSURE: {
+    ObjFunction* closure = AS_FUNCTION(chunk->constants.values[operand]);
+    for (int i = 0; i < closure->upvalueCount; i++) {
+      bool isLocal = chunk->code[offset + 2 + 2 * i];
+      int index = chunk->code[offset + 3 + 2 * i];
+      if (isLocal ? index >= height : index >= function->upvalueCount) {
+        return "Captured variable out of range";
+      }
+    }
+    return NULL;
+  }
+  default:
+    return NULL;
+  }
+}
+
+const char* verifyFunction(ObjFunction* function) {
+  Chunk* chunk = &function->chunk;
+  const char* problem = NULL;
+
+  // The number of values on the stack at the start of each instruction, or -1
+  // for bytes that are not the start of an instruction.
+  int* heights = ALLOCATE(int, chunk->count);
+  bool* isStart = ALLOCATE(bool, chunk->count);
+  int* worklist = ALLOCATE(int, chunk->count);
+  int worklistCount = 0;
+
+  for (int i = 0; i < chunk->count; i++) {
+    heights[i] = -1;
+    isStart[i] = false;
+  }
+
+  for (int offset = 0; offset < chunk->count;) {
+    int size = instructionSize(chunk, offset);
+    if (size == 0 || offset + size > chunk->count) {
+      problem = "Malformed instruction";
+      goto done;
+    }
+    isStart[offset] = true;
+    offset += size;
+  }
+
+  if (chunk->count == 0) {
+    goto done;
+  }
+
+  // Parameters are the first values on the stack.
+  heights[0] = function->arity;
+  worklist[worklistCount++] = 0;
+
+  // Records that [target] is reached with [height] values on the stack.
+#define REACH(target, height)                                                  \
+  do {                                                                         \
+    int t = (target);                                                          \
+    int h = (height);                                                          \
+    if (t < 0 || t >= chunk->count || !isStart[t]) {                           \
+      problem = "Jump to the middle of an instruction";                        \
+      goto done;                                                               \
+    }                                                                          \
+    if (h < 0 || h > function->maxSlots) {                                     \
+      problem = "Stack height out of range";                                   \
+      goto done;                                                               \
+    }                                                                          \
+    if (heights[t] == -1) {                                                    \
+      heights[t] = h;                                                          \
+      worklist[worklistCount++] = t;                                           \
+    } else if (heights[t] != h) {                                              \
+      problem = "Inconsistent stack height";                                   \
+      goto done;                                                               \
+    }                                                                          \
+  } while (false)
+
+  while (worklistCount > 0) {
+    int offset = worklist[--worklistCount];
+    int height = heights[offset];
+    OpCode op = chunk->code[offset];
+    int next = offset + instructionSize(chunk, offset);
+
+    if (height < stackInputs(chunk, offset)) {
+      problem = "Stack underflow";
+      goto done;
+    }
+    if ((problem = verifyOperands(function, offset, height)) != NULL) {
+      goto done;
+    }
+
+    int after = height + instructionStackEffect(chunk, offset);
+    // The last two bytes of jumps and loops are the jump operand.
+    uint16_t jump = 0;
+    if (next - offset >= 3) {
+      jump = (uint16_t)((chunk->code[next - 2] << 8) | chunk->code[next - 1]);
+    }
+
+    switch (op) {
+    case OP_RETURN:
+    case OP_EXIT:
+    case OP_ERROR:
+      break;
+    case OP_JUMP:
+      REACH(next + jump, after);
+      break;
+    case OP_JUMP_IF_FALSE:
+    case OP_JUMP_IF_TRUE:
+      REACH(next, after);
+      REACH(next + jump, after);
+      break;
+    case OP_JUMP_IF_NOT_MATCH:
+      REACH(next, after);
+      // The value being matched is left on the stack for the next case.
+      REACH(next + jump, height - 1);
+      break;
+    case OP_LOOP:
+      // Loops encode the exact offset of their destination.
+      REACH(jump, after);
+      break;
+    case OP_FOR_PREP:
+      REACH(next, after);
+      // Nothing is pushed when the range is empty.
+      REACH(next + jump, height);
+      break;
+    case OP_FOR_LOOP:
+      REACH(next, after);
+      REACH(jump, after);
+      break;
+    default:
+      REACH(next, after);
+      break;
+    }
+  }
+
+#undef REACH
+
+done:
+  FREE_ARRAY(int, heights, chunk->count);
+  FREE_ARRAY(bool, isStart, chunk->count);
+  FREE_ARRAY(int, worklist, chunk->count);
+  return problem;
+}
@@ -2,8 +2,24 @@
 #define oba_debug_h
 
 #include "oba_chunk.h"
+#include "oba_function.h"
 
 int disassembleInstruction(Chunk*, int);
 int disassemble(Chunk*, const char*);
 
+// Returns the stack effect of the instruction at [offset], when execution
+// continues at the next instruction.
+int instructionStackEffect(Chunk*, int offset);
+
+// Checks that the bytecode of [function] is well-formed.
+//
+// Every instruction must be reachable only with the same number of values on
+// the stack, which must never be negative or exceed the function's maxSlots.
+// Every jump must land on an instruction, and every operand must refer to a
+// constant, local or upvalue that exists.
+//
+// Nested functions are not checked. Returns a description of the first problem
+// found, or NULL if there is none.
+const char* verifyFunction(ObjFunction*);
+
 #endif
@@ -4,20 +4,31 @@
 
 ObjFunction* newFunction(ObaVM* vm, ObjModule* module) {
   ObjFunction* function = ALLOCATE_OBJ(vm, ObjFunction, OBJ_FUNCTION);
+  initFunction(function, module);
+  return function;
+}
+
+void initFunction(ObjFunction* function, ObjModule* module) {
   initChunk(&function->chunk);
   function->arity = 0;
   function->module = module;
   function->upvalueCount = 0;
+  function->maxSlots = 0;
   function->name = NULL;
+  function->source = NULL;
+  function->line = 0;
 }
 
-ObjClosure* newClosure(ObaVM* vm, ObjFunction* function) {
+ObjClosure* newClosure(ObaVM* vm, ObjFunction* function, ObjModule* module) {
   ObjClosure* closure = ALLOCATE_OBJ(vm, ObjClosure, OBJ_CLOSURE);
   ObjUpvalue** upvalues = ALLOCATE(ObjUpvalue*, function->upvalueCount);
   for (int i = 0; i < function->upvalueCount; i++) {
     upvalues[i] = NULL;
   }
   closure->function = function;
+  closure->module = module;
+  closure->nextInModule = module->closures;
+  module->closures = closure;
   closure->upvalues = upvalues;
   closure->upvalueCount = function->upvalueCount;
   return closure;
@@ -29,3 +40,15 @@ ObjUpvalue* newUpvalue(ObaVM* vm, Value* slot) {
   upvalue->next = NULL;
   return upvalue;
 }
+
+ObjFiber* newFiber(ObaVM* vm, ObjClosure* closure) {
+  ObjFiber* fiber = ALLOCATE_OBJ(vm, ObjFiber, OBJ_FIBER);
+  fiber->frame = fiber->frames;
+  fiber->stackTop = fiber->stack;
+  fiber->apiStack = fiber->stack;
+  fiber->nativeCalls = 0;
+  fiber->openUpvalues = NULL;
+  fiber->closure = closure;
+  fiber->caller = NULL;
+  return fiber;
+}
@@ -40,15 +40,36 @@ typedef struct {
   // The number of upvalues this function closes over.
   int upvalueCount;
 
-  // The module where this function is defined.
+  // The maximum number of stack slots this function uses at once, including
+  // its parameters.
+  int maxSlots;
+
+  // The module this function was compiled as part of. Its name is used to
+  // describe the function. The variables the function reads are those of the
+  // module of the closure running it, since the same compiled function may be
+  // shared by modules in many VMs.
   ObjModule* module;
+
+  // The source of the function's parameters and body, if they have not been
+  // compiled yet, and the line it starts on.
+  //
+  // Large functions declared at the top level of a module only keep their
+  // code once they are first called. Until then it is empty.
+  ObjString* source;
+  int line;
 } ObjFunction;
 
 // An instance of ObjFunction which captures the values in the function's
 // lexical scope at runtime.
-typedef struct {
+typedef struct ObjClosure {
   Obj obj;
   ObjFunction* function;
+
+  // The module whose variables the function reads and defines, and the
+  // closure created in it before this one.
+  ObjModule* module;
+  struct ObjClosure* nextInModule;
+
   ObjUpvalue** upvalues;
   int upvalueCount;
 } ObjClosure;
@@ -59,8 +80,53 @@ typedef struct {
   Value* slots;
 } CallFrame;
 
+// The maximum number of values that can be held on the stack at once.
+#define STACK_MAX 256
+
+// The maximum number of call-frames.
+#define FRAMES_MAX 256
+
+// A thread of execution with its own stack, which can be suspended and resumed.
+//
+// Every VM starts running in a fiber of its own. A fiber created by Oba code
+// runs its function when it is first resumed, and runs until it yields or the
+// function returns, at which point the fiber that resumed it continues. The VM
+// switches between fibers by changing which one it is running.
+typedef struct ObjFiber {
+  Obj obj;
+
+  CallFrame frames[FRAMES_MAX];
+  Value stack[STACK_MAX];
+
+  // Where the fiber is, saved from the VM while another fiber runs.
+  CallFrame* frame;
+  Value* stackTop;
+  Value* apiStack;
+  ObjUpvalue* openUpvalues;
+
+  // The calls natives running in the fiber have made back into Oba code that
+  // have not returned. The fiber cannot yield while there are any, since the
+  // natives are still on the C stack.
+  int nativeCalls;
+
+  // The function the fiber runs, until it is first resumed.
+  ObjClosure* closure;
+
+  // The fiber that resumed this one, while it runs.
+  struct ObjFiber* caller;
+} ObjFiber;
+
 ObjFunction* newFunction(ObaVM*, ObjModule*);
-ObjClosure* newClosure(ObaVM*, ObjFunction*);
+
+// Initializes [function] as an empty function in [module], without allocating
+// it on the VM's heap.
+void initFunction(ObjFunction* function, ObjModule* module);
+
+ObjClosure* newClosure(ObaVM*, ObjFunction*, ObjModule*);
 ObjUpvalue* newUpvalue(ObaVM*, Value*);
 
+// Creates a fiber that runs [closure] when it is first resumed, or an empty
+// fiber to run code in if [closure] is NULL.
+ObjFiber* newFiber(ObaVM* vm, ObjClosure* closure);
+
 #endif
@@ -0,0 +1,323 @@
+#include <errno.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <unistd.h>
+
+#include "oba.h"
+#include "oba_common.h"
+#include "oba_loop.h"
+#include "oba_vm.h"
+
+// The most bytes read from standard input at once.
+#define INPUT_CHUNK_SIZE 4096
+
+typedef enum {
+  WAIT_TIMER,
+  WAIT_BYTE,
+  WAIT_LINE,
+} WaitKind;
+
+struct Wait {
+  ObaVM* vm;
+  WaitKind kind;
+
+  // The timerfd of a [WAIT_TIMER], or -1.
+  int fd;
+
+  // The loop's other waits, in the order they started.
+  struct Wait* prev;
+  struct Wait* next;
+};
+
+struct ObaEventLoop {
+  int epoll;
+
+  // Every wait in progress, oldest first.
+  Wait* first;
+  Wait* last;
+
+  // The number of waits for input, and whether standard input is watched,
+  // which it is while there are any unless it is a regular file. Those cannot
+  // be watched, but reading them never blocks.
+  int inputWaits;
+  bool watchingInput;
+
+  // What has been read from standard input that no VM has taken yet, and
+  // whether the end of the input has been reached.
+  char* input;
+  size_t inputLength;
+  size_t inputCapacity;
+  bool inputEnded;
+};
+
+ObaEventLoop* obaNewEventLoop(void) {
+  int epoll = epoll_create1(EPOLL_CLOEXEC);
+  if (epoll == -1)
+    return NULL;
+
+  ObaEventLoop* loop = ALLOCATE(ObaEventLoop, 1);
+  loop->epoll = epoll;
+  loop->first = NULL;
+  loop->last = NULL;
+  loop->inputWaits = 0;
+  loop->watchingInput = false;
+  loop->input = NULL;
+  loop->inputLength = 0;
+  loop->inputCapacity = 0;
+  loop->inputEnded = false;
+  return loop;
+}
+
+void obaFreeEventLoop(ObaEventLoop* loop) {
+  // The VMs still waiting are detached from the loop, and stay suspended.
+  Wait* wait = loop->first;
+  while (wait != NULL) {
+    Wait* next = wait->next;
+    if (wait->fd != -1) {
+      close(wait->fd);
+    }
+    wait->vm->wait = NULL;
+    wait->vm->loop = NULL;
+    FREE(Wait, wait);
+    wait = next;
+  }
+
+  close(loop->epoll);
+  FREE_ARRAY(char, loop->input, loop->inputCapacity);
+  FREE(ObaEventLoop, loop);
+}
+
+void obaSetEventLoop(ObaVM* vm, ObaEventLoop* loop) {
+  ASSERT(vm->wait == NULL, "The VM should not be waiting");
+  vm->loop = loop;
+}
+
+// Starts a wait of [kind] for [vm], which is suspended once its native returns.
+static Wait* addWait(ObaEventLoop* loop, ObaVM* vm, WaitKind kind, int fd) {
+  Wait* wait = ALLOCATE(Wait, 1);
+  wait->vm = vm;
+  wait->kind = kind;
+  wait->fd = fd;
+  wait->prev = loop->last;
+  wait->next = NULL;
+  if (loop->last != NULL) {
+    loop->last->next = wait;
+  } else {
+    loop->first = wait;
+  }
+  loop->last = wait;
+  vm->wait = wait;
+  return wait;
+}
+
+static void removeWait(ObaEventLoop* loop, Wait* wait) {
+  if (wait->prev != NULL) {
+    wait->prev->next = wait->next;
+  } else {
+    loop->first = wait->next;
+  }
+  if (wait->next != NULL) {
+    wait->next->prev = wait->prev;
+  } else {
+    loop->last = wait->prev;
+  }
+
+  if (wait->fd != -1) {
+    epoll_ctl(loop->epoll, EPOLL_CTL_DEL, wait->fd, NULL);
+    close(wait->fd);
+  } else if (--loop->inputWaits == 0 && loop->watchingInput) {
+    epoll_ctl(loop->epoll, EPOLL_CTL_DEL, STDIN_FILENO, NULL);
+    loop->watchingInput = false;
+  }
+
+  wait->vm->wait = NULL;
+  FREE(Wait, wait);
+}
+
+void cancelWait(ObaVM* vm) { removeWait(vm->loop, vm->wait); }
+
+bool waitForTimer(ObaVM* vm, double seconds) {
+  if (vm->loop == NULL || !canSuspend(vm))
+    return false;
+
+  struct itimerspec timer;
+  memset(&timer, 0, sizeof(timer));
+  timer.it_value.tv_sec = (time_t)seconds;
+  timer.it_value.tv_nsec =
+      (long)((seconds - (double)timer.it_value.tv_sec) * 1e9);
+
+  // A zero timer is disarmed rather than expired, and the native does not need
+  // to wait for one anyway.
+  if (timer.it_value.tv_sec <= 0 && timer.it_value.tv_nsec <= 0)
+    return false;
+
+  int fd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC);
+  if (fd == -1)
+    return false;
+  if (timerfd_settime(fd, 0, &timer, NULL) == -1) {
+    close(fd);
+    return false;
+  }
+
+  Wait* wait = addWait(vm->loop, vm, WAIT_TIMER, fd);
+  struct epoll_event event;
+  event.events = EPOLLIN;
+  event.data.ptr = wait;
+  if (epoll_ctl(vm->loop->epoll, EPOLL_CTL_ADD, fd, &event) == -1) {
+    removeWait(vm->loop, wait);
+    return false;
+  }
+  return true;
+}
+
+// Reads what standard input has into [loop]'s buffer, blocking until it has
+// something or ends.
+static void readInput(ObaEventLoop* loop) {
+  if (loop->inputCapacity - loop->inputLength < INPUT_CHUNK_SIZE) {
+    size_t capacity = loop->inputLength + INPUT_CHUNK_SIZE;
+    loop->input =
+        GROW_ARRAY(char, loop->input, loop->inputCapacity, capacity);
+    loop->inputCapacity = capacity;
+  }
+
+  ssize_t length;
+  do {
+    length = read(STDIN_FILENO, loop->input + loop->inputLength,
+                  INPUT_CHUNK_SIZE);
+  } while (length == -1 && errno == EINTR);
+
+  // Input that another process made non-blocking has nothing yet.
+  if (length == -1 && (errno == EAGAIN || errno == EWOULDBLOCK))
+    return;
+
+  if (length <= 0) {
+    loop->inputEnded = true;
+  } else {
+    loop->inputLength += (size_t)length;
+  }
+}
+
+// Takes the next line, or byte if [line] is false, from [loop]'s buffer and
+// stores it in [value] as a string in [vm], or nil at the end of the input.
+//
+// Returns false if there is not enough input yet.
+static bool takeInput(ObaEventLoop* loop, ObaVM* vm, bool line,
+                      Value* value) {
+  size_t length = loop->inputLength;
+  if (line && length > 0) {
+    char* end = memchr(loop->input, '\n', loop->inputLength);
+    if (end != NULL) {
+      length = (size_t)(end - loop->input) + 1;
+    }
+    if (end == NULL && !loop->inputEnded)
+      return false;
+  } else if (!line && length > 0) {
+    length = 1;
+  } else if (!loop->inputEnded) {
+    return false;
+  }
+
+  if (length == 0) {
+    *value = NIL_VAL;
+    return true;
+  }
+  *value = OBJ_VAL(copyString(vm, loop->input, (int)length));
+  loop->inputLength -= length;
+  memmove(loop->input, loop->input + length, loop->inputLength);
+  return true;
+}
+
+bool waitForInput(ObaVM* vm, bool line) {
+  ObaEventLoop* loop = vm->loop;
+  if (loop == NULL)
+    return false;
+
+  // VMs that started waiting earlier are given input first.
+  Value value;
+  if (loop->inputWaits == 0 && takeInput(loop, vm, line, &value)) {
+    vm->apiStack[0] = value;
+    return true;
+  }
+
+  if (!canSuspend(vm)) {
+    while (!takeInput(loop, vm, line, &value)) {
+      readInput(loop);
+    }
+    vm->apiStack[0] = value;
+    return true;
+  }
+
+  addWait(loop, vm, line ? WAIT_LINE : WAIT_BYTE, -1);
+  loop->inputWaits++;
+  if (!loop->watchingInput) {
+    struct epoll_event event;
+    event.events = EPOLLIN;
+    event.data.ptr = NULL;
+    loop->watchingInput =
+        epoll_ctl(loop->epoll, EPOLL_CTL_ADD, STDIN_FILENO, &event) == 0;
+  }
+  return true;
+}
+
+// Returns the oldest wait for input in [loop], or NULL if there is none.
+static Wait* firstInputWait(ObaEventLoop* loop) {
+  if (loop->inputWaits == 0)
+    return NULL;
+
+  Wait* wait = loop->first;
+  while (wait->kind == WAIT_TIMER) {
+    wait = wait->next;
+  }
+  return wait;
+}
+
+// Ends [wait], and resumes its VM with [value] as the result of the native
+// that started it.
+static ObaVM* resumeWait(ObaEventLoop* loop, Wait* wait, Value value,
+                         ObaInterpretResult* result) {
+  ObaVM* vm = wait->vm;
+  removeWait(loop, wait);
+  setSuspendedResult(vm, value);
+  *result = obaResume(vm);
+  return vm;
+}
+
+ObaVM* obaRunEventLoop(ObaEventLoop* loop, ObaInterpretResult* result) {
+  while (loop->first != NULL) {
+    Wait* wait = firstInputWait(loop);
+    Value value;
+    if (wait != NULL &&
+        takeInput(loop, wait->vm, wait->kind == WAIT_LINE, &value)) {
+      return resumeWait(loop, wait, value, result);
+    }
+
+    if (wait != NULL && !loop->watchingInput) {
+      readInput(loop);
+      continue;
+    }
+
+    struct epoll_event event;
+    int count = epoll_wait(loop->epoll, &event, 1, -1);
+    if (count == -1 && errno == EINTR)
+      continue;
+    if (count != 1)
+      return NULL;
+
+    // Standard input is the only thing watched without a wait of its own.
+    if (event.data.ptr == NULL) {
+      readInput(loop);
+      continue;
+    }
+
+    wait = (Wait*)event.data.ptr;
+    uint64_t expirations;
+    if (read(wait->fd, &expirations, sizeof(expirations)) == -1 &&
+        errno == EAGAIN) {
+      continue;
+    }
+    return resumeWait(loop, wait, OBA_NUMBER(0), result);
+  }
+  return NULL;
+}
@@ -0,0 +1,42 @@
+#ifndef oba_loop_h
+#define oba_loop_h
+
+#include <stdbool.h>
+
+#include "oba.h"
+
+// The event loop that natives wait for I/O on instead of blocking.
+//
+// A native that would block registers what it waits for with the loop of its
+// VM, and returns. The VM then suspends the code that called the native, the
+// same way as when it runs out of fuel, and returns [OBA_RESULT_WAITING] to
+// the host. Once the I/O is ready, [obaRunEventLoop] stores the native's result
+// where the suspended code expects it and resumes the VM.
+//
+// A suspended VM waits for one thing at a time, so each VM has at most one
+// [Wait]. Standard input is read into a buffer owned by the loop, which hands
+// it out to the VMs waiting for it in the order they started waiting.
+typedef struct Wait Wait;
+
+// Suspends the code that called the running native of [vm] until [seconds]
+// have passed.
+//
+// Returns false if the native should block instead, which it should if [vm] is
+// not attached to an event loop or the code cannot be suspended.
+bool waitForTimer(ObaVM* vm, double seconds);
+
+// Reads a line from standard input, or a single byte if [line] is false,
+// through the event loop [vm] is attached to, and stores it in slot 0. At the
+// end of the input, the slot holds what is left, or nil if nothing is.
+//
+// If the input has not arrived yet, the code that called the running native is
+// suspended until it has, or the native blocks if the code cannot be.
+//
+// Returns false if [vm] is not attached to an event loop.
+bool waitForInput(ObaVM* vm, bool line);
+
+// Stops waiting for what [vm] is waiting for, because the code waiting for it
+// has been abandoned.
+void cancelWait(ObaVM* vm);
+
+#endif
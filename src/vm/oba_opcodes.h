@@ -1,36 +1,84 @@
-OPCODE(CONSTANT)
-OPCODE(ERROR)
-OPCODE(ADD)
-OPCODE(MINUS)
-OPCODE(MULTIPLY)
-OPCODE(DIVIDE)
-OPCODE(TRUE)
-OPCODE(FALSE)
-OPCODE(NOT)
-OPCODE(GT)
-OPCODE(LT)
-OPCODE(GTE)
-OPCODE(LTE)
-OPCODE(EQ)
-OPCODE(NEQ)
-OPCODE(POP)
-OPCODE(DEBUG)
-OPCODE(DEFINE_GLOBAL)
-OPCODE(GET_GLOBAL)
-OPCODE(GET_LOCAL)
-OPCODE(GET_UPVALUE)
-OPCODE(SET_UPVALUE)
-OPCODE(SET_LOCAL)
-OPCODE(IMPORT_MODULE)
-OPCODE(GET_IMPORTED_VARIABLE)
-OPCODE(JUMP)
-OPCODE(JUMP_IF_FALSE)
-OPCODE(JUMP_IF_TRUE)
-OPCODE(JUMP_IF_NOT_MATCH)
-OPCODE(LOOP)
-OPCODE(CALL)
-OPCODE(CLOSURE)
-OPCODE(CLOSE_UPVALUE)
-OPCODE(RETURN)
-OPCODE(END_MODULE)
-OPCODE(EXIT)
+// This defines the bytecode instructions used by the VM.
+//
+// Each instruction is listed with its stack effect: the number of values it
+// pushes onto the stack minus the number it pops, when execution continues at
+// the next instruction. This is used by the compiler to track the height of the
+// stack, and by the verifier to check it.
+//
+// The effect of OP_CALL depends on its operand, and is listed as 0 here. A call
+// with N arguments pops the function and its arguments and pushes the result,
+// so its real effect is -N.
+//
+// OP_JUMP_IF_NOT_MATCH pops both the pattern and the value being matched when
+// they match, and only the pattern when it jumps.
+//
+// OP_FOR_PREP pushes the loop variable when the range is not empty, and pushes
+// nothing when it jumps past the loop.
+//
+// The fused forms of the binary operators read their operands directly from the
+// frame instead of the stack: _LL reads two local slots and _LK a local slot and
+// a constant. The compiler only emits them when built with OBA_PEEPHOLE.
+
+OPCODE(CONSTANT, 1)
+OPCODE(ERROR, 0)
+OPCODE(ADD, -1)
+OPCODE(MINUS, -1)
+OPCODE(MULTIPLY, -1)
+OPCODE(DIVIDE, -1)
+OPCODE(TRUE, 1)
+OPCODE(FALSE, 1)
+OPCODE(NOT, 0)
+OPCODE(GT, -1)
+OPCODE(LT, -1)
+OPCODE(GTE, -1)
+OPCODE(LTE, -1)
+OPCODE(EQ, -1)
+OPCODE(NEQ, -1)
+OPCODE(ADD_NN, -1)
+OPCODE(MINUS_NN, -1)
+OPCODE(MULTIPLY_NN, -1)
+OPCODE(DIVIDE_NN, -1)
+OPCODE(GT_NN, -1)
+OPCODE(LT_NN, -1)
+OPCODE(GTE_NN, -1)
+OPCODE(LTE_NN, -1)
+OPCODE(ADD_LL, 1)
+OPCODE(MINUS_LL, 1)
+OPCODE(MULTIPLY_LL, 1)
+OPCODE(DIVIDE_LL, 1)
+OPCODE(GT_LL, 1)
+OPCODE(LT_LL, 1)
+OPCODE(GTE_LL, 1)
+OPCODE(LTE_LL, 1)
+OPCODE(ADD_LK, 1)
+OPCODE(MINUS_LK, 1)
+OPCODE(MULTIPLY_LK, 1)
+OPCODE(DIVIDE_LK, 1)
+OPCODE(GT_LK, 1)
+OPCODE(LT_LK, 1)
+OPCODE(GTE_LK, 1)
+OPCODE(LTE_LK, 1)
+OPCODE(POP, -1)
+OPCODE(DEBUG, -1)
+OPCODE(DEFINE_GLOBAL, -1)
+OPCODE(GET_GLOBAL, 1)
+OPCODE(GET_LOCAL, 1)
+OPCODE(GET_UPVALUE, 1)
+OPCODE(SET_UPVALUE, 0)
+OPCODE(SET_LOCAL, 0)
+OPCODE(STORE_LOCAL, -1)
+OPCODE(IMPORT_MODULE, 1)
+OPCODE(GET_IMPORTED_VARIABLE, 0)
+OPCODE(JUMP, 0)
+OPCODE(JUMP_IF_FALSE, 0)
+OPCODE(JUMP_IF_TRUE, 0)
+OPCODE(JUMP_IF_NOT_MATCH, -2)
+OPCODE(LOOP, 0)
+OPCODE(FOR_PREP, 1)
+OPCODE(FOR_LOOP, 0)
+OPCODE(CALL, 0)
+OPCODE(CLOSURE, 1)
+OPCODE(CLOSE_UPVALUE, -1)
+OPCODE(RETURN, -1)
+OPCODE(END_MODULE, 0)
+OPCODE(EXIT, 0)
@@ -0,0 +1,119 @@
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "oba.h"
+#include "oba_common.h"
+
+struct ObaVMPool {
+  pthread_mutex_t lock;
+
+  // Signaled when a VM is released.
+  pthread_cond_t released;
+
+  // The VMs that are not in use, and how many there are.
+  ObaVM** idle;
+  int idleCount;
+  int idleCapacity;
+
+  // The number of VMs in the pool, including the ones in use.
+  int size;
+
+  // What each VM is created with.
+  ObaSharedCode* sharedCode;
+  Builtin* builtins;
+  int builtinsLength;
+  char* snapshot;
+};
+
+// Creates a VM for [pool], or returns NULL if its snapshot cannot be loaded.
+static ObaVM* newPoolVM(ObaVMPool* pool) {
+  ObaVM* vm = obaNewVM(pool->builtins, pool->builtinsLength);
+  obaSetSharedCode(vm, pool->sharedCode);
+  if (pool->snapshot != NULL && !obaLoadSnapshot(vm, pool->snapshot)) {
+    obaFreeVM(vm);
+    return NULL;
+  }
+  return vm;
+}
+
+ObaVMPool* obaNewVMPool(int size, Builtin* builtins, int builtinsLength,
+                        const char* snapshot) {
+  ObaVMPool* pool = ALLOCATE(ObaVMPool, 1);
+  pthread_mutex_init(&pool->lock, NULL);
+  pthread_cond_init(&pool->released, NULL);
+  pool->idle = ALLOCATE(ObaVM*, size);
+  pool->idleCount = 0;
+  pool->idleCapacity = size;
+  pool->size = size;
+  pool->sharedCode = obaNewSharedCode();
+  pool->builtins = builtins;
+  pool->builtinsLength = builtinsLength;
+  pool->snapshot = NULL;
+  if (snapshot != NULL) {
+    size_t length = strlen(snapshot);
+    pool->snapshot = ALLOCATE(char, length + 1);
+    memcpy(pool->snapshot, snapshot, length + 1);
+  }
+
+  for (int i = 0; i < size; i++) {
+    ObaVM* vm = newPoolVM(pool);
+    if (vm == NULL) {
+      pool->size = pool->idleCount;
+      obaFreeVMPool(pool);
+      return NULL;
+    }
+    pool->idle[pool->idleCount++] = vm;
+  }
+  return pool;
+}
+
+void obaFreeVMPool(ObaVMPool* pool) {
+  ASSERT(pool->idleCount == pool->size, "Every VM should be released");
+  for (int i = 0; i < pool->idleCount; i++) {
+    obaFreeVM(pool->idle[i]);
+  }
+
+  if (pool->snapshot != NULL) {
+    FREE_ARRAY(char, pool->snapshot, strlen(pool->snapshot) + 1);
+  }
+  FREE_ARRAY(ObaVM*, pool->idle, pool->idleCapacity);
+  obaFreeSharedCode(pool->sharedCode);
+  pthread_mutex_destroy(&pool->lock);
+  pthread_cond_destroy(&pool->released);
+  FREE(ObaVMPool, pool);
+}
+
+ObaVM* obaAcquireVM(ObaVMPool* pool) {
+  pthread_mutex_lock(&pool->lock);
+  while (pool->idleCount == 0 && pool->size > 0) {
+    pthread_cond_wait(&pool->released, &pool->lock);
+  }
+
+  ObaVM* vm = NULL;
+  if (pool->idleCount > 0) {
+    vm = pool->idle[--pool->idleCount];
+  }
+  pthread_mutex_unlock(&pool->lock);
+  return vm;
+}
+
+void obaReleaseVM(ObaVMPool* pool, ObaVM* vm) {
+  // Objects are never freed while a VM runs, so the only way to reclaim what a
+  // script allocated is to start over. Restoring a snapshot is cheap, and is
+  // done here rather than in [obaAcquireVM] so that it is not on the path of
+  // the next script.
+  obaFreeVM(vm);
+  vm = newPoolVM(pool);
+
+  pthread_mutex_lock(&pool->lock);
+  if (vm != NULL) {
+    pool->idle[pool->idleCount++] = vm;
+  } else {
+    // The snapshot is gone, so the pool shrinks rather than hand out a VM
+    // that is missing its variables.
+    pool->size--;
+  }
+  pthread_cond_broadcast(&pool->released);
+  pthread_mutex_unlock(&pool->lock);
+}
@@ -0,0 +1,230 @@
+#include <pthread.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "oba_bytecode.h"
+#include "oba_common.h"
+#include "oba_prefetch.h"
+#include "oba_shared.h"
+#include "oba_vm.h"
+
+// The most threads that compile modules at once.
+#define MAX_WORKERS 4
+
+struct Prefetcher {
+  pthread_mutex_t lock;
+
+  // Signaled when a job is queued, or the workers should stop.
+  pthread_cond_t queued;
+
+  // Signaled when a job is done.
+  pthread_cond_t finished;
+
+  // The jobs that have not been taken yet, oldest first.
+  PrefetchJob* jobs;
+
+  pthread_t workers[MAX_WORKERS];
+  int workerCount;
+  int maxWorkers;
+  bool stopping;
+};
+
+static void compileJob(PrefetchJob* job) {
+  ObaVM* heap = newHeap();
+  heap->sharedCode = job->sharedCode;
+  ObjModule* module =
+      newModule(heap, copyString(heap, job->name, (int)strlen(job->name)));
+  job->function = compileCached(heap, module, job->result.source);
+  job->heap = heap;
+}
+
+// Returns the oldest job that no thread has started on, or NULL if there is
+// none. Must be called with the lock held.
+static PrefetchJob* nextQueued(Prefetcher* prefetcher) {
+  for (PrefetchJob* job = prefetcher->jobs; job != NULL; job = job->next) {
+    if (job->state == PREFETCH_QUEUED)
+      return job;
+  }
+  return NULL;
+}
+
+static void* runWorker(void* arg) {
+  Prefetcher* prefetcher = (Prefetcher*)arg;
+
+  pthread_mutex_lock(&prefetcher->lock);
+  while (!prefetcher->stopping) {
+    PrefetchJob* job = nextQueued(prefetcher);
+    if (job == NULL) {
+      pthread_cond_wait(&prefetcher->queued, &prefetcher->lock);
+      continue;
+    }
+
+    job->state = PREFETCH_RUNNING;
+    pthread_mutex_unlock(&prefetcher->lock);
+    compileJob(job);
+    pthread_mutex_lock(&prefetcher->lock);
+    job->state = PREFETCH_DONE;
+    pthread_cond_broadcast(&prefetcher->finished);
+  }
+  pthread_mutex_unlock(&prefetcher->lock);
+  return NULL;
+}
+
+Prefetcher* newPrefetcher(void) {
+  Prefetcher* prefetcher = ALLOCATE(Prefetcher, 1);
+  pthread_mutex_init(&prefetcher->lock, NULL);
+  pthread_cond_init(&prefetcher->queued, NULL);
+  pthread_cond_init(&prefetcher->finished, NULL);
+  prefetcher->jobs = NULL;
+  prefetcher->workerCount = 0;
+  prefetcher->stopping = false;
+
+  // Leave a core for the thread running the program.
+  long cores = sysconf(_SC_NPROCESSORS_ONLN);
+  prefetcher->maxWorkers = cores > MAX_WORKERS ? MAX_WORKERS : (int)cores - 1;
+  if (prefetcher->maxWorkers < 1)
+    prefetcher->maxWorkers = 1;
+  return prefetcher;
+}
+
+static void freeJob(PrefetchJob* job) {
+  FREE_ARRAY(char, job->name, strlen(job->name) + 1);
+  FREE(PrefetchJob, job);
+}
+
+void freePrefetcher(ObaVM* vm, Prefetcher* prefetcher) {
+  pthread_mutex_lock(&prefetcher->lock);
+  prefetcher->stopping = true;
+  pthread_cond_broadcast(&prefetcher->queued);
+  pthread_mutex_unlock(&prefetcher->lock);
+
+  for (int i = 0; i < prefetcher->workerCount; i++) {
+    pthread_join(prefetcher->workers[i], NULL);
+  }
+
+  PrefetchJob* job = prefetcher->jobs;
+  while (job != NULL) {
+    PrefetchJob* next = job->next;
+    if (job->heap != NULL) {
+      freeHeap(job->heap);
+    }
+    if (job->result.onComplete != NULL) {
+      job->result.onComplete(vm, job->name, job->result);
+    }
+    freeJob(job);
+    job = next;
+  }
+
+  pthread_mutex_destroy(&prefetcher->lock);
+  pthread_cond_destroy(&prefetcher->queued);
+  pthread_cond_destroy(&prefetcher->finished);
+  FREE(Prefetcher, prefetcher);
+}
+
+// Returns the link to the job for the module [name], which is NULL if there is
+// none. Must be called with the lock held.
+static PrefetchJob** findJob(Prefetcher* prefetcher, const char* name) {
+  PrefetchJob** job = &prefetcher->jobs;
+  while (*job != NULL && strcmp((*job)->name, name) != 0) {
+    job = &(*job)->next;
+  }
+  return job;
+}
+
+bool isPrefetching(Prefetcher* prefetcher, const char* name) {
+  pthread_mutex_lock(&prefetcher->lock);
+  bool found = *findJob(prefetcher, name) != NULL;
+  pthread_mutex_unlock(&prefetcher->lock);
+  return found;
+}
+
+void queuePrefetch(Prefetcher* prefetcher, const char* name,
+                   ObaLoadModuleResult result, ObaSharedCode* sharedCode) {
+  size_t length = strlen(name);
+  PrefetchJob* job = ALLOCATE(PrefetchJob, 1);
+  job->name = ALLOCATE(char, length + 1);
+  memcpy(job->name, name, length + 1);
+  job->result = result;
+  job->sharedCode = sharedCode;
+  job->heap = NULL;
+  job->function = NULL;
+  job->state = result.source != NULL ? PREFETCH_QUEUED : PREFETCH_DONE;
+  job->next = NULL;
+
+  pthread_mutex_lock(&prefetcher->lock);
+  *findJob(prefetcher, name) = job;
+
+  if (job->state == PREFETCH_QUEUED) {
+    // Workers are only started once there is something to compile. If one
+    // cannot be started, the module is compiled when it is imported.
+    if (prefetcher->workerCount < prefetcher->maxWorkers &&
+        pthread_create(&prefetcher->workers[prefetcher->workerCount], NULL,
+                       runWorker, prefetcher) == 0) {
+      prefetcher->workerCount++;
+    }
+    pthread_cond_signal(&prefetcher->queued);
+  }
+  pthread_mutex_unlock(&prefetcher->lock);
+}
+
+PrefetchJob* takePrefetch(Prefetcher* prefetcher, const char* name) {
+  pthread_mutex_lock(&prefetcher->lock);
+  PrefetchJob** slot = findJob(prefetcher, name);
+  PrefetchJob* job = *slot;
+  if (job == NULL) {
+    pthread_mutex_unlock(&prefetcher->lock);
+    return NULL;
+  }
+  *slot = job->next;
+
+  // Compile the module here rather than wait for a worker to get to it.
+  if (job->state == PREFETCH_QUEUED) {
+    job->state = PREFETCH_RUNNING;
+    pthread_mutex_unlock(&prefetcher->lock);
+    compileJob(job);
+    job->state = PREFETCH_DONE;
+    return job;
+  }
+
+  while (job->state != PREFETCH_DONE) {
+    pthread_cond_wait(&prefetcher->finished, &prefetcher->lock);
+  }
+  pthread_mutex_unlock(&prefetcher->lock);
+  return job;
+}
+
+ObjFunction* finishPrefetch(ObaVM* vm, PrefetchJob* job) {
+  ObjFunction* function = job->function;
+  ObaVM* heap = job->heap;
+  freeJob(job);
+  if (heap == NULL)
+    return NULL;
+
+  if (heap->objects != NULL) {
+    Obj* last = heap->objects;
+    while (last->next != NULL) {
+      last = last->next;
+    }
+    last->next = vm->objects;
+    vm->objects = heap->objects;
+    heap->objects = NULL;
+  }
+
+  if (heap->images != NULL) {
+    MappedImage* last = heap->images;
+    while (last->next != NULL) {
+      last = last->next;
+    }
+    last->next = vm->images;
+    vm->images = heap->images;
+    heap->images = NULL;
+  }
+
+  for (int i = 0; i < heap->imports.count; i++) {
+    writeValueArray(&vm->imports, heap->imports.values[i]);
+  }
+  adoptSharedModules(vm, heap);
+
+  freeHeap(heap);
+  return function;
+}
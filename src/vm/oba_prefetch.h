@@ -0,0 +1,76 @@
+#ifndef oba_prefetch_h
+#define oba_prefetch_h
+
+#include <stdbool.h>
+
+#include "oba.h"
+#include "oba_function.h"
+#include "oba_value.h"
+
+// Imported modules compiled on worker threads ahead of their import.
+//
+// The compiler collects the names of the modules that a module imports. Once
+// it is done, the VM finds the source of each one that is not loaded yet and
+// queues it here, to be compiled while the importing module runs. When the
+// import runs, it only waits for a module that is still being compiled, or
+// compiles it itself if no worker has started on it.
+//
+// Objects cannot be allocated in the VM from another thread, so each module is
+// compiled into a private heap of its own, which is merged into the VM once the
+// module is imported.
+typedef struct Prefetcher Prefetcher;
+
+typedef enum {
+  PREFETCH_QUEUED,
+  PREFETCH_RUNNING,
+  PREFETCH_DONE,
+} PrefetchState;
+
+// A module queued by [queuePrefetch].
+typedef struct PrefetchJob {
+  // The name the module is registered under.
+  char* name;
+
+  // The module's source or bytecode. Only source is compiled.
+  ObaLoadModuleResult result;
+
+  // Where the module is shared from, or NULL if it is compiled for one VM.
+  ObaSharedCode* sharedCode;
+
+  // The heap the module was compiled into, and its top-level function, which
+  // is NULL if it did not compile.
+  ObaVM* heap;
+  ObjFunction* function;
+
+  // Guarded by the prefetcher's lock.
+  PrefetchState state;
+  struct PrefetchJob* next;
+} PrefetchJob;
+
+Prefetcher* newPrefetcher(void);
+
+// Waits for the workers of [prefetcher] to finish the modules they are
+// compiling, then frees it along with every module that was never imported.
+//
+// The [onComplete] callback of each of those modules is called with [vm].
+void freePrefetcher(ObaVM* vm, Prefetcher* prefetcher);
+
+// Returns true if the module [name] has been queued and not taken yet.
+bool isPrefetching(Prefetcher* prefetcher, const char* name);
+
+// Queues the module [name], whose source or bytecode is [result], to be
+// compiled through [sharedCode] if it is not NULL.
+void queuePrefetch(Prefetcher* prefetcher, const char* name,
+                   ObaLoadModuleResult result, ObaSharedCode* sharedCode);
+
+// Removes the module [name] from [prefetcher] and returns it once it has been
+// compiled, or NULL if it was never queued.
+PrefetchJob* takePrefetch(Prefetcher* prefetcher, const char* name);
+
+// Moves the heap of [job] into [vm] and frees [job].
+//
+// Returns the module's top-level function, or NULL if there is none. The
+// modules it imports are added to the VM's imports.
+ObjFunction* finishPrefetch(ObaVM* vm, PrefetchJob* job);
+
+#endif
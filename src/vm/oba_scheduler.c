@@ -0,0 +1,639 @@
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "oba.h"
+#include "oba_common.h"
+#include "oba_scheduler.h"
+#include "oba_vm.h"
+
+// The number of tasks a deque has room for before it first grows.
+#define DEQUE_CAPACITY 64
+
+// The fuel a task runs with before it is suspended to let others run, in
+// builds that count fuel.
+#define TASK_SLICE 10000
+
+// How often, in tasks taken, a worker takes a task from the scheduler's queue
+// before its own deque, so that tasks in the queue are not held up forever by
+// a worker that keeps spawning more.
+#define QUEUE_INTERVAL 61
+
+// Keeps the fields written by thieves from sharing a cache line with the ones
+// written by the owner of a deque, or by another worker.
+#define CACHE_LINE_SIZE 64
+
+struct ObaTask {
+  ObaScheduler* scheduler;
+
+  // The source the task runs, and the value it was spawned with, until it
+  // finishes.
+  char* source;
+  Message argument;
+
+  // The VM the task runs in, from when it starts until it finishes.
+  ObaVM* vm;
+
+  // How the task's script ended, once [done] is set.
+  ObaInterpretResult result;
+  atomic_bool done;
+
+  // Guards [waiters], so that a task does not start waiting for this one just
+  // as it finishes.
+  pthread_mutex_t lock;
+
+  // The tasks suspended until this one finishes.
+  ObaTask* waiters;
+
+  // The next task in the scheduler's queue, or in the list of waiters this
+  // task is in. A task is in at most one of them, and then in no deque.
+  ObaTask* next;
+
+  // The scheduler holds a reference until the task finishes, and its handle
+  // holds another until it is joined or freed.
+  atomic_int refCount;
+};
+
+typedef _Atomic(ObaTask*) TaskSlot;
+
+// The tasks in a deque, indexed by position modulo [capacity].
+typedef struct DequeArray {
+  long capacity;
+  TaskSlot* tasks;
+
+  // The array this one replaced. Thieves may still be reading from it, so it
+  // is only freed along with the deque.
+  struct DequeArray* previous;
+} DequeArray;
+
+// A work-stealing deque, as described by Chase and Lev, with the memory order
+// given by Lê et al. in "Correct and Efficient Work-Stealing for Weak Memory
+// Models".
+//
+// Only the deque's worker pushes and takes tasks, at the bottom. Any thread can
+// steal the task at the top. The two ends only contend for the last task,
+// which goes to whoever moves [top] past it first.
+typedef struct {
+  atomic_long top;
+  char padding[CACHE_LINE_SIZE];
+  atomic_long bottom;
+  _Atomic(DequeArray*) array;
+} Deque;
+
+typedef struct {
+  ObaScheduler* scheduler;
+  pthread_t thread;
+  Deque deque;
+  char padding[CACHE_LINE_SIZE];
+} Worker;
+
+struct ObaScheduler {
+  Worker* workers;
+  int workerCount;
+  atomic_bool started;
+
+  // Guards [first] and [last], and is held while waiting on [wake].
+  pthread_mutex_t lock;
+
+  // Signaled when a task is queued or finishes, or the scheduler stops, if a
+  // thread is waiting for one.
+  pthread_cond_t wake;
+  atomic_int sleeping;
+
+  // The tasks queued but not yet taken, the tasks not yet finished, and
+  // whether the workers stop once every task has.
+  atomic_long queued;
+  atomic_long live;
+  atomic_bool stopping;
+
+  // Tasks queued by threads other than the workers, and tasks suspended to
+  // let others run, oldest first, and how many there are.
+  ObaTask* first;
+  ObaTask* last;
+  atomic_long queueLength;
+
+  // What each task's VM is created with.
+  ObaSharedCode* sharedCode;
+  Builtin* builtins;
+  int builtinsLength;
+};
+
+// The worker running on this thread, if any.
+static _Thread_local Worker* currentWorker = NULL;
+
+// State of the generator that picks which worker to steal from first.
+static _Thread_local uint32_t stealSeed = 0;
+
+// Deques ----------------------------------------------------------------------
+
+static DequeArray* newDequeArray(long capacity, DequeArray* previous) {
+  DequeArray* array = ALLOCATE(DequeArray, 1);
+  array->capacity = capacity;
+  array->tasks = ALLOCATE(TaskSlot, capacity);
+  array->previous = previous;
+  return array;
+}
+
+static void initDeque(Deque* deque) {
+  atomic_init(&deque->top, 0);
+  atomic_init(&deque->bottom, 0);
+  atomic_init(&deque->array, newDequeArray(DEQUE_CAPACITY, NULL));
+}
+
+static void freeDeque(Deque* deque) {
+  DequeArray* array = atomic_load(&deque->array);
+  while (array != NULL) {
+    DequeArray* previous = array->previous;
+    FREE_ARRAY(TaskSlot, array->tasks, array->capacity);
+    FREE(DequeArray, array);
+    array = previous;
+  }
+}
+
+// Returns a copy of [array] with twice the room, holding the tasks from [top]
+// to [bottom].
+static DequeArray* growDeque(DequeArray* array, long top, long bottom) {
+  DequeArray* grown = newDequeArray(array->capacity * 2, array);
+  for (long i = top; i < bottom; i++) {
+    ObaTask* task = atomic_load_explicit(
+        &array->tasks[i % array->capacity], memory_order_relaxed);
+    atomic_store_explicit(&grown->tasks[i % grown->capacity], task,
+                          memory_order_relaxed);
+  }
+  return grown;
+}
+
+// Pushes [task] onto the bottom of [deque]. Only called by its worker.
+static void pushTask(Deque* deque, ObaTask* task) {
+  long bottom = atomic_load_explicit(&deque->bottom, memory_order_relaxed);
+  long top = atomic_load_explicit(&deque->top, memory_order_acquire);
+  DequeArray* array = atomic_load_explicit(&deque->array, memory_order_relaxed);
+  if (bottom - top > array->capacity - 1) {
+    array = growDeque(array, top, bottom);
+    atomic_store_explicit(&deque->array, array, memory_order_release);
+  }
+  atomic_store_explicit(&array->tasks[bottom % array->capacity], task,
+                        memory_order_relaxed);
+
+  // Thieves that see the new bottom see the task, and what it points to.
+  atomic_store_explicit(&deque->bottom, bottom + 1, memory_order_release);
+}
+
+// Takes the task at the bottom of [deque], or returns NULL if it is empty.
+// Only called by its worker.
+static ObaTask* takeTask(Deque* deque) {
+  long bottom = atomic_load_explicit(&deque->bottom, memory_order_relaxed) - 1;
+  DequeArray* array = atomic_load_explicit(&deque->array, memory_order_relaxed);
+  atomic_store_explicit(&deque->bottom, bottom, memory_order_relaxed);
+  atomic_thread_fence(memory_order_seq_cst);
+  long top = atomic_load_explicit(&deque->top, memory_order_relaxed);
+
+  if (top > bottom) {
+    atomic_store_explicit(&deque->bottom, bottom + 1, memory_order_relaxed);
+    return NULL;
+  }
+
+  ObaTask* task = atomic_load_explicit(&array->tasks[bottom % array->capacity],
+                                       memory_order_relaxed);
+  if (top == bottom) {
+    // The last task may be stolen meanwhile.
+    if (!atomic_compare_exchange_strong_explicit(&deque->top, &top, top + 1,
+                                                 memory_order_seq_cst,
+                                                 memory_order_relaxed)) {
+      task = NULL;
+    }
+    atomic_store_explicit(&deque->bottom, bottom + 1, memory_order_relaxed);
+  }
+  return task;
+}
+
+// Steals the task at the top of [deque], or returns NULL if it is empty or
+// another thread took the task first.
+static ObaTask* stealTask(Deque* deque) {
+  long top = atomic_load_explicit(&deque->top, memory_order_acquire);
+  atomic_thread_fence(memory_order_seq_cst);
+  long bottom = atomic_load_explicit(&deque->bottom, memory_order_acquire);
+  if (top >= bottom)
+    return NULL;
+
+  DequeArray* array = atomic_load_explicit(&deque->array, memory_order_acquire);
+  ObaTask* task = atomic_load_explicit(&array->tasks[top % array->capacity],
+                                       memory_order_relaxed);
+  if (!atomic_compare_exchange_strong_explicit(&deque->top, &top, top + 1,
+                                               memory_order_seq_cst,
+                                               memory_order_relaxed)) {
+    return NULL;
+  }
+  return task;
+}
+
+// Queueing --------------------------------------------------------------------
+
+// Returns the worker of [scheduler] running on this thread, or NULL if this
+// thread is not one of its workers.
+static Worker* localWorker(ObaScheduler* scheduler) {
+  Worker* worker = currentWorker;
+  return worker != NULL && worker->scheduler == scheduler ? worker : NULL;
+}
+
+// Wakes a thread waiting on [scheduler], or every one of them if [all] is
+// true.
+//
+// A thread only waits once it has counted itself in [sleeping] and then seen
+// that there is nothing to do, all while holding the lock. Whatever it waits
+// for is published before [sleeping] is read here, so either the thread sees
+// it, or it is counted and woken.
+static void wakeThreads(ObaScheduler* scheduler, bool all) {
+  if (atomic_load(&scheduler->sleeping) == 0)
+    return;
+
+  pthread_mutex_lock(&scheduler->lock);
+  if (all) {
+    pthread_cond_broadcast(&scheduler->wake);
+  } else {
+    pthread_cond_signal(&scheduler->wake);
+  }
+  pthread_mutex_unlock(&scheduler->lock);
+}
+
+// Queues [task] to run. A worker keeps the tasks it queues in its own deque,
+// unless [yielded] is true, in which case the task has just been suspended to
+// let others run, and goes to the back of the scheduler's queue.
+static void queueTask(ObaScheduler* scheduler, ObaTask* task, bool yielded) {
+  // Counted first, so that [queued] is never less than the number of tasks
+  // that can be taken.
+  atomic_fetch_add(&scheduler->queued, 1);
+
+  Worker* worker = localWorker(scheduler);
+  if (worker != NULL && !yielded) {
+    pushTask(&worker->deque, task);
+  } else {
+    pthread_mutex_lock(&scheduler->lock);
+    task->next = NULL;
+    if (scheduler->last != NULL) {
+      scheduler->last->next = task;
+    } else {
+      scheduler->first = task;
+    }
+    scheduler->last = task;
+    atomic_fetch_add(&scheduler->queueLength, 1);
+    pthread_mutex_unlock(&scheduler->lock);
+  }
+  wakeThreads(scheduler, false);
+}
+
+// Takes the oldest task in [scheduler]'s queue, or returns NULL if it is empty.
+static ObaTask* takeQueuedTask(ObaScheduler* scheduler) {
+  if (atomic_load(&scheduler->queueLength) == 0)
+    return NULL;
+
+  pthread_mutex_lock(&scheduler->lock);
+  ObaTask* task = scheduler->first;
+  if (task != NULL) {
+    scheduler->first = task->next;
+    if (scheduler->first == NULL) {
+      scheduler->last = NULL;
+    }
+    atomic_fetch_sub(&scheduler->queueLength, 1);
+  }
+  pthread_mutex_unlock(&scheduler->lock);
+  return task;
+}
+
+// Steals a task from one of [scheduler]'s workers other than [thief], starting
+// from one picked at random so that thieves spread out over the workers.
+static ObaTask* stealFromWorkers(ObaScheduler* scheduler, Worker* thief) {
+  if (stealSeed == 0) {
+    stealSeed = (uint32_t)(uintptr_t)&stealSeed | 1;
+  }
+  stealSeed ^= stealSeed << 13;
+  stealSeed ^= stealSeed >> 17;
+  stealSeed ^= stealSeed << 5;
+
+  int count = scheduler->workerCount;
+  if (count == 0)
+    return NULL;
+
+  int start = (int)(stealSeed % (uint32_t)count);
+  for (int i = 0; i < count; i++) {
+    Worker* victim = &scheduler->workers[(start + i) % count];
+    if (victim == thief)
+      continue;
+
+    ObaTask* task = stealTask(&victim->deque);
+    if (task != NULL)
+      return task;
+  }
+  return NULL;
+}
+
+// Takes a task to run on this thread, which is [worker] if it is not NULL, or
+// returns NULL if none could be taken.
+static ObaTask* findTask(ObaScheduler* scheduler, Worker* worker) {
+  static _Thread_local unsigned taken = 0;
+
+  ObaTask* task = NULL;
+  if (worker != NULL && ++taken % QUEUE_INTERVAL == 0) {
+    task = takeQueuedTask(scheduler);
+  }
+  if (task == NULL && worker != NULL) {
+    task = takeTask(&worker->deque);
+  }
+  if (task == NULL) {
+    task = takeQueuedTask(scheduler);
+  }
+  if (task == NULL) {
+    task = stealFromWorkers(scheduler, worker);
+  }
+
+  if (task != NULL) {
+    atomic_fetch_sub(&scheduler->queued, 1);
+  }
+  return task;
+}
+
+// Running ---------------------------------------------------------------------
+
+void releaseTask(ObaTask* task) {
+  if (atomic_fetch_sub(&task->refCount, 1) > 1)
+    return;
+
+  pthread_mutex_destroy(&task->lock);
+  FREE(ObaTask, task);
+}
+
+// Queues [task] to run again once [joined] has finished.
+static void waitForTask(ObaScheduler* scheduler, ObaTask* task,
+                        ObaTask* joined) {
+  pthread_mutex_lock(&joined->lock);
+  bool done = atomic_load(&joined->done);
+  if (!done) {
+    task->next = joined->waiters;
+    joined->waiters = task;
+  }
+  pthread_mutex_unlock(&joined->lock);
+
+  if (done) {
+    queueTask(scheduler, task, false);
+  }
+}
+
+static void finishTask(ObaScheduler* scheduler, ObaTask* task,
+                       ObaInterpretResult result) {
+  // Nothing the script allocated can be reclaimed while its VM lives, so the
+  // VM goes as soon as the task is done with it.
+  obaFreeVM(task->vm);
+  task->vm = NULL;
+  FREE_ARRAY(char, task->source, strlen(task->source) + 1);
+  task->source = NULL;
+  freeMessage(&task->argument);
+  task->result = result;
+
+  pthread_mutex_lock(&task->lock);
+  atomic_store(&task->done, true);
+  ObaTask* waiter = task->waiters;
+  task->waiters = NULL;
+  pthread_mutex_unlock(&task->lock);
+
+  while (waiter != NULL) {
+    ObaTask* next = waiter->next;
+    queueTask(scheduler, waiter, false);
+    waiter = next;
+  }
+
+  atomic_fetch_sub(&scheduler->live, 1);
+  wakeThreads(scheduler, true);
+  releaseTask(task);
+}
+
+// Runs [task] until it finishes or is suspended.
+static void runTask(ObaScheduler* scheduler, ObaTask* task) {
+  ObaVM* vm = task->vm;
+  ObaInterpretResult result;
+  if (vm == NULL) {
+    vm = obaNewVM(scheduler->builtins, scheduler->builtinsLength);
+    obaSetSharedCode(vm, scheduler->sharedCode);
+    vm->scheduler = scheduler;
+    vm->task = task;
+    task->vm = vm;
+    obaSetFuel(vm, TASK_SLICE);
+    result = obaInterpretCached(vm, task->source);
+  } else {
+    // A task suspended in a join continues from whether the joined task
+    // succeeded.
+    if (vm->joining != NULL) {
+      setSuspendedResult(
+          vm, OBA_BOOL(vm->joining->result == OBA_RESULT_SUCCESS));
+      vm->joining = NULL;
+    }
+
+    // A task woken by a channel that another VM got to first waits again, and
+    // one whose send failed because the channel was closed ends.
+    if (vm->channel != NULL && !retryChannel(vm)) {
+      waitForChannel(task, vm);
+      return;
+    }
+    if (vm->hasError) {
+      finishTask(scheduler, task, OBA_RESULT_RUNTIME_ERROR);
+      return;
+    }
+    obaSetFuel(vm, TASK_SLICE);
+    result = obaResume(vm);
+  }
+
+  if (result == OBA_RESULT_OUT_OF_FUEL) {
+    queueTask(scheduler, task, true);
+  } else if (result == OBA_RESULT_WAITING && vm->joining != NULL) {
+    waitForTask(scheduler, task, vm->joining);
+  } else if (result == OBA_RESULT_WAITING && vm->channel != NULL) {
+    waitForChannel(task, vm);
+  } else {
+    finishTask(scheduler, task, result);
+  }
+}
+
+void wakeTask(ObaTask* task) { queueTask(task->scheduler, task, false); }
+
+bool runQueuedTask(ObaScheduler* scheduler) {
+  ObaTask* task = findTask(scheduler, localWorker(scheduler));
+  if (task == NULL)
+    return false;
+  runTask(scheduler, task);
+  return true;
+}
+
+// Whether [task] has finished, or if [task] is NULL, whether [scheduler] is
+// stopping and every task has finished.
+static bool isFinished(ObaScheduler* scheduler, ObaTask* task) {
+  if (task != NULL)
+    return atomic_load(&task->done);
+  return atomic_load(&scheduler->stopping) &&
+         atomic_load(&scheduler->live) == 0;
+}
+
+// Runs tasks on this thread until [task] has finished, or if [task] is NULL,
+// until [scheduler] stops.
+static void runUntil(ObaScheduler* scheduler, ObaTask* task) {
+  Worker* worker = localWorker(scheduler);
+  while (!isFinished(scheduler, task)) {
+    ObaTask* next = findTask(scheduler, worker);
+    if (next != NULL) {
+      runTask(scheduler, next);
+      continue;
+    }
+
+    // A task counted in [queued] may not be in a deque yet, or may have been
+    // lost to another thief, so only wait when there are none.
+    pthread_mutex_lock(&scheduler->lock);
+    atomic_fetch_add(&scheduler->sleeping, 1);
+    if (atomic_load(&scheduler->queued) == 0 && !isFinished(scheduler, task)) {
+      pthread_cond_wait(&scheduler->wake, &scheduler->lock);
+    }
+    atomic_fetch_sub(&scheduler->sleeping, 1);
+    pthread_mutex_unlock(&scheduler->lock);
+  }
+}
+
+static void* runWorker(void* arg) {
+  Worker* worker = (Worker*)arg;
+  currentWorker = worker;
+  runUntil(worker->scheduler, NULL);
+  currentWorker = NULL;
+  return NULL;
+}
+
+// Starts [scheduler]'s threads, unless they have been started already.
+static void startWorkers(ObaScheduler* scheduler) {
+  if (atomic_load(&scheduler->started))
+    return;
+
+  pthread_mutex_lock(&scheduler->lock);
+  if (!atomic_load(&scheduler->started)) {
+    // A worker that cannot be started leaves its deque empty, and the others
+    // run the tasks it would have.
+    for (int i = 0; i < scheduler->workerCount; i++) {
+      Worker* worker = &scheduler->workers[i];
+      if (pthread_create(&worker->thread, NULL, runWorker, worker) != 0) {
+        worker->scheduler = NULL;
+      }
+    }
+    atomic_store(&scheduler->started, true);
+  }
+  pthread_mutex_unlock(&scheduler->lock);
+}
+
+// Scheduler -------------------------------------------------------------------
+
+ObaScheduler* obaNewScheduler(int threads, Builtin* builtins,
+                              int builtinsLength) {
+  ObaScheduler* scheduler = ALLOCATE(ObaScheduler, 1);
+  scheduler->workerCount = threads;
+  scheduler->workers = ALLOCATE(Worker, threads);
+  for (int i = 0; i < threads; i++) {
+    scheduler->workers[i].scheduler = scheduler;
+    initDeque(&scheduler->workers[i].deque);
+  }
+  atomic_init(&scheduler->started, false);
+  pthread_mutex_init(&scheduler->lock, NULL);
+  pthread_cond_init(&scheduler->wake, NULL);
+  atomic_init(&scheduler->sleeping, 0);
+  atomic_init(&scheduler->queued, 0);
+  atomic_init(&scheduler->live, 0);
+  atomic_init(&scheduler->stopping, false);
+  scheduler->first = NULL;
+  scheduler->last = NULL;
+  atomic_init(&scheduler->queueLength, 0);
+  scheduler->sharedCode = obaNewSharedCode();
+  scheduler->builtins = builtins;
+  scheduler->builtinsLength = builtinsLength;
+  return scheduler;
+}
+
+void obaFreeScheduler(ObaScheduler* scheduler) {
+  atomic_store(&scheduler->stopping, true);
+  wakeThreads(scheduler, true);
+  runUntil(scheduler, NULL);
+
+  for (int i = 0; i < scheduler->workerCount; i++) {
+    Worker* worker = &scheduler->workers[i];
+    if (atomic_load(&scheduler->started) && worker->scheduler != NULL) {
+      pthread_join(worker->thread, NULL);
+    }
+    freeDeque(&worker->deque);
+  }
+  FREE_ARRAY(Worker, scheduler->workers, scheduler->workerCount);
+  obaFreeSharedCode(scheduler->sharedCode);
+  pthread_mutex_destroy(&scheduler->lock);
+  pthread_cond_destroy(&scheduler->wake);
+  FREE(ObaScheduler, scheduler);
+}
+
+void obaSetScheduler(ObaVM* vm, ObaScheduler* scheduler) {
+  vm->scheduler = scheduler;
+}
+
+// Spawns a task on [scheduler] that runs [source] with [argument].
+static ObaTask* spawn(ObaScheduler* scheduler, const char* source,
+                      Message argument) {
+  size_t length = strlen(source);
+  ObaTask* task = ALLOCATE(ObaTask, 1);
+  task->scheduler = scheduler;
+  task->source = ALLOCATE(char, length + 1);
+  memcpy(task->source, source, length + 1);
+  task->argument = argument;
+  task->vm = NULL;
+  task->result = OBA_RESULT_SUCCESS;
+  atomic_init(&task->done, false);
+  pthread_mutex_init(&task->lock, NULL);
+  task->waiters = NULL;
+  task->next = NULL;
+  atomic_init(&task->refCount, 2);
+
+  atomic_fetch_add(&scheduler->live, 1);
+  startWorkers(scheduler);
+  queueTask(scheduler, task, false);
+  return task;
+}
+
+ObaTask* obaSpawn(ObaScheduler* scheduler, const char* source) {
+  Message argument;
+  argument.type = MESSAGE_NIL;
+  return spawn(scheduler, source, argument);
+}
+
+ObaInterpretResult obaJoin(ObaScheduler* scheduler, ObaTask* task) {
+  runUntil(scheduler, task);
+  ObaInterpretResult result = task->result;
+  releaseTask(task);
+  return result;
+}
+
+ObjTask* spawnTask(ObaVM* vm, const char* source, Message argument) {
+  if (vm->scheduler == NULL) {
+    freeMessage(&argument);
+    return NULL;
+  }
+
+  ObjTask* handle = ALLOCATE_OBJ(vm, ObjTask, OBJ_TASK);
+  handle->task = spawn(vm->scheduler, source, argument);
+  return handle;
+}
+
+Value taskArgument(ObaVM* vm) {
+  if (vm->task == NULL)
+    return NIL_VAL;
+  return messageValue(vm, &vm->task->argument);
+}
+
+void joinTask(ObaVM* vm, ObaTask* task) {
+  // Only a task's VM is resumed when the task it waits for finishes. Other VMs
+  // are run by the host, which would not know to resume them.
+  if (!atomic_load(&task->done) && vm->task != NULL && canSuspend(vm)) {
+    vm->joining = task;
+    return;
+  }
+
+  runUntil(task->scheduler, task);
+  vm->apiStack[0] = OBA_BOOL(task->result == OBA_RESULT_SUCCESS);
+}
@@ -0,0 +1,51 @@
+#ifndef oba_scheduler_h
+#define oba_scheduler_h
+
+#include "oba.h"
+#include "oba_channel.h"
+#include "oba_value.h"
+
+// Tasks run by an [ObaScheduler] on its worker threads.
+//
+// Each worker keeps the tasks it has to run in a deque of its own. It pushes
+// and takes tasks at the bottom without locking, while idle workers steal
+// from the top of other workers' deques, so a task can start and continue on
+// any thread. Tasks queued from outside the workers go through a queue of the
+// scheduler's, guarded by its lock.
+//
+// A task waiting for another is suspended like code that waits for I/O, and
+// queued again by the worker that finishes the other task, so no thread is
+// held by a task that cannot run. Code that cannot be suspended runs other
+// tasks on its own thread until the one it waits for has finished.
+
+// A task's handle in the VM that spawned it.
+typedef struct {
+  Obj obj;
+  ObaTask* task;
+} ObjTask;
+
+// Spawns a task on the scheduler of [vm] that runs [source] with [argument],
+// which the task takes over, and returns its handle, or NULL if [vm] has no
+// scheduler.
+ObjTask* spawnTask(ObaVM* vm, const char* source, Message argument);
+
+// Returns the argument the task [vm] runs was spawned with, or nil if [vm]
+// runs no task.
+Value taskArgument(ObaVM* vm);
+
+// Stores in slot 0 whether [task] finished without an error, once it has
+// finished. Until then, the code that called the running native is suspended
+// if [vm] runs a task, or the native waits for [task] otherwise.
+void joinTask(ObaVM* vm, ObaTask* task);
+
+// Drops the reference to [task] held by a handle.
+void releaseTask(ObaTask* task);
+
+// Queues [task], which is suspended on a channel, to run again.
+void wakeTask(ObaTask* task);
+
+// Runs a task queued on [scheduler] on the calling thread, until it finishes
+// or is suspended. Returns false if no task was queued.
+bool runQueuedTask(ObaScheduler* scheduler);
+
+#endif
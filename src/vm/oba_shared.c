@@ -0,0 +1,190 @@
+#include <pthread.h>
+#include <stdatomic.h>
+#include <string.h>
+
+#include "oba_bytecode.h"
+#include "oba_common.h"
+#include "oba_compiler.h"
+#include "oba_shared.h"
+#include "oba_vm.h"
+
+struct SharedModule {
+  // The name the module was compiled as, and its source.
+  char* name;
+  char* source;
+
+  // The heap the module was compiled into, and its top-level function.
+  ObaVM* heap;
+  ObjFunction* function;
+
+  atomic_int refCount;
+
+  // The next module held by the same [ObaSharedCode], guarded by its lock.
+  struct SharedModule* next;
+};
+
+struct ObaSharedCode {
+  pthread_mutex_t lock;
+  SharedModule* modules;
+};
+
+static char* copyChars(const char* chars) {
+  size_t length = strlen(chars);
+  char* copy = ALLOCATE(char, length + 1);
+  memcpy(copy, chars, length + 1);
+  return copy;
+}
+
+static void freeChars(char* chars) {
+  FREE_ARRAY(char, chars, strlen(chars) + 1);
+}
+
+static void releaseModule(SharedModule* module) {
+  if (atomic_fetch_sub(&module->refCount, 1) > 1)
+    return;
+
+  freeHeap(module->heap);
+  freeChars(module->name);
+  freeChars(module->source);
+  FREE(SharedModule, module);
+}
+
+ObaSharedCode* obaNewSharedCode(void) {
+  ObaSharedCode* code = ALLOCATE(ObaSharedCode, 1);
+  pthread_mutex_init(&code->lock, NULL);
+  code->modules = NULL;
+  return code;
+}
+
+void obaFreeSharedCode(ObaSharedCode* code) {
+  SharedModule* module = code->modules;
+  while (module != NULL) {
+    SharedModule* next = module->next;
+    releaseModule(module);
+    module = next;
+  }
+  pthread_mutex_destroy(&code->lock);
+  FREE(ObaSharedCode, code);
+}
+
+void obaSetSharedCode(ObaVM* vm, ObaSharedCode* code) { vm->sharedCode = code; }
+
+static void holdModule(ObaVM* vm, SharedModule* module) {
+  if (vm->sharedModuleCapacity <= vm->sharedModuleCount) {
+    int oldCap = vm->sharedModuleCapacity;
+    vm->sharedModuleCapacity = GROW_CAPACITY(oldCap);
+    vm->sharedModules = GROW_ARRAY(SharedModule*, vm->sharedModules, oldCap,
+                                   vm->sharedModuleCapacity);
+  }
+  vm->sharedModules[vm->sharedModuleCount++] = module;
+}
+
+// Returns the module [name] compiled from [source], or NULL if there is none.
+// Must be called with the lock held.
+static SharedModule* findModule(ObaSharedCode* code, const char* name,
+                                const char* source) {
+  for (SharedModule* module = code->modules; module != NULL;
+       module = module->next) {
+    if (strcmp(module->name, name) == 0 && strcmp(module->source, source) == 0)
+      return module;
+  }
+  return NULL;
+}
+
+// Compiles the body of every function in [function] that was left until it is
+// first called, since a shared function must not change once other threads can
+// see it. Returns false if one of them does not compile.
+static bool compileBodies(ObaVM* heap, ObjFunction* function) {
+  if (function->source != NULL && !compileFunctionBody(heap, function))
+    return false;
+
+  ValueArray* constants = &function->chunk.constants;
+  for (int i = 0; i < constants->count; i++) {
+    if (IS_FUNCTION(constants->values[i]) &&
+        !compileBodies(heap, AS_FUNCTION(constants->values[i]))) {
+      return false;
+    }
+  }
+  return true;
+}
+
+// Compiles [source] as the module [name] into a heap of its own, or returns
+// NULL if it does not compile.
+static SharedModule* compileModule(const char* name, const char* source) {
+  ObaVM* heap = newHeap();
+  ObjModule* module =
+      newModule(heap, copyString(heap, name, (int)strlen(name)));
+  ObjFunction* function = compileCached(heap, module, source);
+  if (function == NULL || !compileBodies(heap, function)) {
+    freeHeap(heap);
+    return NULL;
+  }
+
+  SharedModule* shared = ALLOCATE(SharedModule, 1);
+  shared->name = copyChars(name);
+  shared->source = copyChars(source);
+  shared->heap = heap;
+  shared->function = function;
+  atomic_init(&shared->refCount, 1);
+  shared->next = NULL;
+  return shared;
+}
+
+ObjFunction* loadSharedModule(ObaVM* vm, ObjModule* module,
+                              const char* source) {
+  ObaSharedCode* code = vm->sharedCode;
+  const char* name = module->name->chars;
+
+  pthread_mutex_lock(&code->lock);
+  SharedModule* shared = findModule(code, name, source);
+  if (shared != NULL) {
+    atomic_fetch_add(&shared->refCount, 1);
+  }
+  pthread_mutex_unlock(&code->lock);
+
+  if (shared == NULL) {
+    // Other modules can be loaded while this one compiles. If another VM
+    // compiles the same module meanwhile, the first one to finish is kept.
+    SharedModule* compiled = compileModule(name, source);
+    if (compiled == NULL)
+      return NULL;
+
+    pthread_mutex_lock(&code->lock);
+    shared = findModule(code, name, source);
+    if (shared == NULL) {
+      shared = compiled;
+      shared->next = code->modules;
+      code->modules = shared;
+    }
+    atomic_fetch_add(&shared->refCount, 1);
+    pthread_mutex_unlock(&code->lock);
+
+    if (shared != compiled) {
+      releaseModule(compiled);
+    }
+  }
+
+  holdModule(vm, shared);
+  ValueArray* imports = &shared->heap->imports;
+  for (int i = 0; i < imports->count; i++) {
+    writeValueArray(&vm->imports, imports->values[i]);
+  }
+  return shared->function;
+}
+
+void adoptSharedModules(ObaVM* vm, ObaVM* heap) {
+  for (int i = 0; i < heap->sharedModuleCount; i++) {
+    holdModule(vm, heap->sharedModules[i]);
+  }
+  heap->sharedModuleCount = 0;
+}
+
+void releaseSharedModules(ObaVM* vm) {
+  for (int i = 0; i < vm->sharedModuleCount; i++) {
+    releaseModule(vm->sharedModules[i]);
+  }
+  FREE_ARRAY(SharedModule*, vm->sharedModules, vm->sharedModuleCapacity);
+  vm->sharedModules = NULL;
+  vm->sharedModuleCount = 0;
+  vm->sharedModuleCapacity = 0;
+}
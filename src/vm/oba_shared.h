@@ -0,0 +1,33 @@
+#ifndef oba_shared_h
+#define oba_shared_h
+
+#include "oba.h"
+#include "oba_function.h"
+
+// Modules compiled once for every VM attached to the same [ObaSharedCode].
+//
+// A shared module is compiled into a heap of its own, and nothing in that heap
+// changes afterwards, so VMs on any thread can run its functions at once. The
+// bodies of functions that would be compiled when first called are compiled
+// up front instead. Each VM only creates closures over the shared functions,
+// and the closures hold the VM's own module, whose variables they use.
+//
+// Shared modules are reference counted. The [ObaSharedCode] holds one
+// reference to each, and every VM that loads one holds another until the VM
+// is freed.
+typedef struct SharedModule SharedModule;
+
+// Returns the top-level function of [module] compiled from [source], shared
+// through the [ObaSharedCode] of [vm], which must have one. The modules it
+// imports are added to the VM's imports.
+//
+// Returns NULL if [source] cannot be shared because it does not compile.
+ObjFunction* loadSharedModule(ObaVM* vm, ObjModule* module, const char* source);
+
+// Moves the references to shared modules held by [heap] to [vm].
+void adoptSharedModules(ObaVM* vm, ObaVM* heap);
+
+// Drops the references to shared modules held by [vm].
+void releaseSharedModules(ObaVM* vm);
+
+#endif
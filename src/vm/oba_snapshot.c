@@ -0,0 +1,738 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "oba_bytecode.h"
+#include "oba_common.h"
+#include "oba_debug.h"
+#include "oba_function.h"
+#include "oba_snapshot.h"
+#include "oba_vm.h"
+
+// Identifies a snapshot.
+static const uint8_t MAGIC[4] = {'O', 'B', 'A', 'S'};
+
+// Every record in the heap starts at a multiple of this many bytes.
+#define ALIGNMENT 8
+
+// The sizes that a snapshot's layout depends on.
+#define LAYOUT_SIZES 12
+
+typedef struct {
+  uint8_t magic[4];
+  uint32_t version;
+
+  // The sizes of the VM's structs, followed by the bytecode version and the
+  // number of instructions, which must all match.
+  uint32_t layout[LAYOUT_SIZES];
+
+  // The size of the whole snapshot, including this header, and a hash of
+  // everything after the header.
+  uint64_t length;
+  uint64_t checksum;
+
+  // The offset of the module whose variables scripts start with.
+  uint64_t root;
+
+  // The offset of the first object. Each object's [next] field holds the
+  // offset of the one after it.
+  uint64_t objects;
+
+  // The offset and number of the [NativeName]s of the natives in the heap.
+  uint64_t natives;
+  uint64_t nativeCount;
+} SnapshotHeader;
+
+// The name that a native in the heap is defined under in the globals.
+typedef struct {
+  uint64_t native;
+  uint64_t name;
+} NativeName;
+
+static void describeLayout(uint32_t layout[LAYOUT_SIZES]) {
+  layout[0] = sizeof(void*);
+  layout[1] = sizeof(Value);
+  layout[2] = sizeof(ObjString);
+  layout[3] = sizeof(ObjFunction);
+  layout[4] = sizeof(ObjClosure);
+  layout[5] = sizeof(ObjNative);
+  layout[6] = sizeof(ObjUpvalue);
+  layout[7] = sizeof(ObjModule);
+  layout[8] = sizeof(Entry);
+  layout[9] = sizeof(Table);
+  layout[10] = BYTECODE_VERSION;
+  layout[11] = OP_EXIT + 1;
+}
+
+static size_t objectSize(ObjType type) {
+  switch (type) {
+  case OBJ_STRING:
+    return sizeof(ObjString);
+  case OBJ_FUNCTION:
+    return sizeof(ObjFunction);
+  case OBJ_CLOSURE:
+    return sizeof(ObjClosure);
+  case OBJ_NATIVE:
+    return sizeof(ObjNative);
+  case OBJ_UPVALUE:
+    return sizeof(ObjUpvalue);
+  case OBJ_MODULE:
+    return sizeof(ObjModule);
+  case OBJ_FIBER:
+    // Fibers are never saved, since their stacks point into a running VM.
+    return 0;
+  case OBJ_TASK:
+    // Nor are tasks, which are running or have run on a scheduler.
+    return 0;
+  case OBJ_CHANNEL:
+    // Nor are channels, which other VMs may be using.
+    return 0;
+  }
+  return 0;
+}
+
+// Saving ----------------------------------------------------------------------
+
+// An object in the heap being saved.
+typedef struct {
+  Obj* object;
+  size_t offset;
+} Placed;
+
+typedef struct {
+  ObaVM* vm;
+  ByteBuffer buffer;
+
+  // Every object placed in the heap so far, in the order they were placed.
+  // Objects after [written] have not been written yet.
+  Placed* placed;
+  int placedCount;
+  int placedCapacity;
+  int written;
+
+  // An open-addressing map from objects to indices in [placed] plus one, so
+  // that zero marks an empty slot.
+  int* indices;
+  int indexCapacity;
+
+  ByteBuffer natives;
+  uint64_t nativeCount;
+
+  bool hasError;
+} Writer;
+
+// Appends [length] zero bytes to the heap and returns their offset.
+static size_t reserve(Writer* writer, size_t length) {
+  static const uint8_t zeros[ALIGNMENT] = {0};
+
+  ByteBuffer* buffer = &writer->buffer;
+  size_t padding = (ALIGNMENT - buffer->count % ALIGNMENT) % ALIGNMENT;
+  writeBytes(buffer, zeros, padding);
+
+  size_t offset = buffer->count;
+  while (length > 0) {
+    size_t n = length < ALIGNMENT ? length : ALIGNMENT;
+    writeBytes(buffer, zeros, n);
+    length -= n;
+  }
+  return offset;
+}
+
+// Appends [length] [bytes] to the heap and returns their offset.
+static size_t place(Writer* writer, const void* bytes, size_t length) {
+  size_t offset = reserve(writer, length);
+  if (length > 0) {
+    memcpy(writer->buffer.bytes + offset, bytes, length);
+  }
+  return offset;
+}
+
+static size_t hashPointer(const void* pointer, int capacity) {
+  uintptr_t bits = (uintptr_t)pointer;
+  return (size_t)((bits >> 3) * 2654435761u) % capacity;
+}
+
+static void growIndices(Writer* writer) {
+  int capacity = GROW_CAPACITY(writer->indexCapacity);
+  int* indices = ALLOCATE(int, capacity);
+  memset(indices, 0, sizeof(int) * capacity);
+
+  for (int i = 0; i < writer->placedCount; i++) {
+    size_t slot = hashPointer(writer->placed[i].object, capacity);
+    while (indices[slot] != 0) {
+      slot = (slot + 1) % capacity;
+    }
+    indices[slot] = i + 1;
+  }
+
+  FREE_ARRAY(int, writer->indices, writer->indexCapacity);
+  writer->indices = indices;
+  writer->indexCapacity = capacity;
+}
+
+// Returns the offset of [object] in the heap, placing it there if it is not
+// already. Its fields are written later by [writeObject].
+static size_t offsetOf(Writer* writer, Obj* object) {
+  if (object == NULL)
+    return 0;
+
+  if (writer->placedCount + 1 > writer->indexCapacity * TABLE_MAX_LOAD) {
+    growIndices(writer);
+  }
+
+  size_t slot = hashPointer(object, writer->indexCapacity);
+  while (writer->indices[slot] != 0) {
+    Placed* placed = &writer->placed[writer->indices[slot] - 1];
+    if (placed->object == object)
+      return placed->offset;
+    slot = (slot + 1) % writer->indexCapacity;
+  }
+
+  if (writer->placedCapacity <= writer->placedCount) {
+    int oldCap = writer->placedCapacity;
+    writer->placedCapacity = GROW_CAPACITY(oldCap);
+    writer->placed =
+        GROW_ARRAY(Placed, writer->placed, oldCap, writer->placedCapacity);
+  }
+
+  Placed* placed = &writer->placed[writer->placedCount++];
+  placed->object = object;
+  placed->offset = reserve(writer, objectSize(object->type));
+  writer->indices[slot] = writer->placedCount;
+  return placed->offset;
+}
+
+// Converts [offset] to the form pointers are stored in.
+#define OFFSET(offset) ((void*)(uintptr_t)(offset))
+
+static Value valueAt(Writer* writer, Value value) {
+  if (IS_OBJ(value)) {
+    value.as.obj = OFFSET(offsetOf(writer, AS_OBJ(value)));
+  }
+  return value;
+}
+
+// Places a copy of [count] [values] in the heap and returns its offset.
+static size_t placeValues(Writer* writer, Value* values, int count) {
+  Value* copy = ALLOCATE(Value, count);
+  for (int i = 0; i < count; i++) {
+    copy[i] = valueAt(writer, values[i]);
+  }
+  size_t offset = place(writer, copy, sizeof(Value) * count);
+  FREE_ARRAY(Value, copy, count);
+  return offset;
+}
+
+// Records the name [native] is defined under, so it can be found again when
+// the snapshot is loaded.
+static void nameNative(Writer* writer, ObjNative* native, size_t offset) {
+  Table* globals = writer->vm->globals;
+  for (int i = 0; i < globals->capacity; i++) {
+    Entry* entry = &globals->entries[i];
+    if (entry->key != NULL && IS_NATIVE(entry->value) &&
+        AS_NATIVE(entry->value) == native->function) {
+      NativeName name;
+      name.native = offset;
+      name.name =
+          place(writer, entry->key->chars, (size_t)entry->key->length + 1);
+      writeBytes(&writer->natives, &name, sizeof(name));
+      writer->nativeCount++;
+      return;
+    }
+  }
+
+  // Natives that are not globals could not be found again.
+  writer->hasError = true;
+}
+
+// Writes the fields of [placed], with every pointer replaced by an offset.
+//
+// [placed] is passed by value, and offsets of things placed while writing are
+// computed before anything is copied into the heap, because placing them can
+// move both the heap and [writer->placed].
+static void writeObject(Writer* writer, Placed placed) {
+  switch (placed.object->type) {
+  case OBJ_STRING: {
+    ObjString string = *(ObjString*)placed.object;
+    string.chars =
+        OFFSET(place(writer, string.chars, (size_t)string.length + 1));
+    atomic_init(&string.shared, NULL);
+    memcpy(writer->buffer.bytes + placed.offset, &string, sizeof(string));
+    return;
+  }
+  case OBJ_FUNCTION: {
+    ObjFunction function = *(ObjFunction*)placed.object;
+    Chunk* chunk = &function.chunk;
+    function.name = OFFSET(offsetOf(writer, (Obj*)function.name));
+    function.module = OFFSET(offsetOf(writer, (Obj*)function.module));
+    function.source = OFFSET(offsetOf(writer, (Obj*)function.source));
+    chunk->code = OFFSET(place(writer, chunk->code, chunk->count));
+    chunk->capacity = chunk->count;
+    chunk->constants.values = OFFSET(
+        placeValues(writer, chunk->constants.values, chunk->constants.count));
+    chunk->constants.capacity = chunk->constants.count;
+    memcpy(writer->buffer.bytes + placed.offset, &function, sizeof(function));
+    return;
+  }
+  case OBJ_CLOSURE: {
+    ObjClosure closure = *(ObjClosure*)placed.object;
+    void** upvalues = ALLOCATE(void*, closure.upvalueCount);
+    for (int i = 0; i < closure.upvalueCount; i++) {
+      upvalues[i] = OFFSET(offsetOf(writer, (Obj*)closure.upvalues[i]));
+    }
+    size_t offset =
+        place(writer, upvalues, sizeof(void*) * closure.upvalueCount);
+    FREE_ARRAY(void*, upvalues, closure.upvalueCount);
+
+    closure.function = OFFSET(offsetOf(writer, (Obj*)closure.function));
+    closure.module = OFFSET(offsetOf(writer, (Obj*)closure.module));
+    closure.upvalues = OFFSET(offset);
+
+    // Only the closures that are saved are linked into their modules again
+    // once they are loaded.
+    closure.nextInModule = NULL;
+    memcpy(writer->buffer.bytes + placed.offset, &closure, sizeof(closure));
+    return;
+  }
+  case OBJ_NATIVE: {
+    ObjNative native = *(ObjNative*)placed.object;
+    nameNative(writer, &native, placed.offset);
+    native.function = NULL;
+    memcpy(writer->buffer.bytes + placed.offset, &native, sizeof(native));
+    return;
+  }
+  case OBJ_UPVALUE: {
+    // Every upvalue is saved closed, since the stack is not.
+    ObjUpvalue upvalue = *(ObjUpvalue*)placed.object;
+    upvalue.closed = valueAt(writer, *upvalue.location);
+    upvalue.location = NULL;
+    upvalue.next = NULL;
+    memcpy(writer->buffer.bytes + placed.offset, &upvalue, sizeof(upvalue));
+    return;
+  }
+  case OBJ_MODULE: {
+    ObjModule module = *(ObjModule*)placed.object;
+    Table table = *module.variables;
+    Entry* entries = ALLOCATE(Entry, table.capacity);
+    for (int i = 0; i < table.capacity; i++) {
+      entries[i].key = OFFSET(offsetOf(writer, (Obj*)table.entries[i].key));
+      entries[i].value = valueAt(writer, table.entries[i].value);
+    }
+    size_t entriesOffset =
+        place(writer, entries, sizeof(Entry) * table.capacity);
+    FREE_ARRAY(Entry, entries, table.capacity);
+
+    table.entries = OFFSET(entriesOffset);
+    module.name = OFFSET(offsetOf(writer, (Obj*)module.name));
+    module.variables = OFFSET(place(writer, &table, sizeof(table)));
+    module.closures = NULL;
+    memcpy(writer->buffer.bytes + placed.offset, &module, sizeof(module));
+    return;
+  }
+  case OBJ_FIBER:
+  case OBJ_TASK:
+  case OBJ_CHANNEL:
+    writer->hasError = true;
+    return;
+  }
+}
+
+bool obaSaveSnapshot(ObaVM* vm, const char* path) {
+  if (vm->main == NULL)
+    return false;
+
+  Writer writer;
+  memset(&writer, 0, sizeof(writer));
+  writer.vm = vm;
+  initByteBuffer(&writer.buffer);
+  initByteBuffer(&writer.natives);
+
+  SnapshotHeader header;
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, MAGIC, sizeof(MAGIC));
+  header.version = SNAPSHOT_VERSION;
+  describeLayout(header.layout);
+  place(&writer, &header, sizeof(header));
+
+  // Writing an object places the objects it refers to, so this visits
+  // everything reachable from the root.
+  header.root = offsetOf(&writer, (Obj*)vm->main);
+  while (writer.written < writer.placedCount) {
+    writeObject(&writer, writer.placed[writer.written++]);
+  }
+
+  // Chain the objects together in the order they were placed.
+  header.objects = writer.placed[0].offset;
+  for (int i = 0; i < writer.placedCount; i++) {
+    Obj* object = (Obj*)(writer.buffer.bytes + writer.placed[i].offset);
+    object->next =
+        i + 1 < writer.placedCount ? OFFSET(writer.placed[i + 1].offset) : NULL;
+  }
+
+  header.nativeCount = writer.nativeCount;
+  header.natives = place(&writer, writer.natives.bytes, writer.natives.count);
+  header.length = writer.buffer.count;
+  header.checksum = hashBytes(FNV_OFFSET_BASIS,
+                              writer.buffer.bytes + sizeof(header),
+                              header.length - sizeof(header));
+  memcpy(writer.buffer.bytes, &header, sizeof(header));
+
+  bool ok = !writer.hasError;
+  if (ok) {
+    FILE* file = fopen(path, "wb");
+    ok = file != NULL;
+    if (ok) {
+      ok = fwrite(writer.buffer.bytes, 1, writer.buffer.count, file) ==
+           writer.buffer.count;
+      ok = fclose(file) == 0 && ok;
+    }
+  }
+
+  FREE_ARRAY(Placed, writer.placed, writer.placedCapacity);
+  FREE_ARRAY(int, writer.indices, writer.indexCapacity);
+  freeByteBuffer(&writer.natives);
+  freeByteBuffer(&writer.buffer);
+  return ok;
+}
+
+#undef OFFSET
+
+// Loading ---------------------------------------------------------------------
+
+typedef struct {
+  uint8_t* bytes;
+  size_t length;
+  bool hasError;
+} Loader;
+
+// Turns the offset in [*field] into a pointer to the [length] bytes at that
+// offset. Only an empty array may be NULL.
+static void relocate(Loader* loader, void** field, size_t length) {
+  uintptr_t offset = (uintptr_t)*field;
+  if (offset == 0 && length == 0)
+    return;
+
+  if (offset < sizeof(SnapshotHeader) || offset % ALIGNMENT != 0 ||
+      offset > loader->length || loader->length - offset < length) {
+    loader->hasError = true;
+    *field = NULL;
+    return;
+  }
+  *field = loader->bytes + offset;
+}
+
+// Returns whether [object], which starts inside the snapshot, fits in it.
+static bool isObject(Loader* loader, Obj* object) {
+  size_t offset = (uint8_t*)object - loader->bytes;
+  size_t size = objectSize(object->type);
+  return size != 0 && loader->length - offset >= size;
+}
+
+// Like [relocate], for a pointer to an object of [type], which may be NULL.
+static void relocateObject(Loader* loader, void** field, ObjType type) {
+  if (*field == NULL)
+    return;
+
+  relocate(loader, field, sizeof(Obj));
+  Obj* object = (Obj*)*field;
+  if (object != NULL && (!isObject(loader, object) || object->type != type)) {
+    loader->hasError = true;
+    *field = NULL;
+  }
+}
+
+static void relocateValue(Loader* loader, Value* value) {
+  if (!IS_OBJ(*value))
+    return;
+
+  relocate(loader, (void**)&value->as.obj, sizeof(Obj));
+  if (value->as.obj == NULL || !isObject(loader, value->as.obj)) {
+    loader->hasError = true;
+    *value = NIL_VAL;
+  }
+}
+
+static void relocateValues(Loader* loader, Value** values, int count) {
+  if (count < 0) {
+    loader->hasError = true;
+    return;
+  }
+
+  relocate(loader, (void**)values, sizeof(Value) * count);
+  for (int i = 0; i < count && *values != NULL; i++) {
+    relocateValue(loader, &(*values)[i]);
+  }
+}
+
+static void relocateFields(Loader* loader, Obj* object) {
+  switch (object->type) {
+  case OBJ_STRING: {
+    ObjString* string = (ObjString*)object;
+    if (string->length < 0) {
+      loader->hasError = true;
+      return;
+    }
+    relocate(loader, (void**)&string->chars, (size_t)string->length + 1);
+    if (string->chars == NULL || string->chars[string->length] != '\0') {
+      loader->hasError = true;
+    }
+    string->ownsChars = false;
+    atomic_init(&string->shared, NULL);
+    return;
+  }
+  case OBJ_FUNCTION: {
+    ObjFunction* function = (ObjFunction*)object;
+    Chunk* chunk = &function->chunk;
+    relocateObject(loader, (void**)&function->name, OBJ_STRING);
+    relocateObject(loader, (void**)&function->module, OBJ_MODULE);
+    relocateObject(loader, (void**)&function->source, OBJ_STRING);
+    if (chunk->count < 0 ||
+        (function->source != NULL && function->name == NULL)) {
+      loader->hasError = true;
+      return;
+    }
+    relocate(loader, (void**)&chunk->code, chunk->count);
+    relocateValues(loader, &chunk->constants.values, chunk->constants.count);
+    chunk->ownsCode = false;
+    return;
+  }
+  case OBJ_CLOSURE: {
+    ObjClosure* closure = (ObjClosure*)object;
+    relocateObject(loader, (void**)&closure->function, OBJ_FUNCTION);
+    relocateObject(loader, (void**)&closure->module, OBJ_MODULE);
+    if (closure->function == NULL || closure->module == NULL ||
+        closure->upvalueCount < 0) {
+      loader->hasError = true;
+      return;
+    }
+    relocate(loader, (void**)&closure->upvalues,
+             sizeof(ObjUpvalue*) * closure->upvalueCount);
+    for (int i = 0; i < closure->upvalueCount && closure->upvalues != NULL;
+         i++) {
+      relocateObject(loader, (void**)&closure->upvalues[i], OBJ_UPVALUE);
+    }
+    return;
+  }
+  case OBJ_NATIVE:
+    // Natives are found by name once every object has been relocated.
+    return;
+  case OBJ_UPVALUE: {
+    ObjUpvalue* upvalue = (ObjUpvalue*)object;
+    upvalue->location = &upvalue->closed;
+    relocateValue(loader, &upvalue->closed);
+    return;
+  }
+  case OBJ_MODULE: {
+    ObjModule* module = (ObjModule*)object;
+    relocateObject(loader, (void**)&module->name, OBJ_STRING);
+    relocate(loader, (void**)&module->variables, sizeof(Table));
+    Table* table = module->variables;
+    if (table == NULL || table->capacity < 0) {
+      loader->hasError = true;
+      return;
+    }
+    relocate(loader, (void**)&table->entries, sizeof(Entry) * table->capacity);
+    for (int i = 0; i < table->capacity && table->entries != NULL; i++) {
+      relocateObject(loader, (void**)&table->entries[i].key, OBJ_STRING);
+      relocateValue(loader, &table->entries[i].value);
+    }
+    return;
+  }
+  case OBJ_FIBER:
+  case OBJ_TASK:
+  case OBJ_CHANNEL:
+    break;
+  }
+  loader->hasError = true;
+}
+
+// Relocates every object in the chain that starts at [offset].
+static void relocateObjects(Loader* loader, uint64_t offset) {
+  while (offset != 0 && !loader->hasError) {
+    void* field = (void*)(uintptr_t)offset;
+    relocate(loader, &field, sizeof(Obj));
+    Obj* object = (Obj*)field;
+    if (object == NULL || !isObject(loader, object)) {
+      loader->hasError = true;
+      return;
+    }
+
+    // Objects are chained in increasing order, so a corrupt chain cannot loop.
+    uint64_t next = (uint64_t)(uintptr_t)object->next;
+    if (next != 0 && (next <= offset || next >= loader->length)) {
+      loader->hasError = true;
+      return;
+    }
+
+    relocateFields(loader, object);
+    object->next = next == 0 ? NULL : (Obj*)(loader->bytes + next);
+    offset = next;
+  }
+}
+
+// Sets the function of each native in the heap to the one defined under the
+// same name in [vm]'s globals.
+static void findNatives(ObaVM* vm, Loader* loader, SnapshotHeader* header) {
+  void* field = (void*)(uintptr_t)header->natives;
+  relocate(loader, &field, sizeof(NativeName) * header->nativeCount);
+  NativeName* names = (NativeName*)field;
+
+  for (uint64_t i = 0; i < header->nativeCount && !loader->hasError; i++) {
+    ObjNative* native = (ObjNative*)(uintptr_t)names[i].native;
+    const char* name = (const char*)(uintptr_t)names[i].name;
+    relocateObject(loader, (void**)&native, OBJ_NATIVE);
+    relocate(loader, (void**)&name, 1);
+    if (native == NULL || name == NULL ||
+        memchr(name, '\0', loader->bytes + loader->length - (uint8_t*)name) ==
+            NULL) {
+      loader->hasError = true;
+      return;
+    }
+
+    Table* globals = vm->globals;
+    for (int j = 0; j < globals->capacity; j++) {
+      Entry* entry = &globals->entries[j];
+      if (entry->key != NULL && IS_NATIVE(entry->value) &&
+          strcmp(entry->key->chars, name) == 0) {
+        native->function = AS_NATIVE(entry->value);
+      }
+    }
+    if (native->function == NULL) {
+      loader->hasError = true;
+    }
+  }
+}
+
+// Reads the file at [path] into a single allocation.
+static uint8_t* readSnapshot(const char* path, size_t* length) {
+  FILE* file = fopen(path, "rb");
+  if (file == NULL)
+    return NULL;
+
+  uint8_t* bytes = NULL;
+  long size = -1;
+  if (fseek(file, 0L, SEEK_END) == 0) {
+    size = ftell(file);
+    rewind(file);
+  }
+
+  if (size >= (long)sizeof(SnapshotHeader)) {
+    bytes = ALLOCATE(uint8_t, size);
+    if (fread(bytes, 1, size, file) != (size_t)size) {
+      FREE_ARRAY(uint8_t, bytes, size);
+      bytes = NULL;
+    }
+  }
+
+  fclose(file);
+  *length = (size_t)size;
+  return bytes;
+}
+
+bool obaLoadSnapshot(ObaVM* vm, const char* path) {
+  if (vm->snapshot != NULL)
+    return false;
+
+  Loader loader;
+  loader.hasError = false;
+  loader.bytes = readSnapshot(path, &loader.length);
+  if (loader.bytes == NULL)
+    return false;
+
+  SnapshotHeader header;
+  memcpy(&header, loader.bytes, sizeof(header));
+  uint32_t layout[LAYOUT_SIZES];
+  describeLayout(layout);
+  if (memcmp(header.magic, MAGIC, sizeof(MAGIC)) != 0 ||
+      header.version != SNAPSHOT_VERSION ||
+      memcmp(header.layout, layout, sizeof(layout)) != 0 ||
+      header.length != loader.length ||
+      header.checksum != hashBytes(FNV_OFFSET_BASIS,
+                                   loader.bytes + sizeof(header),
+                                   loader.length - sizeof(header))) {
+    FREE_ARRAY(uint8_t, loader.bytes, loader.length);
+    return false;
+  }
+
+  relocateObjects(&loader, header.objects);
+  findNatives(vm, &loader, &header);
+
+  ObjModule* root = (ObjModule*)(uintptr_t)header.root;
+  relocateObject(&loader, (void**)&root, OBJ_MODULE);
+  if (root == NULL) {
+    loader.hasError = true;
+  }
+
+  // Never run code that could read or jump outside of its frame.
+  Obj* first =
+      header.objects == 0 ? NULL : (Obj*)(loader.bytes + header.objects);
+  for (Obj* object = first; object != NULL && !loader.hasError;
+       object = object->next) {
+    if (object->type == OBJ_FUNCTION &&
+        verifyFunction((ObjFunction*)object) != NULL) {
+      loader.hasError = true;
+    }
+  }
+
+  if (loader.hasError) {
+    FREE_ARRAY(uint8_t, loader.bytes, loader.length);
+    return false;
+  }
+
+  // Module variables can still be defined, so their tables are moved out of
+  // the snapshot, where they could not grow. Imported modules are registered,
+  // so that importing them again does not run them again.
+  for (Obj* object = first; object != NULL; object = object->next) {
+    if (object->type == OBJ_CLOSURE) {
+      ObjClosure* closure = (ObjClosure*)object;
+      closure->nextInModule = closure->module->closures;
+      closure->module->closures = closure;
+    }
+    if (object->type != OBJ_MODULE)
+      continue;
+
+    ObjModule* module = (ObjModule*)object;
+    Table* table = ALLOCATE(Table, 1);
+    initTable(table);
+    tableAddAll(module->variables, table);
+    module->variables = table;
+
+    if (module != root) {
+      tableSet(vm->modules, module->name, OBJ_VAL(module));
+    }
+  }
+
+  vm->snapshot = loader.bytes;
+  vm->snapshotLength = loader.length;
+  vm->prelude = root;
+  return true;
+}
+
+void freeSnapshot(ObaVM* vm) {
+  if (vm->snapshot == NULL)
+    return;
+
+  SnapshotHeader* header = (SnapshotHeader*)vm->snapshot;
+  Obj* object =
+      header->objects == 0 ? NULL : (Obj*)(vm->snapshot + header->objects);
+  for (; object != NULL; object = object->next) {
+    if (object->type == OBJ_MODULE) {
+      ObjModule* module = (ObjModule*)object;
+      freeTable(module->variables);
+      FREE(Table, module->variables);
+    }
+
+    // Functions compiled since the snapshot was loaded own their code.
+    if (object->type == OBJ_FUNCTION) {
+      ObjFunction* function = (ObjFunction*)object;
+      if (function->chunk.ownsCode) {
+        freeChunk(&function->chunk);
+      }
+    }
+  }
+
+  FREE_ARRAY(uint8_t, vm->snapshot, vm->snapshotLength);
+  vm->snapshot = NULL;
+  vm->prelude = NULL;
+}
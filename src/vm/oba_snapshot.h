@@ -0,0 +1,30 @@
+#ifndef oba_snapshot_h
+#define oba_snapshot_h
+
+#include "oba.h"
+
+// A snapshot of a VM's heap, written by [obaSaveSnapshot].
+//
+// The heap is stored as the VM's own object structs, with every pointer
+// replaced by its offset from the start of the file. [obaLoadSnapshot] reads
+// the whole file into one allocation and adds its address to each pointer, so
+// restoring a heap needs no parsing. Only the variables of modules are copied
+// out, since they can still change.
+//
+// Natives are stored by the name they are defined under in the globals, and
+// looked up again when the snapshot is loaded.
+//
+// Because structs are stored as they are laid out in memory, a snapshot can
+// only be loaded by a build of Oba with the same layout and instruction set,
+// which the header records. The header also holds a checksum of the heap, so a
+// damaged snapshot is rejected before anything in it is trusted. Pointers are
+// still checked to stay inside the snapshot, and functions are still verified,
+// but a snapshot is otherwise trusted like the binary that wrote it.
+//
+// Bump SNAPSHOT_VERSION whenever the format changes.
+#define SNAPSHOT_VERSION 4
+
+// Frees the heap restored by [obaLoadSnapshot], if any.
+void freeSnapshot(ObaVM* vm);
+
+#endif
@@ -0,0 +1,22 @@
+#include <string.h>
+
+#include "oba_stdlib.h"
+
+#ifdef OBA_STDLIB
+// Generated by tools/embed_stdlib.c, and only available to builds run by the
+// Makefile.
+#include "oba_stdlib_modules.h"
+#else
+static const EmbeddedModule stdlibModules[] = {
+    {NULL, NULL, 0}, // Sentinel to mark the end of the array.
+};
+#endif
+
+const EmbeddedModule* findEmbeddedModule(const char* name) {
+  for (const EmbeddedModule* module = stdlibModules; module->name != NULL;
+       module++) {
+    if (strcmp(module->name, name) == 0)
+      return module;
+  }
+  return NULL;
+}
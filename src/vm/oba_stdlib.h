@@ -0,0 +1,21 @@
+#ifndef oba_stdlib_h
+#define oba_stdlib_h
+
+#include <stddef.h>
+#include <stdint.h>
+
+// A module of the standard library compiled into the binary.
+//
+// When oba is built by the Makefile, tools/embed_stdlib.c compiles each file in
+// mod/ to serialized bytecode, which the VM runs in place from read-only data.
+// Other builds embed nothing and load the standard library from mod/ instead.
+typedef struct {
+  const char* name;
+  const uint8_t* bytecode;
+  size_t length;
+} EmbeddedModule;
+
+// Returns the embedded module named [name], or NULL if there is none.
+const EmbeddedModule* findEmbeddedModule(const char* name);
+
+#endif
@@ -28,6 +28,7 @@ typedef enum {
   TOK_MULTIPLY,
   TOK_DIVIDE,
   TOK_MEMBER,
+  TOK_RANGE,
 
   TOK_IDENT,
   TOK_NUMBER,
@@ -44,6 +45,8 @@ typedef enum {
   TOK_IF,
   TOK_ELSE,
   TOK_WHILE,
+  TOK_FOR,
+  TOK_IN,
   TOK_MATCH,
   TOK_FN,
   TOK_IMPORT,
@@ -40,6 +40,15 @@ void printObject(Value value) {
     printf("<module %s>", module->name->chars);
     break;
   }
+  case OBJ_FIBER:
+    printf("<fiber>");
+    break;
+  case OBJ_TASK:
+    printf("<task>");
+    break;
+  case OBJ_CHANNEL:
+    printf("<channel>");
+    break;
   default:
     break; // Unreachable
   }
@@ -66,7 +75,12 @@ void freeObject(Obj* obj) {
   switch (obj->type) {
   case OBJ_STRING: {
     ObjString* string = (ObjString*)obj;
-    FREE_ARRAY(char, string->chars, string->length + 1);
+    SharedChars* shared = atomic_load(&string->shared);
+    if (shared != NULL) {
+      releaseChars(shared);
+    } else if (string->ownsChars) {
+      FREE_ARRAY(char, string->chars, string->length + 1);
+    }
     FREE(ObjString, obj);
     break;
   }
@@ -91,9 +105,21 @@ void freeObject(Obj* obj) {
   case OBJ_MODULE: {
     ObjModule* module = (ObjModule*)obj;
     freeTable(module->variables);
+    FREE(Table, module->variables);
     FREE(ObjModule, obj);
     break;
   }
+  case OBJ_FIBER:
+    FREE(ObjFiber, obj);
+    break;
+  case OBJ_TASK:
+    releaseTask(((ObjTask*)obj)->task);
+    FREE(ObjTask, obj);
+    break;
+  case OBJ_CHANNEL:
+    obaReleaseChannel(((ObjChannel*)obj)->channel);
+    FREE(ObjChannel, obj);
+    break;
   }
 }
 
@@ -126,6 +152,8 @@ ObjString* allocateString(ObaVM* vm, char* chars, int length, uint32_t hash) {
   string->length = length;
   string->chars = chars;
   string->hash = hash;
+  string->ownsChars = true;
+  atomic_init(&string->shared, NULL);
 
   return string;
 }
@@ -155,6 +183,58 @@ ObjString* takeString(ObaVM* vm, char* chars, int length) {
   return allocateString(vm, chars, length, hash);
 }
 
+ObjString* borrowString(ObaVM* vm, const char* chars, int length) {
+  uint32_t hash = hashString(chars, length);
+  ObjString* string = allocateString(vm, (char*)chars, length, hash);
+  string->ownsChars = false;
+  return string;
+}
+
+SharedChars* shareChars(ObjString* string) {
+  SharedChars* shared = atomic_load(&string->shared);
+  if (shared == NULL) {
+    shared = ALLOCATE(SharedChars, 1);
+    atomic_init(&shared->refCount, 1);
+    shared->length = string->length;
+    if (string->ownsChars) {
+      shared->chars = string->chars;
+    } else {
+      shared->chars = ALLOCATE(char, string->length + 1);
+      memcpy(shared->chars, string->chars, string->length + 1);
+    }
+
+    // Strings in shared code can be sent by VMs on other threads at the same
+    // time, and only the first to share the string's characters keeps them.
+    SharedChars* expected = NULL;
+    if (!atomic_compare_exchange_strong(&string->shared, &expected, shared)) {
+      if (!string->ownsChars) {
+        FREE_ARRAY(char, shared->chars, shared->length + 1);
+      }
+      FREE(SharedChars, shared);
+      shared = expected;
+    }
+  }
+
+  atomic_fetch_add(&shared->refCount, 1);
+  return shared;
+}
+
+ObjString* newSharedString(ObaVM* vm, SharedChars* shared, uint32_t hash) {
+  atomic_fetch_add(&shared->refCount, 1);
+  ObjString* string = allocateString(vm, shared->chars, shared->length, hash);
+  string->ownsChars = false;
+  atomic_init(&string->shared, shared);
+  return string;
+}
+
+void releaseChars(SharedChars* shared) {
+  if (atomic_fetch_sub(&shared->refCount, 1) > 1)
+    return;
+
+  FREE_ARRAY(char, shared->chars, shared->length + 1);
+  FREE(SharedChars, shared);
+}
+
 ObjNative* newNative(ObaVM* vm, NativeFn function) {
   ObjNative* native = ALLOCATE_OBJ(vm, ObjNative, OBJ_NATIVE);
   native->function = function;
@@ -166,6 +246,7 @@ ObjModule* newModule(ObaVM* vm, ObjString* name) {
   module->name = name;
   module->variables = (Table*)reallocate(NULL, 0, sizeof(Table));
   initTable(module->variables);
+  module->closures = NULL;
   return module;
 }
 
@@ -189,6 +270,13 @@ bool objectsEqual(Value ao, Value bo) {
     NativeFn b = AS_NATIVE(bo);
     return a == b;
   }
+  case OBJ_FIBER:
+    return AS_FIBER(ao) == AS_FIBER(bo);
+  case OBJ_TASK:
+    return AS_TASK(ao) == AS_TASK(bo);
+  case OBJ_CHANNEL:
+    // Each VM has handles of its own to the channels it was sent.
+    return AS_CHANNEL(ao)->channel == AS_CHANNEL(bo)->channel;
   default:
     return false; // Unreachable.
   }
@@ -289,7 +377,7 @@ bool tableGet(Table* table, ObjString* key, Value* value) {
 }
 
 bool tableSet(Table* table, ObjString* key, Value value) {
-  if (table->count <= table->capacity * TABLE_MAX_LOAD) {
+  if (table->count + 1 > table->capacity * TABLE_MAX_LOAD) {
     int capacity = GROW_CAPACITY(table->capacity);
     adjustCapacity(table, capacity);
   }
@@ -304,3 +392,12 @@ bool tableSet(Table* table, ObjString* key, Value value) {
   entry->value = value;
   return isNewKey;
 }
+
+void tableAddAll(Table* from, Table* to) {
+  for (int i = 0; i < from->capacity; i++) {
+    Entry* entry = &from->entries[i];
+    if (entry->key != NULL) {
+      tableSet(to, entry->key, entry->value);
+    }
+  }
+}
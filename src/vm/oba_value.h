@@ -1,6 +1,7 @@
 #ifndef oba_value_h
 #define oba_value_h
 
+#include <stdatomic.h>
 #include <stdbool.h>
 #include <stdint.h>
 #include <stdlib.h>
@@ -24,6 +25,9 @@
 #define IS_NATIVE(value) isObjType(value, OBJ_NATIVE)
 #define IS_UPVALUE(value) isObjType(value, OBJ_UPVALUE)
 #define IS_MODULE(value) isObjType(value, OBJ_MODULE)
+#define IS_FIBER(value) isObjType(value, OBJ_FIBER)
+#define IS_TASK(value) isObjType(value, OBJ_TASK)
+#define IS_CHANNEL(value) isObjType(value, OBJ_CHANNEL)
 #define OBJ_TYPE(value) (AS_OBJ(value)->type)
 
 // Macros for converting from Oba to C.
@@ -37,6 +41,9 @@
 #define AS_NATIVE(value) (((ObjNative*)AS_OBJ(value))->function)
 #define AS_UPVALUE(value) ((ObjUpvalue*)AS_OBJ(value))
 #define AS_MODULE(value) ((ObjModule*)AS_OBJ(value))
+#define AS_FIBER(value) ((ObjFiber*)AS_OBJ(value))
+#define AS_TASK(value) ((ObjTask*)AS_OBJ(value))
+#define AS_CHANNEL(value) ((ObjChannel*)AS_OBJ(value))
 
 // Singletions
 #define NIL_VAL ((Value){VAL_NIL, {0}})
@@ -51,6 +58,9 @@ typedef enum {
   OBJ_NATIVE,
   OBJ_UPVALUE,
   OBJ_MODULE,
+  OBJ_FIBER,
+  OBJ_TASK,
+  OBJ_CHANNEL,
 } ObjType;
 
 typedef struct Obj {
@@ -82,19 +92,31 @@ typedef struct {
   Value* values;
 } ValueArray;
 
+// Characters held by strings in any number of VMs, on any thread, which are
+// freed along with the last string holding them.
+typedef struct {
+  atomic_int refCount;
+  char* chars;
+  int length;
+} SharedChars;
+
 typedef struct {
   Obj obj;
   int length;
   char* chars;
   uint32_t hash;
-} ObjString;
 
-typedef Value (*NativeFn)(ObaVM* vm, int argc, Value* argv);
+  // Whether [chars] was allocated for this string. Strings loaded in place from
+  // a mapped bytecode image borrow their characters, which are never freed.
+  bool ownsChars;
 
-struct Builtin {
-  const char* name;
-  NativeFn function;
-};
+  // The shared characters holding [chars] once the string has been sent to
+  // another VM, or NULL. They are then freed with the last string holding them
+  // rather than with this one.
+  _Atomic(SharedChars*) shared;
+} ObjString;
+
+typedef ObaNativeFn NativeFn;
 
 typedef struct {
   Obj obj;
@@ -116,6 +138,10 @@ typedef struct {
   Obj obj;
   Table* variables;
   ObjString* name;
+
+  // The closures created in the module, newest first, so that reloading it
+  // can move the closures its new body created into it.
+  struct ObjClosure* closures;
 } ObjModule;
 
 static inline bool isObjType(Value value, ObjType type) {
@@ -140,6 +166,23 @@ void freeObject(Obj*);
 ObjString* allocateString(ObaVM* vm, char* chars, int length, uint32_t hash);
 ObjString* takeString(ObaVM* vm, char* chars, int length);
 
+// Creates a string whose [length] characters live in memory owned by something
+// else, such as a mapped bytecode image. [chars] must be null-terminated and
+// outlive the string.
+ObjString* borrowString(ObaVM* vm, const char* chars, int length);
+
+// Returns the characters of [string] as shared characters, which the caller
+// holds a reference to. Characters the string owns are shared without being
+// copied, so this only copies the ones it borrows, once.
+SharedChars* shareChars(ObjString* string);
+
+// Creates a string in [vm] holding a new reference to [shared], which a string
+// with [hash] was shared as.
+ObjString* newSharedString(ObaVM* vm, SharedChars* shared, uint32_t hash);
+
+// Drops a reference to [shared].
+void releaseChars(SharedChars* shared);
+
 ObjNative* newNative(ObaVM*, NativeFn);
 
 ObjModule* newModule(ObaVM* vm, ObjString* name);
@@ -151,4 +194,7 @@ void adjustCapacity(Table* table, int capacity);
 bool tableGet(Table* table, ObjString* key, Value* value);
 bool tableSet(Table* table, ObjString* key, Value value);
 
+// Copies every entry of [from] into [to].
+void tableAddAll(Table* from, Table* to);
+
 #endif
@@ -1,3 +1,4 @@
+#include <limits.h>
 #include <stdarg.h>
 #include <stdint.h>
 #include <stdio.h>
@@ -6,14 +7,23 @@
 
 #include "oba.h"
 #include "oba_builtins.h"
+#include "oba_bytecode.h"
 #include "oba_common.h"
 #include "oba_function.h"
+#include "oba_snapshot.h"
+#include "oba_stdlib.h"
 #include "oba_vm.h"
 
 #ifdef DEBUG_TRACE_EXECUTION
 #include "oba_debug.h"
 #endif
 
+const int stackEffects[] = {
+#define OPCODE(name, effect) effect,
+#include "oba_opcodes.h"
+#undef OPCODE
+};
+
 // VM -------------------------------------------------------------------------
 
 static Value peek(ObaVM* vm, int lookahead) {
@@ -33,15 +43,68 @@ static Value pop(ObaVM* vm) {
 static void defineNative(ObaVM* vm, const char* name, NativeFn function) {
   push(vm, OBJ_VAL(copyString(vm, name, (int)strlen(name))));
   push(vm, OBJ_VAL(newNative(vm, function)));
-  tableSet(vm->globals, AS_STRING(vm->stack[0]), vm->stack[1]);
+  tableSet(vm->globals, AS_STRING(vm->fiber->stack[0]), vm->fiber->stack[1]);
   pop(vm);
   pop(vm);
 }
 
-static void resetStack(ObaVM* vm) { vm->stackTop = vm->stack; }
+// Finishes [fiber] and the fibers that resumed it, up to the root fiber,
+// since the code they were running has been abandoned.
+static void abandonFibers(ObaVM* vm, ObjFiber* fiber) {
+  while (fiber != NULL && fiber != vm->root) {
+    ObjFiber* caller = fiber->caller;
+    fiber->frame = fiber->frames;
+    fiber->stackTop = fiber->stack;
+    fiber->apiStack = fiber->stack;
+    fiber->nativeCalls = 0;
+    fiber->openUpvalues = NULL;
+    fiber->closure = NULL;
+    fiber->caller = NULL;
+    fiber = caller;
+  }
+}
+
+// Saves where the running fiber is, and continues [fiber] from where it was.
+static void switchFiber(ObaVM* vm, ObjFiber* fiber) {
+  ObjFiber* current = vm->fiber;
+  current->frame = vm->frame;
+  current->stackTop = vm->stackTop;
+  current->apiStack = vm->apiStack;
+  current->openUpvalues = vm->openUpvalues;
+
+  vm->fiber = fiber;
+  vm->frame = fiber->frame;
+  vm->stackTop = fiber->stackTop;
+  vm->apiStack = fiber->apiStack;
+  vm->openUpvalues = fiber->openUpvalues;
+}
+
+// Whether [vm] waits for I/O, another task or a channel, which it does once a
+// native has started waiting until the VM is resumed.
+static inline bool isWaiting(ObaVM* vm) {
+  return vm->wait != NULL || vm->joining != NULL || vm->channel != NULL;
+}
+
+static void resetStack(ObaVM* vm) {
+  abandonFibers(vm, vm->suspended != NULL ? vm->suspended : vm->fiber);
+  vm->suspended = NULL;
+  if (vm->wait != NULL) {
+    cancelWait(vm);
+  }
+  vm->joining = NULL;
+  if (vm->channel != NULL) {
+    cancelChannel(vm);
+  }
+  vm->fiber = vm->root;
+  vm->fiber->nativeCalls = 0;
+  vm->stackTop = vm->fiber->stack;
+  vm->apiStack = vm->fiber->stack;
+  vm->openUpvalues = NULL;
+  vm->frame = vm->fiber->frames;
+}
 
 static void registerBuiltins(ObaVM* vm, Builtin* builtins, int builtinsLength) {
-  Builtin* builtin = __builtins__;
+  const Builtin* builtin = __builtins__;
 
   // Original builtins.
   while (builtin->name != NULL) {
@@ -58,10 +121,12 @@ static void registerBuiltins(ObaVM* vm, Builtin* builtins, int builtinsLength) {
 static void runtimeError(ObaVM* vm, const char* format, ...) {
   va_list args;
   va_start(args, format);
+  flockfile(stderr);
   fprintf(stderr, "Runtime error: ");
   vfprintf(stderr, format, args);
-  va_end(args);
   fputs("\n", stderr);
+  funlockfile(stderr);
+  va_end(args);
 
   // TODO(kendal): Capture op line info
   /*
@@ -70,6 +135,7 @@ static void runtimeError(ObaVM* vm, const char* format, ...) {
   fprintf(stderr, "[line %d] in script\n", line);
   */
   resetStack(vm);
+  vm->hasError = true;
 }
 
 static bool call(ObaVM* vm, ObjClosure* closure, int arity) {
@@ -79,22 +145,58 @@ static bool call(ObaVM* vm, ObjClosure* closure, int arity) {
     return false;
   }
 
-  vm->frame++;
-  if (vm->frame - vm->frames > FRAMES_MAX) {
+  if (vm->frame - vm->fiber->frames + 1 >= FRAMES_MAX) {
     runtimeError(vm, "Too many nested function calls");
     return false;
   }
+
+  if (closure->function->source != NULL &&
+      !compileFunctionBody(vm, closure->function)) {
+    runtimeError(vm, "Could not compile function %s",
+                 closure->function->name->chars);
+    return false;
+  }
+
+  // Make sure the function has room for every value it can push, so that
+  // individual pushes do not need to be checked.
+  Value* slots = vm->stackTop - arity;
+  if (slots + closure->function->maxSlots > vm->fiber->stack + STACK_MAX) {
+    runtimeError(vm, "Stack overflow");
+    return false;
+  }
+
+  vm->frame++;
   vm->frame->closure = closure;
   vm->frame->ip = closure->function->chunk.code;
-  vm->frame->slots = vm->stackTop - arity;
+  vm->frame->slots = slots;
   return true;
 }
 
 static bool callNative(ObaVM* vm, NativeFn native, int arity) {
-  Value result = native(vm, arity, vm->stackTop - arity);
-  vm->stackTop -= arity;
-  push(vm, result);
-  return true;
+  // The native's slots start at the native itself, which its result replaces.
+  ObjFiber* fiber = vm->fiber;
+  Value* apiStack = vm->apiStack;
+  vm->apiStack = vm->stackTop - arity - 1;
+  vm->apiStack[0] = NIL_VAL;
+  native(vm, arity);
+
+  // A function the native called failed, and the stack is gone.
+  if (vm->hasError)
+    return false;
+
+  // If the native switched to another fiber, its own continues from the
+  // native's result when it is switched back to.
+  if (vm->fiber != fiber) {
+    fiber->stackTop = fiber->apiStack + 1;
+    fiber->apiStack = apiStack;
+    return true;
+  }
+  vm->stackTop = vm->apiStack + 1;
+  vm->apiStack = apiStack;
+
+  // A native that waits for I/O, another task or a channel stops the VM until
+  // its result is ready.
+  return !isWaiting(vm);
 }
 
 static bool callValue(ObaVM* vm, Value value, int arity) {
@@ -150,11 +252,13 @@ static void closeUpvalue(ObaVM* vm, Value* last) {
   }
 }
 
-char* readFile(ObaVM* vm, const char* path) {
+// Modules --------------------------------------------------------------------
+
+// Returns the contents of the file at [path], or NULL if it cannot be read.
+static char* readFile(const char* path) {
   FILE* fp = fopen(path, "rb");
   if (!fp) {
-    perror("failed to read file");
-    exit(1);
+    return NULL;
   }
 
   // Get the file size.
@@ -164,16 +268,10 @@ char* readFile(ObaVM* vm, const char* path) {
 
   // Read the contents.
   char* contents = malloc(size + 1);
-  if (!contents) {
-    fclose(fp);
-    perror("failed to allocate memory for file");
-    exit(1);
-  }
-  if (1 != fread(contents, size, 1, fp)) {
+  if (!contents || fread(contents, 1, size, fp) != (size_t)size) {
     fclose(fp);
     free(contents);
-    perror("failed to read file");
-    exit(1);
+    return NULL;
   }
   contents[size] = '\0';
 
@@ -181,47 +279,188 @@ char* readFile(ObaVM* vm, const char* path) {
   return contents;
 }
 
-// TODO(kendal): Allow the host application to resolve modules in its own way.
-static char* resolveModule(ObaVM* vm, Value name) {
-  ObjString* path = AS_STRING(name);
+// Returns the name that the module [name], imported by [importer], is
+// registered under, or NULL if the host's resolver rejects it.
+static ObjString* resolveModule(ObaVM* vm, ObjModule* importer,
+                                ObjString* name) {
+  if (vm->resolveModuleFn == NULL)
+    return name;
 
-  int pathLength = path->length + strlen("mod/.oba") + 1;
-  char* fullpath = malloc(pathLength);
-  sprintf(fullpath, "mod/%s.oba", path->chars);
-  fullpath[pathLength] = '\0';
-  return fullpath;
+  char* resolved = vm->resolveModuleFn(vm, importer->name->chars, name->chars);
+  if (resolved == NULL)
+    return NULL;
+  return takeString(vm, resolved, (int)strlen(resolved));
 }
 
-ObjClosure* compileInModule(ObaVM* vm, Value value, const char* source) {
-  ObjString* name = AS_STRING(value);
-  ObjModule* module = newModule(vm, name);
-  ObjFunction* function = obaCompile(vm, module, source);
+// Stores [module] as a global variable of the current module, under [name].
+static void bindModule(ObaVM* vm, ObjString* name, ObjModule* module) {
+  tableSet(vm->frame->closure->module->variables, name,
+           OBJ_VAL(module));
+}
+
+// Loads the body of [module] from [result], which the host's loader returned.
+// Returns NULL if the module does not compile or its bytecode is rejected.
+static ObjFunction* loadHostModule(ObaVM* vm, ObjModule* module,
+                                   ObaLoadModuleResult result) {
+  if (result.source != NULL) {
+    ObjFunction* function = compileCached(vm, module, result.source);
+    if (result.onComplete != NULL) {
+      result.onComplete(vm, module->name->chars, result);
+    }
+    return function;
+  }
+
+  // Bytecode runs in place, so the host's buffer is only released once the VM
+  // is freed. This holds even if it is rejected, because objects read before
+  // the problem was found may point into it.
+  HostBuffer* buffer = ALLOCATE(HostBuffer, 1);
+  buffer->module = module;
+  buffer->result = result;
+  buffer->next = vm->hostBuffers;
+  vm->hostBuffers = buffer;
+
+  return deserializeModule(vm, module, result.bytecode, result.length, true);
+}
+
+// Calls the completion callback of every buffer that the host's loader
+// returned bytecode in.
+static void releaseHostBuffers(ObaVM* vm) {
+  HostBuffer* buffer = vm->hostBuffers;
+  while (buffer != NULL) {
+    HostBuffer* next = buffer->next;
+    if (buffer->result.onComplete != NULL) {
+      buffer->result.onComplete(vm, buffer->module->name->chars,
+                                buffer->result);
+    }
+    FREE(HostBuffer, buffer);
+    buffer = next;
+  }
+  vm->hostBuffers = NULL;
+}
+
+// Returns the contents of mod/[name].oba, or NULL if it cannot be read.
+static char* readModuleFile(const char* name) {
+  int pathLength = (int)strlen(name) + (int)strlen("mod/.oba") + 1;
+  char* path = ALLOCATE(char, pathLength);
+  snprintf(path, pathLength, "mod/%s.oba", name);
+  char* source = readFile(path);
+  FREE_ARRAY(char, path, pathLength);
+  return source;
+}
+
+// Frees the source of a module read by [readModuleFile].
+static void freeModuleFile(ObaVM* vm, const char* name,
+                           ObaLoadModuleResult result) {
+  free((char*)result.source);
+}
+
+// Loads the body of [module] from [job], which compiled it ahead of time.
+static ObjFunction* loadPrefetched(ObaVM* vm, ObjModule* module,
+                                   PrefetchJob* job) {
+  ObaLoadModuleResult result = job->result;
+  ObjFunction* function = finishPrefetch(vm, job);
   if (function == NULL) {
-    return NULL;
+    // Bytecode is not loaded ahead of time, and a module that does not compile
+    // is compiled again so that its errors are reported.
+    return loadHostModule(vm, module, result);
   }
 
-  // Store the module as a global variable of the current module.
-  tableSet(vm->frame->closure->function->module->variables, module->name,
-           OBJ_VAL(module));
-  return newClosure(vm, function);
+  if (result.onComplete != NULL) {
+    result.onComplete(vm, module->name->chars, result);
+  }
+  return function;
 }
 
-// TODO(kendal): If the module is already loaded, bail early.
-// TODO(kendal): Handle circular imports.
-static ObjClosure* importModule(ObaVM* vm, Value name) {
-  char* path = resolveModule(vm, name);
-  char* source = readFile(vm, path);
+// Loads the body of [module], which has not been loaded yet.
+//
+// The host's loader is asked first. Modules it does not provide come from the
+// standard library compiled into the binary, then from mod/<name>.oba.
+static ObjFunction* loadModule(ObaVM* vm, ObjModule* module) {
+  const char* name = module->name->chars;
+
+  PrefetchJob* job = takePrefetch(vm->prefetcher, name);
+  if (job != NULL)
+    return loadPrefetched(vm, module, job);
+
+  if (vm->loadModuleFn != NULL) {
+    ObaLoadModuleResult result = vm->loadModuleFn(vm, name);
+    if (result.source != NULL || result.bytecode != NULL) {
+      return loadHostModule(vm, module, result);
+    }
+  }
+
+  // The standard library runs straight from the binary, without touching the
+  // filesystem.
+  const EmbeddedModule* embedded = findEmbeddedModule(name);
+  if (embedded != NULL) {
+    ObjFunction* function = deserializeModule(vm, module, embedded->bytecode,
+                                              embedded->length, true);
+    if (function != NULL)
+      return function;
+  }
 
-  ObjClosure* moduleClosure = compileInModule(vm, name, source);
-  if (moduleClosure == NULL) {
-    FREE_ARRAY(char, source, strlen(source));
+  char* source = readModuleFile(name);
+  if (source == NULL)
     return NULL;
+
+  ObjFunction* function = compileCached(vm, module, source);
+  free(source);
+  return function;
+}
+
+// Queues the modules imported by [importer], which the compiler collected in
+// the VM's imports, to be compiled on worker threads while [importer] runs.
+//
+// Modules that are loaded already or built into the binary are skipped, since
+// there is nothing to compile.
+static void prefetchImports(ObaVM* vm, ObjModule* importer) {
+  ValueArray imports = vm->imports;
+  initValueArray(&vm->imports);
+
+  for (int i = 0; i < imports.count; i++) {
+    ObjString* resolved =
+        resolveModule(vm, importer, AS_STRING(imports.values[i]));
+    Value loaded;
+    if (resolved == NULL || tableGet(vm->modules, resolved, &loaded) ||
+        isPrefetching(vm->prefetcher, resolved->chars))
+      continue;
+
+    ObaLoadModuleResult result = {0};
+    if (vm->loadModuleFn != NULL) {
+      result = vm->loadModuleFn(vm, resolved->chars);
+    }
+    if (result.source == NULL && result.bytecode == NULL) {
+      if (findEmbeddedModule(resolved->chars) != NULL)
+        continue;
+
+      result.source = readModuleFile(resolved->chars);
+      if (result.source == NULL)
+        continue;
+      result.onComplete = freeModuleFile;
+    }
+    queuePrefetch(vm->prefetcher, resolved->chars, result, vm->sharedCode);
   }
 
-  FREE_ARRAY(char, path, strlen(path));
-  FREE_ARRAY(char, source, strlen(source));
+  freeValueArray(&imports);
+}
+
+// Loads the module registered as [resolved] and binds it to [name] in the
+// current module. Returns a closure that runs the module's body, or NULL if it
+// cannot be loaded.
+//
+// The module is registered before its body runs, so that a module importing it
+// while it runs gets the variables it has defined so far.
+static ObjClosure* importModule(ObaVM* vm, ObjString* name,
+                                ObjString* resolved) {
+  ObjModule* module = newModule(vm, resolved);
+  ObjFunction* function = loadModule(vm, module);
+  prefetchImports(vm, module);
+  if (function == NULL)
+    return NULL;
 
-  return moduleClosure;
+  tableSet(vm->modules, resolved, OBJ_VAL(module));
+  bindModule(vm, name, module);
+  return newClosure(vm, function, module);
 }
 
 static void return_(ObaVM* vm) {
@@ -237,11 +476,73 @@ static void return_(ObaVM* vm) {
   vm->frame--;
 }
 
+// Ends the fiber [vm] is running, whose function has returned, and continues
+// the fiber that resumed it with the function's result.
+static void finishFiber(ObaVM* vm) {
+  ObjFiber* fiber = vm->fiber;
+  Value result = pop(vm);
+  switchFiber(vm, fiber->caller);
+  fiber->caller = NULL;
+
+  // The caller is suspended in a call to resume, whose slot the result fills.
+  vm->stackTop[-1] = result;
+}
+
+bool isFiberDone(ObaVM* vm, ObjFiber* fiber) {
+  return fiber != vm->fiber && fiber->closure == NULL &&
+         fiber->frame == fiber->frames;
+}
+
+void resumeFiber(ObaVM* vm, ObjFiber* fiber, Value value) {
+  if (fiber == vm->root || fiber == vm->fiber || fiber->caller != NULL) {
+    runtimeError(vm, "Fiber is already running");
+    return;
+  }
+  if (isFiberDone(vm, fiber)) {
+    runtimeError(vm, "Cannot resume a finished fiber");
+    return;
+  }
+
+  fiber->caller = vm->fiber;
+  switchFiber(vm, fiber);
+  if (fiber->closure == NULL) {
+    // The fiber is suspended in a call to yield, which returns [value].
+    vm->stackTop[-1] = value;
+    return;
+  }
+
+  // The first resume calls the fiber's function, with [value] if it takes an
+  // argument.
+  ObjClosure* closure = fiber->closure;
+  fiber->closure = NULL;
+  push(vm, OBJ_VAL(closure));
+  if (closure->function->arity == 1) {
+    push(vm, value);
+  }
+  call(vm, closure, closure->function->arity);
+}
+
+void yieldFiber(ObaVM* vm, Value value) {
+  ObjFiber* fiber = vm->fiber;
+  if (fiber->caller == NULL) {
+    runtimeError(vm, "Cannot yield from the main fiber");
+    return;
+  }
+  if (fiber->nativeCalls > 0) {
+    runtimeError(vm, "Cannot yield from a function called by a native");
+    return;
+  }
+
+  switchFiber(vm, fiber->caller);
+  fiber->caller = NULL;
+  vm->stackTop[-1] = value;
+}
+
 static void concatenate(ObaVM* vm) {
   ObjString* b = AS_STRING(pop(vm));
   ObjString* a = AS_STRING(pop(vm));
 
-  char* chars = ALLOCATE(char, b->length + a->length);
+  char* chars = ALLOCATE(char, b->length + a->length + 1);
   int length = b->length + a->length;
 
   memcpy(chars, a->chars, a->length);
@@ -256,14 +557,48 @@ ObaVM* obaNewVM(Builtin* builtins, int builtinsLength) {
   ObaVM* vm = (ObaVM*)realloc(NULL, sizeof(*vm));
   memset(vm, 0, sizeof(ObaVM));
 
-  vm->openUpvalues = NULL;
   vm->objects = NULL;
-  vm->frame = vm->frames;
+  vm->images = NULL;
+  vm->resolveModuleFn = NULL;
+  vm->loadModuleFn = NULL;
+  vm->hostBuffers = NULL;
+  vm->handles = NULL;
+  vm->hasError = false;
+  vm->loop = NULL;
+  vm->wait = NULL;
+  vm->scheduler = NULL;
+  vm->task = NULL;
+  vm->joining = NULL;
+  vm->channel = NULL;
+  vm->receiving = NULL;
+  vm->receivingCount = 0;
+  vm->receivingCapacity = 0;
+#ifdef OBA_FUEL
+  vm->fuel = LLONG_MAX;
+#endif
+  vm->prefetcher = newPrefetcher();
+  vm->reportCompileErrors = true;
+  vm->sharedCode = NULL;
+  vm->sharedModules = NULL;
+  vm->sharedModuleCount = 0;
+  vm->sharedModuleCapacity = 0;
+  vm->userData = NULL;
+  vm->main = NULL;
+  vm->snapshot = NULL;
+  vm->prelude = NULL;
 
   vm->globals = (Table*)realloc(NULL, sizeof(Table));
   initTable(vm->globals);
+  initValueArray(&vm->imports);
+
+  vm->modules = (Table*)realloc(NULL, sizeof(Table));
+  initTable(vm->modules);
 
+  vm->root = newFiber(vm, NULL);
+  vm->fiber = vm->root;
+  vm->suspended = NULL;
   resetStack(vm);
+  pthread_once(&startTimeOnce, readStartTime);
   registerBuiltins(vm, builtins, builtinsLength);
   return vm;
 }
@@ -278,16 +613,97 @@ static void freeObjects(ObaVM* vm) {
 }
 
 void obaFreeVM(ObaVM* vm) {
-  // The closure is unset if an error occurred during compilation.
-  if (vm->frame->closure != NULL) {
-    freeChunk(&vm->frame->closure->function->chunk);
+#ifdef OBA_COUNT_INSTRUCTIONS
+  fprintf(stderr, "Instructions executed: %llu\n", vm->instructionCount);
+#endif
+
+  if (vm->wait != NULL) {
+    cancelWait(vm);
+  }
+  if (vm->channel != NULL) {
+    cancelChannel(vm);
   }
-  freeTable(vm->frame->closure->function->module->variables);
+  stopReceiving(vm);
+  freePrefetcher(vm, vm->prefetcher);
+  releaseHostBuffers(vm);
+  while (vm->handles != NULL) {
+    obaReleaseHandle(vm, vm->handles);
+  }
+  freeValueArray(&vm->imports);
   freeObjects(vm);
+  freeTable(vm->globals);
+  free(vm->globals);
+  freeTable(vm->modules);
+  free(vm->modules);
+  unmapImages(vm);
+  freeSnapshot(vm);
+  releaseSharedModules(vm);
   free(vm);
 }
 
-static ObaInterpretResult run(ObaVM* vm) {
+ObaVM* newHeap(void) {
+  ObaVM* heap = ALLOCATE(ObaVM, 1);
+  memset(heap, 0, sizeof(ObaVM));
+  initValueArray(&heap->imports);
+
+  // A module that does not compile is compiled again when it is imported, which
+  // is when its errors are reported.
+  heap->reportCompileErrors = false;
+  return heap;
+}
+
+void freeHeap(ObaVM* heap) {
+  freeObjects(heap);
+  unmapImages(heap);
+  freeValueArray(&heap->imports);
+  releaseSharedModules(heap);
+  FREE(ObaVM, heap);
+}
+
+bool canSuspend(ObaVM* vm) {
+  // Natives called from C rather than Oba code have no code to resume.
+  if (vm->frame == vm->fiber->frames)
+    return false;
+
+  // A native's call cannot be resumed, since the native is on the C stack.
+  for (ObjFiber* fiber = vm->fiber; fiber != NULL; fiber = fiber->caller) {
+    if (fiber->nativeCalls > 0)
+      return false;
+  }
+  return true;
+}
+
+void setSuspendedResult(ObaVM* vm, Value value) {
+  // The suspended fiber stopped in a call to a native, whose slot is on top.
+  vm->suspended->stackTop[-1] = value;
+}
+
+// Stops the code [run] is running so that [obaResume] can continue it, and
+// returns [result] to the host.
+static ObaInterpretResult suspend(ObaVM* vm, ObaInterpretResult result) {
+  // The host's slots are in the root fiber until the VM resumes.
+  vm->suspended = vm->fiber;
+  switchFiber(vm, vm->root);
+  return result;
+}
+
+#ifdef OBA_FUEL
+// Stops the code [run] is running from [base] because it ran out of fuel.
+static ObaInterpretResult outOfFuel(ObaVM* vm, CallFrame* base) {
+  vm->fuel = 0;
+
+  // A native's call cannot be resumed, since the native is on the C stack.
+  if (base != vm->root->frames) {
+    runtimeError(vm, "Out of fuel in a function called by a native");
+    return OBA_RESULT_RUNTIME_ERROR;
+  }
+  return suspend(vm, OBA_RESULT_OUT_OF_FUEL);
+}
+#endif
+
+// Runs the code in [vm]'s current frame until it exits, or until a function
+// returns to [base].
+static ObaInterpretResult run(ObaVM* vm, CallFrame* base) {
 
   // clang-format off
 
@@ -313,6 +729,43 @@ do {                                                                           \
   }                                                                            \
 } while (0)
 
+// Like BINARY_OP, for operands the compiler has proven are numbers.
+#define NUMERIC_OP(type, op)                                                   \
+do {                                                                           \
+  double b = AS_NUMBER(pop(vm));                                               \
+  double a = AS_NUMBER(pop(vm));                                               \
+  push(vm, type(a op b));                                                      \
+} while (0)
+
+// Like BINARY_OP, for the fused forms that read operands [a] and [b] from
+// the frame instead of the stack.
+#define FUSED_OP(type, op, a, b)                                            \
+do {                                                                           \
+  Value left = (a);                                                            \
+  Value right = (b);                                                           \
+  if (!IS_NUMBER(left) || !IS_NUMBER(right)) {                                 \
+    runtimeError(vm, "Expected numeric or string operands");                   \
+    return OBA_RESULT_RUNTIME_ERROR;                                           \
+  }                                                                            \
+  push(vm, type(AS_NUMBER(left) op AS_NUMBER(right)));                         \
+} while (0)
+
+// Like FUSED_OP, for addition which also concatenates strings.
+#define FUSED_ADD(a, b)                                                     \
+do {                                                                           \
+  Value augend = (a);                                                          \
+  Value addend = (b);                                                          \
+  if (IS_STRING(augend) && IS_STRING(addend)) {                                \
+    push(vm, augend);                                                          \
+    push(vm, addend);                                                          \
+    concatenate(vm);                                                           \
+  } else {                                                                     \
+    FUSED_OP(OBA_NUMBER, +, augend, addend);                                \
+  }                                                                            \
+} while (0)
+
+#define READ_LOCAL() (vm->frame->slots[READ_BYTE()])
+
 // Debug output
 
 #ifdef DEBUG_TRACE_EXECUTION
@@ -322,7 +775,7 @@ do {                                                                           \
         &vm->frame->closure->function->chunk,                                  \
         (int)(vm->frame->ip - vm->frame->closure->function->chunk.code));      \
     printf("          ");                                                      \
-    for (Value* slot = vm->stack; slot < vm->stackTop; slot++) {               \
+    for (Value* slot = vm->fiber->stack; slot < vm->stackTop; slot++) {        \
       printf("[ ");                                                            \
       printValue(*slot);                                                       \
       printf(" ]");                                                            \
@@ -335,6 +788,24 @@ do {                                                                           \
 
 #define DEBUG_TRACE_INSTRUCTIONS() ;
 
+#endif
+
+#ifdef OBA_COUNT_INSTRUCTIONS
+#define COUNT_INSTRUCTION() vm->instructionCount++;
+#else
+#define COUNT_INSTRUCTION() ;
+#endif
+
+#ifdef OBA_FUEL
+// Uses a unit of fuel, and stops if there was none left. The instruction has
+// already run, so resuming continues with the next one.
+#define CONSUME_FUEL()                                                         \
+  do {                                                                         \
+    if (--vm->fuel < 0)                                                        \
+      return outOfFuel(vm, base);                                              \
+  } while (false)
+#else
+#define CONSUME_FUEL() ;
 #endif
 
   // Optimizations
@@ -344,6 +815,7 @@ do {                                                                           \
 #define DISPATCH()                                                             \
   do {                                                                         \
     DEBUG_TRACE_INSTRUCTIONS();                                                \
+    COUNT_INSTRUCTION();                                                       \
     goto* dispatchTable[READ_BYTE()];                                          \
   } while (true)
 
@@ -352,7 +824,7 @@ do {                                                                           \
   // Computed goto dispatch table.
   // eli.thegreenplace.net/2012/07/12/computed-goto-for-efficient-dispatch-tables
   static void* dispatchTable[] = {
-#define OPCODE(name) &&op_##name,
+#define OPCODE(name, effect) &&op_##name,
 #include "oba_opcodes.h"
 #undef OPCODE
   };
@@ -361,12 +833,12 @@ do {                                                                           \
 
 #else
 
-#define OPCODE(name) OP_##name
-#define CASE_OP(name) case OPCODE(name)
+#define CASE_OP(name) case OP_##name
 
 #define INTERPRET_LOOP                                                         \
   loop:                                                                        \
   DEBUG_TRACE_INSTRUCTIONS();                                                  \
+  COUNT_INSTRUCTION();                                                         \
   switch ((OpCode)READ_BYTE())
 
 #define DISPATCH() goto loop
@@ -438,6 +910,158 @@ do {                                                                           \
       DISPATCH();
     }
 
+    CASE_OP(ADD_NN) : {
+      NUMERIC_OP(OBA_NUMBER, +);
+      DISPATCH();
+    }
+
+    CASE_OP(MINUS_NN) : {
+      NUMERIC_OP(OBA_NUMBER, -);
+      DISPATCH();
+    }
+
+    CASE_OP(MULTIPLY_NN) : {
+      NUMERIC_OP(OBA_NUMBER, *);
+      DISPATCH();
+    }
+
+    CASE_OP(DIVIDE_NN) : {
+      NUMERIC_OP(OBA_NUMBER, /);
+      DISPATCH();
+    }
+
+    CASE_OP(GT_NN) : {
+      NUMERIC_OP(OBA_BOOL, >);
+      DISPATCH();
+    }
+
+    CASE_OP(LT_NN) : {
+      NUMERIC_OP(OBA_BOOL, <);
+      DISPATCH();
+    }
+
+    CASE_OP(GTE_NN) : {
+      NUMERIC_OP(OBA_BOOL, >=);
+      DISPATCH();
+    }
+
+    CASE_OP(LTE_NN) : {
+      NUMERIC_OP(OBA_BOOL, <=);
+      DISPATCH();
+    }
+
+    CASE_OP(ADD_LL) : {
+      Value a = READ_LOCAL();
+      Value b = READ_LOCAL();
+      FUSED_ADD(a, b);
+      DISPATCH();
+    }
+
+    CASE_OP(MINUS_LL) : {
+      Value a = READ_LOCAL();
+      Value b = READ_LOCAL();
+      FUSED_OP(OBA_NUMBER, -, a, b);
+      DISPATCH();
+    }
+
+    CASE_OP(MULTIPLY_LL) : {
+      Value a = READ_LOCAL();
+      Value b = READ_LOCAL();
+      FUSED_OP(OBA_NUMBER, *, a, b);
+      DISPATCH();
+    }
+
+    CASE_OP(DIVIDE_LL) : {
+      Value a = READ_LOCAL();
+      Value b = READ_LOCAL();
+      FUSED_OP(OBA_NUMBER, /, a, b);
+      DISPATCH();
+    }
+
+    CASE_OP(GT_LL) : {
+      Value a = READ_LOCAL();
+      Value b = READ_LOCAL();
+      FUSED_OP(OBA_BOOL, >, a, b);
+      DISPATCH();
+    }
+
+    CASE_OP(LT_LL) : {
+      Value a = READ_LOCAL();
+      Value b = READ_LOCAL();
+      FUSED_OP(OBA_BOOL, <, a, b);
+      DISPATCH();
+    }
+
+    CASE_OP(GTE_LL) : {
+      Value a = READ_LOCAL();
+      Value b = READ_LOCAL();
+      FUSED_OP(OBA_BOOL, >=, a, b);
+      DISPATCH();
+    }
+
+    CASE_OP(LTE_LL) : {
+      Value a = READ_LOCAL();
+      Value b = READ_LOCAL();
+      FUSED_OP(OBA_BOOL, <=, a, b);
+      DISPATCH();
+    }
+
+    CASE_OP(ADD_LK) : {
+      Value a = READ_LOCAL();
+      Value b = READ_CONSTANT();
+      FUSED_ADD(a, b);
+      DISPATCH();
+    }
+
+    CASE_OP(MINUS_LK) : {
+      Value a = READ_LOCAL();
+      Value b = READ_CONSTANT();
+      FUSED_OP(OBA_NUMBER, -, a, b);
+      DISPATCH();
+    }
+
+    CASE_OP(MULTIPLY_LK) : {
+      Value a = READ_LOCAL();
+      Value b = READ_CONSTANT();
+      FUSED_OP(OBA_NUMBER, *, a, b);
+      DISPATCH();
+    }
+
+    CASE_OP(DIVIDE_LK) : {
+      Value a = READ_LOCAL();
+      Value b = READ_CONSTANT();
+      FUSED_OP(OBA_NUMBER, /, a, b);
+      DISPATCH();
+    }
+
+    CASE_OP(GT_LK) : {
+      Value a = READ_LOCAL();
+      Value b = READ_CONSTANT();
+      FUSED_OP(OBA_BOOL, >, a, b);
+      DISPATCH();
+    }
+
+    CASE_OP(LT_LK) : {
+      Value a = READ_LOCAL();
+      Value b = READ_CONSTANT();
+      FUSED_OP(OBA_BOOL, <, a, b);
+      DISPATCH();
+    }
+
+    CASE_OP(GTE_LK) : {
+      Value a = READ_LOCAL();
+      Value b = READ_CONSTANT();
+      FUSED_OP(OBA_BOOL, >=, a, b);
+      DISPATCH();
+    }
+
+    CASE_OP(LTE_LK) : {
+      Value a = READ_LOCAL();
+      Value b = READ_CONSTANT();
+      FUSED_OP(OBA_BOOL, <=, a, b);
+      DISPATCH();
+    }
+
     CASE_OP(EQ) : {
       Value b = pop(vm);
       Value a = pop(vm);
@@ -505,12 +1129,43 @@ do {                                                                           \
 
     CASE_OP(LOOP) : {
       vm->frame->ip = vm->frame->closure->function->chunk.code + READ_SHORT();
+      CONSUME_FUEL();
+      DISPATCH();
+    }
+
+    CASE_OP(FOR_PREP) : {
+      // The counter and the limit are in consecutive slots.
+      Value* counter = &vm->frame->slots[READ_BYTE()];
+      uint16_t jump = READ_SHORT();
+      if (!IS_NUMBER(counter[0]) || !IS_NUMBER(counter[1])) {
+        runtimeError(vm, "Expected numeric range bounds");
+        return OBA_RESULT_RUNTIME_ERROR;
+      }
+      if (AS_NUMBER(counter[0]) >= AS_NUMBER(counter[1])) {
+        vm->frame->ip += jump;
+        DISPATCH();
+      }
+      push(vm, counter[0]);
+      DISPATCH();
+    }
+
+    CASE_OP(FOR_LOOP) : {
+      // The counter, the limit and the loop variable are in consecutive slots.
+      Value* counter = &vm->frame->slots[READ_BYTE()];
+      uint16_t start = READ_SHORT();
+      double next = AS_NUMBER(counter[0]) + 1;
+      if (next < AS_NUMBER(counter[1])) {
+        counter[0] = OBA_NUMBER(next);
+        counter[2] = counter[0];
+        vm->frame->ip = vm->frame->closure->function->chunk.code + start;
+        CONSUME_FUEL();
+      }
       DISPATCH();
     }
 
     CASE_OP(DEFINE_GLOBAL) : {
       ObjString* name = READ_STRING();
-      tableSet(vm->frame->closure->function->module->variables, name,
+      tableSet(vm->frame->closure->module->variables, name,
                peek(vm, 1));
       pop(vm);
       DISPATCH();
@@ -520,7 +1175,7 @@ do {                                                                           \
       ObjString* name = READ_STRING();
       Value value;
 
-      if (!tableGet(vm->frame->closure->function->module->variables, name,
+      if (!tableGet(vm->frame->closure->module->variables, name,
                     &value)) {
         if (!tableGet(vm->globals, name, &value)) {
           runtimeError(vm, "Undefined variable: %s", name->chars);
@@ -537,6 +1192,12 @@ do {                                                                           \
       DISPATCH();
     }
 
+    CASE_OP(STORE_LOCAL) : {
+      uint8_t slot = READ_BYTE();
+      vm->frame->slots[slot] = pop(vm);
+      DISPATCH();
+    }
+
     CASE_OP(GET_LOCAL) : {
       // Locals live on the top of the stack.
       uint8_t slot = READ_BYTE();
@@ -577,7 +1238,7 @@ do {                                                                           \
       Value value;
       if (!tableGet(module->variables, name, &value)) {
         runtimeError(vm, "Variable '%s' not found in module '%s'", name->chars,
-                     module->name);
+                     module->name->chars);
         return OBA_RESULT_RUNTIME_ERROR;
       }
       push(vm, value);
@@ -587,14 +1248,18 @@ do {                                                                           \
     CASE_OP(CALL) : {
       uint8_t argCount = READ_BYTE();
       if (!callValue(vm, peek(vm, argCount + 1), argCount)) {
+        if (isWaiting(vm))
+          return suspend(vm, OBA_RESULT_WAITING);
         return OBA_RESULT_RUNTIME_ERROR;
       }
+      CONSUME_FUEL();
       DISPATCH();
     }
 
     CASE_OP(CLOSURE) : {
       ObjFunction* function = AS_FUNCTION(READ_CONSTANT());
-      ObjClosure* closure = newClosure(vm, function);
+      ObjClosure* closure =
+          newClosure(vm, function, vm->frame->closure->module);
       push(vm, OBJ_VAL(closure));
 
       for (int j = 0; j < closure->upvalueCount; j++) {
@@ -611,6 +1276,11 @@ do {                                                                           \
 
     CASE_OP(RETURN) : {
       return_(vm);
+      if (vm->frame == base)
+        return OBA_RESULT_SUCCESS;
+      if (vm->frame == vm->fiber->frames) {
+        finishFiber(vm);
+      }
       DISPATCH();
     }
 
@@ -621,28 +1291,52 @@ do {                                                                           \
 
     CASE_OP(DEBUG) : {
       Value value = pop(vm);
+      flockfile(stdout);
       printValue(value);
       printf("\n");
+      funlockfile(stdout);
       DISPATCH();
     }
 
     CASE_OP(IMPORT_MODULE) : {
-      ObjClosure* moduleClosure = importModule(vm, READ_CONSTANT());
+      ObjString* name = READ_STRING();
+      ObjString* resolved =
+          resolveModule(vm, vm->frame->closure->module, name);
+      if (resolved == NULL) {
+        runtimeError(vm, "Could not resolve module '%s'", name->chars);
+        return OBA_RESULT_RUNTIME_ERROR;
+      }
+
+      // A module runs only once. Later imports bind the same module, even if
+      // it is still running because it imported this one.
+      Value module;
+      if (tableGet(vm->modules, resolved, &module)) {
+        bindModule(vm, name, AS_MODULE(module));
+        push(vm, module);
+        DISPATCH();
+      }
+
+      ObjClosure* moduleClosure = importModule(vm, name, resolved);
+      if (moduleClosure == NULL) {
+        runtimeError(vm, "Could not load module '%s'", resolved->chars);
+        return OBA_RESULT_RUNTIME_ERROR;
+      }
       push(vm, OBJ_VAL(moduleClosure));
       callValue(vm, OBJ_VAL(moduleClosure), 0);
       DISPATCH();
     }
 
     CASE_OP(END_MODULE) : {
-      if (vm->frame - vm->frames > 1) {
+      if (vm->frame - vm->fiber->frames > 1) {
         return_(vm);
       }
       DISPATCH();
     }
 
     CASE_OP(EXIT) : {
-      // Pop the root closure off the stack.
+      // Pop the root closure and its frame.
       pop(vm);
+      vm->frame--;
       return OBA_RESULT_SUCCESS;
     }
   }
@@ -652,15 +1346,21 @@ do {                                                                           \
 #undef READ_CONSTANT
 #undef READ_STRING
 #undef BINARY_OP
+#undef NUMERIC_OP
+#undef FUSED_OP
+#undef FUSED_ADD
+#undef READ_LOCAL
 #undef CASE_OP
 #undef DISPATCH
 #undef INTERPRET_LOOP
 #undef DEBUG_TRACE_INSTRUCTIONS
+#undef COUNT_INSTRUCTION
+#undef CONSUME_FUEL
 }
 
-ObaInterpretResult obaInterpret(ObaVM* vm, const char* source) {
-  ObjModule* module = newModule(vm, copyString(vm, "main", 4));
-  ObjFunction* function = obaCompile(vm, module, source);
+// Runs [function], the top-level function of [module], from an empty stack.
+static ObaInterpretResult interpretFunction(ObaVM* vm, ObjModule* module,
+                                            ObjFunction* function) {
   if (function == NULL) {
     return OBA_RESULT_COMPILE_ERROR;
   }
@@ -668,10 +1368,323 @@ ObaInterpretResult obaInterpret(ObaVM* vm, const char* source) {
     return OBA_RESULT_SUCCESS;
   }
 
+  resetStack(vm);
+  vm->hasError = false;
   push(vm, OBJ_VAL(function));
-  ObjClosure* closure = newClosure(vm, function);
+  ObjClosure* closure = newClosure(vm, function, module);
   pop(vm);
   push(vm, OBJ_VAL(closure));
+  CallFrame* base = vm->frame;
   callValue(vm, OBJ_VAL(closure), 0);
-  return run(vm);
+  return run(vm, base);
+}
+
+// Creates the module that a script runs in, which starts with the variables
+// restored from a snapshot, if any.
+static ObjModule* newMainModule(ObaVM* vm) {
+  ObjModule* module = newModule(vm, copyString(vm, "main", 4));
+  if (vm->prelude != NULL) {
+    tableAddAll(vm->prelude->variables, module->variables);
+  }
+  vm->main = module;
+  return module;
+}
+
+ObaInterpretResult obaInterpret(ObaVM* vm, const char* source) {
+  ObjModule* module = newMainModule(vm);
+  ObjFunction* function = obaCompile(vm, module, source);
+  prefetchImports(vm, module);
+  return interpretFunction(vm, module, function);
+}
+
+ObaInterpretResult obaInterpretCached(ObaVM* vm, const char* source) {
+  ObjModule* module = newMainModule(vm);
+  ObjFunction* function = compileCached(vm, module, source);
+  prefetchImports(vm, module);
+  return interpretFunction(vm, module, function);
+}
+
+ObaInterpretResult obaInterpretStream(ObaVM* vm, ObaReadFn read,
+                                      void* userData) {
+  ObjModule* module = newMainModule(vm);
+  ObjFunction* function = obaCompileStream(vm, module, read, userData);
+  prefetchImports(vm, module);
+  return interpretFunction(vm, module, function);
+}
+
+ObaInterpretResult obaReloadModule(ObaVM* vm, const char* name,
+                                   const char* source) {
+  // Running the new body would abandon the suspended code, so the error is
+  // reported without resetting the stack.
+  if (vm->suspended != NULL || isWaiting(vm)) {
+    fprintf(stderr,
+            "Runtime error: Cannot reload module '%s' while code is "
+            "suspended\n",
+            name);
+    return OBA_RESULT_RUNTIME_ERROR;
+  }
+
+  Value value;
+  if (!tableGet(vm->modules, copyString(vm, name, (int)strlen(name)),
+                &value)) {
+    runtimeError(vm, "Module '%s' is not loaded", name);
+    return OBA_RESULT_RUNTIME_ERROR;
+  }
+  ObjModule* module = AS_MODULE(value);
+
+  // The new body runs in a module of its own, so that nothing sees its
+  // variables until all of them are defined.
+  ObjModule* staging = newModule(vm, module->name);
+  ObjFunction* function = compileCached(vm, staging, source);
+  prefetchImports(vm, staging);
+  ObaInterpretResult result = interpretFunction(vm, staging, function);
+  if (result != OBA_RESULT_SUCCESS)
+    return result;
+
+  // Closures the new body created belong to the module from now on. Closures
+  // taken from the module before keep their code, but read its new variables.
+  ObjClosure* last = NULL;
+  for (ObjClosure* closure = staging->closures; closure != NULL;
+       closure = closure->nextInModule) {
+    closure->module = module;
+    last = closure;
+  }
+  if (last != NULL) {
+    last->nextInModule = module->closures;
+    module->closures = staging->closures;
+    staging->closures = NULL;
+  }
+  Table* variables = module->variables;
+  module->variables = staging->variables;
+  staging->variables = variables;
+  return OBA_RESULT_SUCCESS;
+}
+
+void obaSetFuel(ObaVM* vm, long long fuel) {
+#ifdef OBA_FUEL
+  vm->fuel = fuel < 0 ? LLONG_MAX : fuel;
+#else
+  (void)vm;
+  (void)fuel;
+#endif
+}
+
+long long obaGetFuel(ObaVM* vm) {
+#ifdef OBA_FUEL
+  return vm->fuel == LLONG_MAX ? -1 : vm->fuel;
+#else
+  (void)vm;
+  return -1;
+#endif
+}
+
+ObaInterpretResult obaResume(ObaVM* vm) {
+  // The code that ran out of fuel returns to the first frame of the root
+  // fiber, where the script or call it ran from started. Code waiting for I/O,
+  // a task or a channel is resumed by its event loop or scheduler once that is
+  // done.
+  if (isWaiting(vm))
+    return OBA_RESULT_WAITING;
+  if (vm->suspended == NULL)
+    return OBA_RESULT_SUCCESS;
+  switchFiber(vm, vm->suspended);
+  vm->suspended = NULL;
+  return run(vm, vm->root->frames);
+}
+
+void obaSetModuleHandlers(ObaVM* vm, ObaResolveModuleFn resolveModuleFn,
+                          ObaLoadModuleFn loadModuleFn) {
+  vm->resolveModuleFn = resolveModuleFn;
+  vm->loadModuleFn = loadModuleFn;
+}
+
+void obaSetUserData(ObaVM* vm, void* userData) { vm->userData = userData; }
+
+void* obaGetUserData(ObaVM* vm) { return vm->userData; }
+
+// Slots ----------------------------------------------------------------------
+
+bool obaEnsureSlots(ObaVM* vm, int count) {
+  if (vm->apiStack + count > vm->fiber->stack + STACK_MAX)
+    return false;
+
+  while (vm->stackTop < vm->apiStack + count) {
+    push(vm, NIL_VAL);
+  }
+  return true;
+}
+
+int obaGetSlotCount(ObaVM* vm) { return (int)(vm->stackTop - vm->apiStack); }
+
+ObaType obaGetSlotType(ObaVM* vm, int slot) {
+  ASSERT(slot < obaGetSlotCount(vm), "Slot out of bounds");
+  Value value = vm->apiStack[slot];
+  switch (value.type) {
+  case VAL_NIL:
+    return OBA_TYPE_NIL;
+  case VAL_BOOL:
+    return OBA_TYPE_BOOL;
+  case VAL_NUMBER:
+    return OBA_TYPE_NUMBER;
+  case VAL_OBJ:
+    return IS_STRING(value) ? OBA_TYPE_STRING : OBA_TYPE_UNKNOWN;
+  }
+  return OBA_TYPE_UNKNOWN; // Unreachable
+}
+
+void obaSetSlotNil(ObaVM* vm, int slot) {
+  ASSERT(slot < obaGetSlotCount(vm), "Slot out of bounds");
+  vm->apiStack[slot] = NIL_VAL;
+}
+
+void obaSetSlotBool(ObaVM* vm, int slot, bool value) {
+  ASSERT(slot < obaGetSlotCount(vm), "Slot out of bounds");
+  vm->apiStack[slot] = OBA_BOOL(value);
+}
+
+bool obaGetSlotBool(ObaVM* vm, int slot) {
+  ASSERT(slot < obaGetSlotCount(vm), "Slot out of bounds");
+  ASSERT(IS_BOOL(vm->apiStack[slot]), "Slot must hold a bool");
+  return AS_BOOL(vm->apiStack[slot]);
+}
+
+void obaSetSlotNumber(ObaVM* vm, int slot, double value) {
+  ASSERT(slot < obaGetSlotCount(vm), "Slot out of bounds");
+  vm->apiStack[slot] = OBA_NUMBER(value);
+}
+
+void obaCopySlot(ObaVM* vm, int slot, int from) {
+  ASSERT(slot < obaGetSlotCount(vm), "Slot out of bounds");
+  ASSERT(from < obaGetSlotCount(vm), "Slot out of bounds");
+  vm->apiStack[slot] = vm->apiStack[from];
+}
+
+double obaGetSlotNumber(ObaVM* vm, int slot) {
+  ASSERT(slot < obaGetSlotCount(vm), "Slot out of bounds");
+  ASSERT(IS_NUMBER(vm->apiStack[slot]), "Slot must hold a number");
+  return AS_NUMBER(vm->apiStack[slot]);
+}
+
+void obaSetSlotString(ObaVM* vm, int slot, const char* chars, size_t length) {
+  ASSERT(slot < obaGetSlotCount(vm), "Slot out of bounds");
+  vm->apiStack[slot] = OBJ_VAL(copyString(vm, chars, (int)length));
+}
+
+void obaSetSlotChannel(ObaVM* vm, int slot, ObaChannel* channel) {
+  ASSERT(slot < obaGetSlotCount(vm), "Slot out of bounds");
+  vm->apiStack[slot] = OBJ_VAL(newChannelHandle(vm, channel));
+}
+
+const char* obaGetSlotString(ObaVM* vm, int slot, size_t* length) {
+  ASSERT(slot < obaGetSlotCount(vm), "Slot out of bounds");
+  ASSERT(IS_STRING(vm->apiStack[slot]), "Slot must hold a string");
+  ObjString* string = AS_STRING(vm->apiStack[slot]);
+  if (length != NULL) {
+    *length = (size_t)string->length;
+  }
+  return string->chars;
+}
+
+// Calling Oba functions from C -----------------------------------------------
+
+ObaHandle* obaGetFunction(ObaVM* vm, const char* module, const char* name) {
+  ObjModule* found = NULL;
+  Value value;
+  if (strcmp(module, "main") == 0) {
+    found = vm->main;
+  } else if (tableGet(vm->modules,
+                      copyString(vm, module, (int)strlen(module)), &value)) {
+    found = AS_MODULE(value);
+  }
+
+  if (found == NULL ||
+      !tableGet(found->variables, copyString(vm, name, (int)strlen(name)),
+                &value) ||
+      !IS_CLOSURE(value)) {
+    return NULL;
+  }
+
+  ObaHandle* handle = ALLOCATE(ObaHandle, 1);
+  handle->closure = AS_CLOSURE(value);
+  handle->prev = NULL;
+  handle->next = vm->handles;
+  if (vm->handles != NULL) {
+    vm->handles->prev = handle;
+  }
+  vm->handles = handle;
+  return handle;
+}
+
+void obaReleaseHandle(ObaVM* vm, ObaHandle* handle) {
+  if (handle->prev != NULL) {
+    handle->prev->next = handle->next;
+  } else {
+    vm->handles = handle->next;
+  }
+  if (handle->next != NULL) {
+    handle->next->prev = handle->prev;
+  }
+  FREE(ObaHandle, handle);
+}
+
+ObaInterpretResult obaCallSlot(ObaVM* vm, int slot, int argCount) {
+  ASSERT(slot + argCount < obaGetSlotCount(vm), "Slot out of bounds");
+
+  // Only natives have slots above the bottom of the root fiber's stack, or in
+  // other fibers. A call from the host abandons the code that ran out of fuel
+  // or is waiting for I/O, if any. An error ends every call in progress, so a
+  // native whose call failed must not make another.
+  ObjFiber* fiber = vm->fiber;
+  bool fromNative = fiber != vm->root || vm->apiStack != fiber->stack;
+  if (!fromNative) {
+    abandonFibers(vm, vm->suspended);
+    vm->suspended = NULL;
+    if (vm->wait != NULL) {
+      cancelWait(vm);
+    }
+    vm->joining = NULL;
+    if (vm->channel != NULL) {
+      cancelChannel(vm);
+    }
+    vm->frame = fiber->frames;
+    fiber->nativeCalls = 0;
+    vm->hasError = false;
+  } else if (vm->hasError) {
+    return OBA_RESULT_RUNTIME_ERROR;
+  }
+
+  // The call runs on top of the slots, like a call made by Oba code, and may
+  // be made while other calls are running below it. The ones made by natives
+  // return before [callValue] does, and are counted until then. An error
+  // resets every fiber, so the count is only kept up to date when the call
+  // returns.
+  vm->stackTop = vm->apiStack + slot + argCount + 1;
+  CallFrame* base = vm->frame;
+  if (fromNative) {
+    fiber->nativeCalls++;
+  }
+  ObaInterpretResult result = OBA_RESULT_RUNTIME_ERROR;
+  if (callValue(vm, vm->apiStack[slot], argCount)) {
+    result = vm->frame == base ? OBA_RESULT_SUCCESS : run(vm, base);
+  }
+  if (fromNative && result == OBA_RESULT_SUCCESS) {
+    fiber->nativeCalls--;
+  }
+  return result;
+}
+
+void obaRuntimeError(ObaVM* vm, const char* message) {
+  runtimeError(vm, "%s", message);
+}
+
+ObaInterpretResult obaCall(ObaVM* vm, ObaHandle* handle) {
+  int arity = handle->closure->function->arity;
+  if (!obaEnsureSlots(vm, arity + 1)) {
+    runtimeError(vm, "Stack overflow");
+    return OBA_RESULT_RUNTIME_ERROR;
+  }
+
+  // The function takes the place of slot 0, where it returns its result.
+  vm->apiStack[0] = OBJ_VAL(handle->closure);
+  return obaCallSlot(vm, 0, arity);
 }
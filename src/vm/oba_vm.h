@@ -1,39 +1,187 @@
 #ifndef oba_vm_h
 #define oba_vm_h
 
+#include "oba_bytecode.h"
+#include "oba_channel.h"
 #include "oba_compiler.h"
 #include "oba_function.h"
+#include "oba_loop.h"
+#include "oba_prefetch.h"
+#include "oba_scheduler.h"
+#include "oba_shared.h"
 #include "oba_token.h"
 #include "oba_value.h"
 
-// The maximum number of values that can be held on the stack at once.
-#define STACK_MAX 256
+// A buffer of bytecode that the host's module loader returned, which modules
+// run from in place until the VM is freed.
+typedef struct HostBuffer {
+  ObjModule* module;
+  ObaLoadModuleResult result;
+  struct HostBuffer* next;
+} HostBuffer;
 
-// The maximum number of call-frames.
-#define FRAMES_MAX 256
+// A function the host looked up with [obaGetFunction].
+//
+// Handles are kept in a list on the VM, so that the ones the host never
+// releases are freed along with it.
+struct ObaHandle {
+  ObjClosure* closure;
+  struct ObaHandle* prev;
+  struct ObaHandle* next;
+};
 
 struct ObaVM {
-  CallFrame frames[FRAMES_MAX];
-  CallFrame* frame;
+  // The fiber the VM is running, and the one it runs scripts and the host's
+  // calls in.
+  ObjFiber* fiber;
+  ObjFiber* root;
 
-  Value stack[STACK_MAX];
+  // Where the running fiber is. These are kept here rather than in the fiber
+  // so that running code reaches them without going through [fiber], and are
+  // saved into the fiber when the VM switches to another.
+  CallFrame* frame;
   Value* stackTop;
 
+  // The first of the slots the host or the running native reads and writes
+  // values through.
+  Value* apiStack;
+
+  ObjUpvalue* openUpvalues;
+
+  // The fiber that was running when the VM last ran out of fuel or started
+  // waiting for I/O, which [obaResume] continues, or NULL.
+  ObjFiber* suspended;
+
+  // The event loop the VM's natives wait for I/O on, or NULL if they block,
+  // and what the VM is waiting for, if anything.
+  ObaEventLoop* loop;
+  Wait* wait;
+
+  // The scheduler the VM's natives spawn tasks on, or NULL, and the task the
+  // VM runs, if the scheduler created it to run one.
+  ObaScheduler* scheduler;
+  ObaTask* task;
+
+  // The task the VM waits for, once a native has joined one that has not
+  // finished, or NULL. The scheduler resumes the VM when that task finishes.
+  ObaTask* joining;
+
+  // The channel the VM waits to send [message] on, if [sending] is true, or to
+  // receive from otherwise, once a native has found it full or empty, or NULL.
+  // The scheduler resumes the VM when it is ready.
+  ObaChannel* channel;
+  bool sending;
+  Message message;
+
+  // The channels the VM receives from, each of which it holds a reference to
+  // until it is freed, which closes them.
+  ObaChannel** receiving;
+  int receivingCount;
+  int receivingCapacity;
+
+  // Whether a runtime error has been reported since the VM last started
+  // running. Natives that call back into Oba see this, after the stack has
+  // been reset, and their own callers stop running when they return.
+  bool hasError;
+
   // Global values available to all modules.
   //
   // Builtins are defined here. When searching for a global, the VM first checks
   // the current module, then this table.
   Table* globals;
 
+  // Every module loaded so far, by name.
   Table* modules;
-  ObjUpvalue* openUpvalues;
   Obj* objects;
+
+  // Bytecode images that loaded functions run from in place.
+  MappedImage* images;
+
+  // The host's module handlers, set by [obaSetModuleHandlers], and the buffers
+  // of bytecode its loader returned.
+  ObaResolveModuleFn resolveModuleFn;
+  ObaLoadModuleFn loadModuleFn;
+  HostBuffer* hostBuffers;
+
+  // The handles the host has not released yet.
+  ObaHandle* handles;
+
+  // The modules imported by the code compiled since they were last queued for
+  // compiling on [prefetcher]'s worker threads.
+  ValueArray imports;
+  Prefetcher* prefetcher;
+
+  // Whether the compiler prints the errors it finds.
+  bool reportCompileErrors;
+
+  // Where modules compiled from source are shared with other VMs, if anywhere,
+  // and the shared modules this VM has loaded.
+  ObaSharedCode* sharedCode;
+  SharedModule** sharedModules;
+  int sharedModuleCount;
+  int sharedModuleCapacity;
+
+  // Data the host associates with the VM, for use in its callbacks.
+  void* userData;
+
+  // The module of the most recent script run by [obaInterpret], whose
+  // variables [obaSaveSnapshot] saves.
+  ObjModule* main;
+
+  // The heap restored by [obaLoadSnapshot], and the module in it whose
+  // variables every script starts with.
+  uint8_t* snapshot;
+  size_t snapshotLength;
+  ObjModule* prelude;
+
+#ifdef OBA_FUEL
+  // The number of backward jumps and calls the VM can make before it stops,
+  // set by [obaSetFuel].
+  long long fuel;
+#endif
+
+#ifdef OBA_COUNT_INSTRUCTIONS
+  // The number of instructions executed so far, reported when the VM is freed.
+  unsigned long long instructionCount;
+#endif
 };
 
 typedef enum {
-#define OPCODE(name) OP_##name,
+#define OPCODE(name, effect) OP_##name,
 #include "oba_opcodes.h"
 #undef OPCODE
 } OpCode;
 
+// The stack effect of each instruction, indexed by [OpCode].
+extern const int stackEffects[];
+
+// Returns a heap to compile code into away from the VM that will run it.
+//
+// The compiler only uses a VM to allocate objects in, to map images from the
+// compile cache into, and to collect the names of imports, so a heap is a VM
+// that is never run.
+ObaVM* newHeap(void);
+
+// Frees [heap] and everything compiled into it.
+void freeHeap(ObaVM* heap);
+
+// Switches [vm] to [fiber], resuming it with [value], or reports a runtime
+// error if it cannot be resumed. Called from a native.
+void resumeFiber(ObaVM* vm, ObjFiber* fiber, Value value);
+
+// Switches [vm] back to the fiber that resumed the running one, which resumes
+// with [value], or reports a runtime error if it cannot. Called from a native.
+void yieldFiber(ObaVM* vm, Value value);
+
+// Whether [fiber] has run its function to the end.
+bool isFiberDone(ObaVM* vm, ObjFiber* fiber);
+
+// Whether the code that called the running native can be suspended until
+// [obaResume], which it cannot be if a native is waiting below it on the C
+// stack for a call to return.
+bool canSuspend(ObaVM* vm);
+
+// Sets the result of the native call [vm] is suspended in to [value].
+void setSuspendedResult(ObaVM* vm, Value value);
+
 #endif
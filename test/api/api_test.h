@@ -0,0 +1,30 @@
+#ifndef api_test_h
+#define api_test_h
+
+#include <stdbool.h>
+
+#include <oba.h>
+
+// Tests of the C API, which `make test` builds into a driver and runs after
+// the tests written in Oba.
+//
+// Each test is a function that checks what the API does with [EXPECT], and
+// carries on after a check fails so that every failure is reported. Errors
+// that scripts report on purpose go to stderr, which the driver discards.
+
+// Fails the running test unless [condition] holds.
+#define EXPECT(condition) expect((condition), #condition, __FILE__, __LINE__)
+
+// Reports [text], the source of [condition], at [line] of [file] if
+// [condition] does not hold. Use [EXPECT] rather than calling this directly.
+void expect(bool condition, const char* text, const char* file, int line);
+
+// The tests, each defined in the file of the same name.
+void testCallback(void);
+void testFuel(void);
+void testHandle(void);
+void testLoop(void);
+void testReload(void);
+void testSlot(void);
+
+#endif
@@ -0,0 +1,116 @@
+// Tests natives that call functions back with [obaCallSlot].
+
+#include <stdio.h>
+
+#include "api_test.h"
+
+// The number [record] was last called with.
+static double recorded;
+
+// The number of calls [apply] made that succeeded, and that failed.
+static int applied;
+static int failures;
+
+// Stores its argument in [recorded].
+static void recordNative(ObaVM* vm, int argc) {
+  (void)argc;
+  recorded = obaGetSlotNumber(vm, 1);
+}
+
+// Reports its argument, a string, as a runtime error.
+static void raiseNative(ObaVM* vm, int argc) {
+  (void)argc;
+  obaRuntimeError(vm, obaGetSlotString(vm, 1, NULL));
+}
+
+// Calls its first argument with its second, and returns the result.
+static void applyNative(ObaVM* vm, int argc) {
+  (void)argc;
+  if (obaCallSlot(vm, 1, 1) != OBA_RESULT_SUCCESS) {
+    failures++;
+    return;
+  }
+  applied++;
+  obaCopySlot(vm, 0, 1);
+}
+
+static Builtin builtins[] = {
+    {"record", recordNative},
+    {"raise", raiseNative},
+    {"apply", applyNative},
+};
+
+static const char* functions = "\
+fn double n = n * 2\n\
+fn add_one n = n + 1\n\
+fn twice n = apply(double, apply(double, n))\n\
+fn bad n = n + true\n\
+fn fail n = raise(\"failed\")\n\
+fn nested_bad n = apply(bad, n)\n\
+fn sum n {\n\
+  let total = 0\n\
+  for i in 0..n {\n\
+    total = total + apply(double, i)\n\
+  }\n\
+  total\n\
+}\n\
+";
+
+// Runs [source] in [vm] after the functions above, starting with [recorded]
+// and the counts reset.
+static ObaInterpretResult run(ObaVM* vm, const char* source) {
+  char script[1024];
+  snprintf(script, sizeof(script), "%s%s", functions, source);
+  recorded = -1;
+  applied = 0;
+  failures = 0;
+  return obaInterpret(vm, script);
+}
+
+void testCallback(void) {
+  ObaVM* vm = obaNewVM(builtins, sizeof(builtins) / sizeof(builtins[0]));
+
+  // Functions, and natives that call functions, called by natives.
+  EXPECT(run(vm, "record(apply(double, 21))") == OBA_RESULT_SUCCESS);
+  EXPECT(recorded == 42);
+  EXPECT(applied == 1);
+
+  EXPECT(run(vm, "record(apply(add_one, 1) + apply(add_one, 2))") ==
+         OBA_RESULT_SUCCESS);
+  EXPECT(recorded == 5);
+  EXPECT(applied == 2);
+
+  EXPECT(run(vm, "record(sum(4))") == OBA_RESULT_SUCCESS);
+  EXPECT(recorded == 12);
+  EXPECT(applied == 4);
+
+  EXPECT(run(vm, "record(apply(twice, 3))") == OBA_RESULT_SUCCESS);
+  EXPECT(recorded == 12);
+  EXPECT(applied == 3);
+
+  // An error in a function a native called fails the native's call, and
+  // every call below it, and stops the script.
+  EXPECT(run(vm, "apply(1, 2)\nrecord(1)") == OBA_RESULT_RUNTIME_ERROR);
+  EXPECT(recorded == -1);
+  EXPECT(failures == 1);
+
+  EXPECT(run(vm, "apply(bad, 1)\nrecord(1)") == OBA_RESULT_RUNTIME_ERROR);
+  EXPECT(recorded == -1);
+  EXPECT(failures == 1);
+
+  EXPECT(run(vm, "apply(fail, 1)\nrecord(1)") == OBA_RESULT_RUNTIME_ERROR);
+  EXPECT(recorded == -1);
+  EXPECT(failures == 1);
+
+  EXPECT(run(vm, "apply(nested_bad, 1)\nrecord(1)") ==
+         OBA_RESULT_RUNTIME_ERROR);
+  EXPECT(recorded == -1);
+  EXPECT(failures == 2);
+  EXPECT(applied == 0);
+
+  // The VM runs code as usual after an error.
+  EXPECT(run(vm, "record(apply(twice, 1))") == OBA_RESULT_SUCCESS);
+  EXPECT(recorded == 4);
+
+  obaFreeVM(vm);
+}
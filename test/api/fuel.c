@@ -0,0 +1,144 @@
+// Tests limiting the code a VM runs with [obaSetFuel].
+
+#include <stdio.h>
+
+#include "api_test.h"
+
+// The number [record] was last called with.
+static double recorded;
+
+// Stores its argument in [recorded].
+static void recordNative(ObaVM* vm, int argc) {
+  (void)argc;
+  recorded = obaGetSlotNumber(vm, 1);
+}
+
+// Calls its first argument with its second, and returns the result.
+static void applyNative(ObaVM* vm, int argc) {
+  (void)argc;
+  if (obaCallSlot(vm, 1, 1) == OBA_RESULT_SUCCESS) {
+    obaCopySlot(vm, 0, 1);
+  }
+}
+
+static Builtin builtins[] = {
+    {"record", recordNative},
+    {"apply", applyNative},
+};
+
+static const char* recordSum = "\
+{\n\
+  let total = 0\n\
+  for i in 0..100 {\n\
+    total = total + i\n\
+  }\n\
+  record(total)\n\
+}\n\
+";
+
+#ifdef OBA_FUEL
+
+static const char* sum = "\
+fn sum n {\n\
+  let total = 0\n\
+  for i in 0..n {\n\
+    total = total + i\n\
+  }\n\
+  total\n\
+}\n\
+";
+
+// Runs out of fuel in a script, and resumes it.
+static void testScript(ObaVM* vm) {
+  recorded = -1;
+  obaSetFuel(vm, 10);
+  EXPECT(obaInterpret(vm, recordSum) == OBA_RESULT_OUT_OF_FUEL);
+  EXPECT(obaGetFuel(vm) == 0);
+  EXPECT(recorded == -1);
+
+  // Each resume runs until the fuel it was given is used up.
+  int resumes = 0;
+  ObaInterpretResult result = OBA_RESULT_OUT_OF_FUEL;
+  while (result == OBA_RESULT_OUT_OF_FUEL && resumes < 100) {
+    obaSetFuel(vm, 10);
+    result = obaResume(vm);
+    resumes++;
+  }
+  EXPECT(result == OBA_RESULT_SUCCESS);
+  EXPECT(resumes > 1);
+  EXPECT(recorded == 4950);
+
+  // There is nothing left to resume.
+  EXPECT(obaResume(vm) == OBA_RESULT_SUCCESS);
+}
+
+// Runs out of fuel in a function called by the host, and resumes it.
+static void testCall(ObaVM* vm) {
+  obaSetFuel(vm, -1);
+  EXPECT(obaInterpret(vm, sum) == OBA_RESULT_SUCCESS);
+  ObaHandle* handle = obaGetFunction(vm, "main", "sum");
+  EXPECT(handle != NULL);
+  if (handle == NULL)
+    return;
+
+  obaSetFuel(vm, 5);
+  obaEnsureSlots(vm, 2);
+  obaSetSlotNumber(vm, 1, 100);
+  EXPECT(obaCall(vm, handle) == OBA_RESULT_OUT_OF_FUEL);
+
+  obaSetFuel(vm, -1);
+  EXPECT(obaGetFuel(vm) == -1);
+  EXPECT(obaResume(vm) == OBA_RESULT_SUCCESS);
+  EXPECT(obaGetSlotType(vm, 0) == OBA_TYPE_NUMBER);
+  EXPECT(obaGetSlotNumber(vm, 0) == 4950);
+
+  // Calling the function again abandons the call that ran out of fuel.
+  obaSetFuel(vm, 5);
+  obaEnsureSlots(vm, 2);
+  obaSetSlotNumber(vm, 1, 100);
+  EXPECT(obaCall(vm, handle) == OBA_RESULT_OUT_OF_FUEL);
+  obaSetFuel(vm, -1);
+  obaSetSlotNumber(vm, 1, 4);
+  EXPECT(obaCall(vm, handle) == OBA_RESULT_SUCCESS);
+  EXPECT(obaGetSlotNumber(vm, 0) == 6);
+  EXPECT(obaResume(vm) == OBA_RESULT_SUCCESS);
+
+  obaReleaseHandle(vm, handle);
+}
+
+// Runs out of fuel in a function called by a native, which cannot be resumed.
+static void testNative(ObaVM* vm) {
+  char script[256];
+  snprintf(script, sizeof(script), "%srecord(apply(sum, 100))", sum);
+  recorded = -1;
+  obaSetFuel(vm, 5);
+  EXPECT(obaInterpret(vm, script) == OBA_RESULT_RUNTIME_ERROR);
+  EXPECT(recorded == -1);
+  EXPECT(obaGetFuel(vm) == 0);
+
+  obaSetFuel(vm, -1);
+  EXPECT(obaResume(vm) == OBA_RESULT_SUCCESS);
+  EXPECT(recorded == -1);
+}
+
+#endif
+
+void testFuel(void) {
+  ObaVM* vm = obaNewVM(builtins, sizeof(builtins) / sizeof(builtins[0]));
+  EXPECT(obaGetFuel(vm) == -1);
+
+#ifdef OBA_FUEL
+  testScript(vm);
+  testCall(vm);
+  testNative(vm);
+#else
+  // Builds without OBA_FUEL ignore the limit.
+  recorded = -1;
+  obaSetFuel(vm, 0);
+  EXPECT(obaInterpret(vm, recordSum) == OBA_RESULT_SUCCESS);
+  EXPECT(obaGetFuel(vm) == -1);
+  EXPECT(recorded == 4950);
+#endif
+
+  obaFreeVM(vm);
+}
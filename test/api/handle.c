@@ -0,0 +1,77 @@
+// Tests calling Oba functions from C through handles.
+
+#include "api_test.h"
+
+static const char* functions = "\
+fn answer = 42\n\
+fn add a b = a + b\n\
+fn describe n = match n | 0 = \"zero\" | n = \"other\";\n\
+fn fail = 1 + true\n\
+let number = 1\n\
+";
+
+void testHandle(void) {
+  ObaVM* vm = obaNewVM(NULL, 0);
+  EXPECT(obaInterpret(vm, functions) == OBA_RESULT_SUCCESS);
+
+  // Only functions can be looked up.
+  EXPECT(obaGetFunction(vm, "main", "missing") == NULL);
+  EXPECT(obaGetFunction(vm, "main", "number") == NULL);
+  EXPECT(obaGetFunction(vm, "missing", "answer") == NULL);
+
+  ObaHandle* answer = obaGetFunction(vm, "main", "answer");
+  ObaHandle* add = obaGetFunction(vm, "main", "add");
+  ObaHandle* describe = obaGetFunction(vm, "main", "describe");
+  ObaHandle* fail = obaGetFunction(vm, "main", "fail");
+  EXPECT(answer != NULL && add != NULL && describe != NULL && fail != NULL);
+  if (answer == NULL || add == NULL || describe == NULL || fail == NULL)
+    return;
+
+  // A function with no arguments leaves its result as the only slot.
+  EXPECT(obaCall(vm, answer) == OBA_RESULT_SUCCESS);
+  EXPECT(obaGetSlotCount(vm) == 1);
+  EXPECT(obaGetSlotNumber(vm, 0) == 42);
+
+  // The arguments are taken from the slots after slot 0, and the slots after
+  // them are discarded.
+  EXPECT(obaEnsureSlots(vm, 5));
+  obaSetSlotNumber(vm, 1, 2);
+  obaSetSlotNumber(vm, 2, 3);
+  obaSetSlotNumber(vm, 3, 100);
+  EXPECT(obaCall(vm, add) == OBA_RESULT_SUCCESS);
+  EXPECT(obaGetSlotCount(vm) == 1);
+  EXPECT(obaGetSlotNumber(vm, 0) == 5);
+
+  // Strings are returned like any other value.
+  EXPECT(obaEnsureSlots(vm, 2));
+  obaSetSlotNumber(vm, 1, 0);
+  EXPECT(obaCall(vm, describe) == OBA_RESULT_SUCCESS);
+  EXPECT(obaGetSlotCount(vm) == 1);
+  EXPECT(obaGetSlotType(vm, 0) == OBA_TYPE_STRING);
+  size_t length;
+  const char* chars = obaGetSlotString(vm, 0, &length);
+  EXPECT(length == 4 && chars[0] == 'z' && chars[4] == '\0');
+
+  // A function that fails returns an error, and the VM can call others.
+  EXPECT(obaCall(vm, fail) == OBA_RESULT_RUNTIME_ERROR);
+  EXPECT(obaCall(vm, answer) == OBA_RESULT_SUCCESS);
+  EXPECT(obaGetSlotNumber(vm, 0) == 42);
+
+  // Handles call the function they were looked up for, even once the script
+  // that defined it has been replaced.
+  EXPECT(obaInterpret(vm, "fn answer = 0") == OBA_RESULT_SUCCESS);
+  EXPECT(obaCall(vm, answer) == OBA_RESULT_SUCCESS);
+  EXPECT(obaGetSlotNumber(vm, 0) == 42);
+
+  // Releasing a handle leaves the others usable, in any order.
+  obaReleaseHandle(vm, add);
+  obaReleaseHandle(vm, answer);
+  EXPECT(obaEnsureSlots(vm, 2));
+  obaSetSlotNumber(vm, 1, 0);
+  EXPECT(obaCall(vm, describe) == OBA_RESULT_SUCCESS);
+  EXPECT(obaGetSlotType(vm, 0) == OBA_TYPE_STRING);
+  obaReleaseHandle(vm, describe);
+
+  // Handles that are not released are freed with the VM.
+  obaFreeVM(vm);
+}
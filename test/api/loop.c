@@ -0,0 +1,89 @@
+// Tests running scripts that wait for I/O on an event loop.
+
+#include <dirent.h>
+
+#include "api_test.h"
+
+// The number [record] was last called with.
+static double recorded;
+
+// Stores its argument in [recorded].
+static void recordNative(ObaVM* vm, int argc) {
+  (void)argc;
+  recorded = obaGetSlotNumber(vm, 1);
+}
+
+static Builtin builtins[] = {
+    {"record", recordNative},
+};
+
+// Returns the number of file descriptors the process has open, or -1 if they
+// cannot be listed.
+static int countFiles(void) {
+  DIR* dir = opendir("/proc/self/fd");
+  if (dir == NULL)
+    return -1;
+
+  // The directory's own descriptor is listed along with "." and "..".
+  int count = -3;
+  while (readdir(dir) != NULL) {
+    count++;
+  }
+  closedir(dir);
+  return count;
+}
+
+void testLoop(void) {
+  ObaVM* first = obaNewVM(builtins, sizeof(builtins) / sizeof(builtins[0]));
+  ObaVM* second = obaNewVM(builtins, sizeof(builtins) / sizeof(builtins[0]));
+  int files = countFiles();
+
+  // A script waiting on the loop is resumed by it.
+  ObaEventLoop* loop = obaNewEventLoop();
+  EXPECT(loop != NULL);
+  if (loop == NULL)
+    return;
+  obaSetEventLoop(first, loop);
+  recorded = -1;
+  EXPECT(obaInterpret(first, "__native_sleep(1 / 100)\nrecord(1)") ==
+         OBA_RESULT_WAITING);
+  EXPECT(recorded == -1);
+  ObaInterpretResult result = OBA_RESULT_RUNTIME_ERROR;
+  EXPECT(obaRunEventLoop(loop, &result) == first);
+  EXPECT(result == OBA_RESULT_SUCCESS);
+  EXPECT(recorded == 1);
+  EXPECT(obaRunEventLoop(loop, &result) == NULL);
+
+  // Freeing the loop while scripts wait on it leaves them suspended, and
+  // closes what they waited on.
+  obaSetEventLoop(second, loop);
+  EXPECT(obaInterpret(first, "__native_sleep(60)\nrecord(2)") ==
+         OBA_RESULT_WAITING);
+  EXPECT(obaInterpret(second, "__native_sleep(60)\nrecord(3)") ==
+         OBA_RESULT_WAITING);
+  obaFreeEventLoop(loop);
+  EXPECT(files == -1 || countFiles() == files);
+  EXPECT(recorded == 1);
+
+  // Resuming one ends its wait at once, and running other code in the other
+  // abandons it.
+  EXPECT(obaResume(first) == OBA_RESULT_SUCCESS);
+  EXPECT(recorded == 2);
+  EXPECT(obaInterpret(second, "record(4)") == OBA_RESULT_SUCCESS);
+  EXPECT(recorded == 4);
+  EXPECT(obaResume(second) == OBA_RESULT_SUCCESS);
+  EXPECT(recorded == 4);
+
+  // Both can be attached to another loop, and VMs that are freed while they
+  // wait stop waiting.
+  loop = obaNewEventLoop();
+  obaSetEventLoop(first, loop);
+  obaSetEventLoop(second, loop);
+  EXPECT(obaInterpret(first, "__native_sleep(60)") == OBA_RESULT_WAITING);
+  obaFreeVM(first);
+  obaSetEventLoop(second, NULL);
+  obaFreeEventLoop(loop);
+
+  obaFreeVM(second);
+  EXPECT(files == -1 || countFiles() == files);
+}
@@ -0,0 +1,58 @@
+// Runs the tests of the C API, and exits with 1 if any of them fails.
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "api_test.h"
+
+typedef struct {
+  const char* name;
+  void (*run)(void);
+} Test;
+
+static const Test tests[] = {
+    {"callback", testCallback},
+    {"fuel", testFuel},
+    {"handle", testHandle},
+    {"loop", testLoop},
+    {"reload", testReload},
+    {"slot", testSlot},
+    {NULL, NULL},
+};
+
+// The test being run.
+static const Test* running;
+
+// Whether a check in the running test has failed.
+static bool failed;
+
+void expect(bool condition, const char* text, const char* file, int line) {
+  if (condition)
+    return;
+  if (!failed) {
+    printf("- FAIL api/%s\n", running->name);
+  }
+  printf("  - ERROR: %s:%d: Expected %s\n", file, line, text);
+  failed = true;
+}
+
+int main(void) {
+  // Scripts report the errors the tests cause to stderr, and the tests must
+  // not read or fill the user's compile cache.
+  if (freopen("/dev/null", "w", stderr) == NULL)
+    return EXIT_FAILURE;
+  setenv("OBA_CACHE_DIR", "", 1);
+
+  int exitCode = EXIT_SUCCESS;
+  for (const Test* test = tests; test->name != NULL; test++) {
+    running = test;
+    failed = false;
+    test->run();
+    if (failed) {
+      exitCode = EXIT_FAILURE;
+    } else {
+      printf("- PASS api/%s\n", test->name);
+    }
+  }
+  return exitCode;
+}
@@ -0,0 +1,101 @@
+// Tests replacing the code of an imported module with [obaReloadModule].
+
+#include <string.h>
+
+#include "api_test.h"
+
+static const char* counter = "\
+let base = 1\n\
+fn value = base\n\
+";
+
+// Loads the module "counter", and leaves the others to the VM.
+static ObaLoadModuleResult loadModule(ObaVM* vm, const char* name) {
+  (void)vm;
+  ObaLoadModuleResult result = {NULL, NULL, 0, NULL, NULL};
+  if (strcmp(name, "counter") == 0) {
+    result.source = counter;
+  }
+  return result;
+}
+
+// Calls the function [name] in [module] with no arguments, and returns the
+// number it returns, or -1 if it cannot be called or returns something else.
+static double callNumber(ObaVM* vm, const char* module, const char* name) {
+  ObaHandle* handle = obaGetFunction(vm, module, name);
+  if (handle == NULL)
+    return -1;
+
+  double value = -1;
+  if (obaCall(vm, handle) == OBA_RESULT_SUCCESS &&
+      obaGetSlotType(vm, 0) == OBA_TYPE_NUMBER) {
+    value = obaGetSlotNumber(vm, 0);
+  }
+  obaReleaseHandle(vm, handle);
+  return value;
+}
+
+// Reloads a module while a script is waiting, which must not abandon it.
+static void testWaiting(ObaVM* vm) {
+  ObaEventLoop* loop = obaNewEventLoop();
+  EXPECT(loop != NULL);
+  if (loop == NULL)
+    return;
+
+  obaSetEventLoop(vm, loop);
+  EXPECT(obaInterpret(vm, "__native_sleep(1 / 100)") == OBA_RESULT_WAITING);
+  EXPECT(obaReloadModule(vm, "counter", "let base = 4\nfn value = base") ==
+         OBA_RESULT_RUNTIME_ERROR);
+
+  ObaInterpretResult result = OBA_RESULT_RUNTIME_ERROR;
+  EXPECT(obaRunEventLoop(loop, &result) == vm);
+  EXPECT(result == OBA_RESULT_SUCCESS);
+  obaSetEventLoop(vm, NULL);
+  obaFreeEventLoop(loop);
+
+  EXPECT(callNumber(vm, "counter", "value") == 2);
+}
+
+void testReload(void) {
+  ObaVM* vm = obaNewVM(NULL, 0);
+  obaSetModuleHandlers(vm, NULL, loadModule);
+
+  // A module that was never imported cannot be reloaded.
+  EXPECT(obaReloadModule(vm, "counter", "let base = 2\nfn value = base") ==
+         OBA_RESULT_RUNTIME_ERROR);
+
+  EXPECT(obaInterpret(vm, "\
+import \"counter\"\n\
+let old = counter::value\n\
+fn current = counter::value()\n\
+") == OBA_RESULT_SUCCESS);
+  EXPECT(callNumber(vm, "counter", "value") == 1);
+
+  // Functions taken from the module before keep their code, but read the new
+  // variables. Members looked up afterwards are the new ones.
+  EXPECT(obaReloadModule(vm, "counter",
+                         "let base = 2\nfn value = base * 10") ==
+         OBA_RESULT_SUCCESS);
+  EXPECT(callNumber(vm, "counter", "value") == 20);
+  EXPECT(callNumber(vm, "main", "current") == 20);
+  EXPECT(callNumber(vm, "main", "old") == 2);
+
+  // A body that does not compile, or fails, leaves the module as it was.
+  EXPECT(obaReloadModule(vm, "counter", "fn value =") ==
+         OBA_RESULT_COMPILE_ERROR);
+  EXPECT(callNumber(vm, "counter", "value") == 20);
+
+  EXPECT(obaReloadModule(vm, "counter",
+                         "let base = 3\nfn value = base\nlet bad = 1 + true") ==
+         OBA_RESULT_RUNTIME_ERROR);
+  EXPECT(callNumber(vm, "counter", "value") == 20);
+
+  // The module can be reloaded again after a failed reload.
+  EXPECT(obaReloadModule(vm, "counter", "let base = 2\nfn value = base") ==
+         OBA_RESULT_SUCCESS);
+  EXPECT(callNumber(vm, "counter", "value") == 2);
+  EXPECT(callNumber(vm, "main", "old") == 2);
+
+  testWaiting(vm);
+  obaFreeVM(vm);
+}
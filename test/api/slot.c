@@ -0,0 +1,116 @@
+// Tests reading and writing values through slots.
+
+#include <stdio.h>
+#include <string.h>
+
+#include "api_test.h"
+
+static const char bytes[] = {'a', '\0', 'b'};
+
+// The length of the string [record] was last called with, and whether its
+// bytes were [bytes] repeated, followed by a null byte.
+static size_t recordedLength;
+static bool recordedBytes;
+
+// Returns [bytes] as a string.
+static void bytesNative(ObaVM* vm, int argc) {
+  (void)argc;
+  obaSetSlotString(vm, 0, bytes, sizeof(bytes));
+}
+
+// Stores the length of its argument, a string, in [recordedLength], and checks
+// its bytes.
+static void recordNative(ObaVM* vm, int argc) {
+  (void)argc;
+  const char* chars = obaGetSlotString(vm, 1, &recordedLength);
+  recordedBytes = chars[recordedLength] == '\0';
+  for (size_t i = 0; i < recordedLength; i++) {
+    recordedBytes = recordedBytes && chars[i] == bytes[i % sizeof(bytes)];
+  }
+}
+
+// Returns the type of its argument, as a number.
+static void typeNative(ObaVM* vm, int argc) {
+  (void)argc;
+  obaSetSlotNumber(vm, 0, obaGetSlotType(vm, 1));
+}
+
+static Builtin builtins[] = {
+    {"bytes", bytesNative},
+    {"record", recordNative},
+    {"type", typeNative},
+};
+
+// Returns the type of the value [source] evaluates to, or -1 if it cannot be
+// evaluated.
+static int typeOf(ObaVM* vm, const char* source) {
+  char script[256];
+  snprintf(script, sizeof(script), "fn result = type(%s)", source);
+
+  ObaHandle* handle = NULL;
+  int type = -1;
+  if (obaInterpret(vm, script) == OBA_RESULT_SUCCESS &&
+      (handle = obaGetFunction(vm, "main", "result")) != NULL &&
+      obaCall(vm, handle) == OBA_RESULT_SUCCESS) {
+    type = (int)obaGetSlotNumber(vm, 0);
+  }
+  if (handle != NULL) {
+    obaReleaseHandle(vm, handle);
+  }
+  return type;
+}
+
+void testSlot(void) {
+  ObaVM* vm = obaNewVM(builtins, sizeof(builtins) / sizeof(builtins[0]));
+
+  // New slots hold nil, and slots are only ever added.
+  EXPECT(obaGetSlotCount(vm) == 0);
+  EXPECT(obaEnsureSlots(vm, 3));
+  EXPECT(obaGetSlotCount(vm) == 3);
+  EXPECT(obaEnsureSlots(vm, 1));
+  EXPECT(obaGetSlotCount(vm) == 3);
+  for (int i = 0; i < 3; i++) {
+    EXPECT(obaGetSlotType(vm, i) == OBA_TYPE_NIL);
+  }
+  EXPECT(!obaEnsureSlots(vm, 1 << 24));
+  EXPECT(obaGetSlotCount(vm) == 3);
+
+  obaSetSlotBool(vm, 0, true);
+  EXPECT(obaGetSlotType(vm, 0) == OBA_TYPE_BOOL);
+  EXPECT(obaGetSlotBool(vm, 0));
+  obaSetSlotNumber(vm, 1, 1.5);
+  EXPECT(obaGetSlotType(vm, 1) == OBA_TYPE_NUMBER);
+  EXPECT(obaGetSlotNumber(vm, 1) == 1.5);
+  obaCopySlot(vm, 2, 1);
+  EXPECT(obaGetSlotNumber(vm, 2) == 1.5);
+  obaSetSlotNil(vm, 1);
+  EXPECT(obaGetSlotType(vm, 1) == OBA_TYPE_NIL);
+
+  // Strings keep every byte, including null bytes, and are followed by one.
+  obaSetSlotString(vm, 2, bytes, sizeof(bytes));
+  EXPECT(obaGetSlotType(vm, 2) == OBA_TYPE_STRING);
+  size_t length = 0;
+  const char* chars = obaGetSlotString(vm, 2, &length);
+  EXPECT(length == sizeof(bytes));
+  EXPECT(memcmp(chars, bytes, sizeof(bytes)) == 0 && chars[length] == '\0');
+
+  obaSetSlotString(vm, 2, "", 0);
+  EXPECT(obaGetSlotString(vm, 2, NULL)[0] == '\0');
+
+  // Natives see the same values as the host.
+  recordedLength = 0;
+  EXPECT(obaInterpret(vm, "record(bytes())") == OBA_RESULT_SUCCESS);
+  EXPECT(recordedLength == 3 && recordedBytes);
+  EXPECT(obaInterpret(vm, "record(bytes() + bytes())") == OBA_RESULT_SUCCESS);
+  EXPECT(recordedLength == 6 && recordedBytes);
+
+  EXPECT(typeOf(vm, "type") == OBA_TYPE_UNKNOWN);
+  EXPECT(typeOf(vm, "true") == OBA_TYPE_BOOL);
+  EXPECT(typeOf(vm, "1") == OBA_TYPE_NUMBER);
+  EXPECT(typeOf(vm, "\"string\"") == OBA_TYPE_STRING);
+  EXPECT(typeOf(vm, "bytes()") == OBA_TYPE_STRING);
+  EXPECT(typeOf(vm, "result") == OBA_TYPE_UNKNOWN);
+  EXPECT(typeOf(vm, "record(bytes())") == OBA_TYPE_NIL);
+
+  obaFreeVM(vm);
+}
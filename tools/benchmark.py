@@ -0,0 +1,106 @@
+import argparse
+import glob
+import os
+import re
+import subprocess
+import sys
+import tempfile
+import time
+
+BENCHMARK_DIR = os.path.join("test", "benchmark")
+SOURCES = ["src/main.c"] + sorted(glob.glob("src/vm/*.c"))
+
+BUILDS = {
+    "plain": [],
+    "peephole": ["-DOBA_PEEPHOLE"],
+}
+
+INSTRUCTIONS_RE = re.compile("Instructions executed: ([0-9]+)")
+
+
+def get_args():
+    parser = argparse.ArgumentParser(
+        description="Measures the peephole optimizations."
+    )
+    parser.add_argument("--cc", help="The C compiler to use", default="cc")
+    parser.add_argument(
+        "--runs", help="The number of timed runs per benchmark", type=int, default=5
+    )
+    parser.add_argument(
+        "--glob", help="Filter benchmark files by name", default="*.oba"
+    )
+    return parser.parse_args()
+
+
+def build(cc, output, flags):
+    command = [cc, "-O2", "-pthread", "-DOBA_COMPUTED_GOTO", "-I", "./src/include"]
+    command += flags + ["-o", output] + SOURCES
+    subprocess.run(command, check=True)
+
+
+def count_instructions(oba, benchmark):
+    proc = subprocess.run([oba, benchmark], capture_output=True, text=True)
+    match = INSTRUCTIONS_RE.search(proc.stderr)
+    if proc.returncode != 0 or not match:
+        raise RuntimeError("{} failed:\n{}".format(benchmark, proc.stderr))
+    return int(match.group(1))
+
+
+def best_time(oba, benchmark, runs):
+    best = None
+    for _ in range(runs):
+        start = time.perf_counter()
+        subprocess.run([oba, benchmark], capture_output=True, check=True)
+        elapsed = time.perf_counter() - start
+        if best is None or elapsed < best:
+            best = elapsed
+    return best
+
+
+def main():
+    args = get_args()
+    benchmarks = sorted(glob.glob(os.path.join(BENCHMARK_DIR, args.glob)))
+    if not benchmarks:
+        print("No benchmarks match {}".format(args.glob))
+        sys.exit(1)
+
+    with tempfile.TemporaryDirectory() as tmp:
+        timed = {}
+        counted = {}
+        for name, flags in BUILDS.items():
+            timed[name] = os.path.join(tmp, "oba-" + name)
+            counted[name] = os.path.join(tmp, "oba-" + name + "-count")
+            build(args.cc, timed[name], flags)
+            build(args.cc, counted[name], flags + ["-DOBA_COUNT_INSTRUCTIONS"])
+
+        print(
+            "{:<12} {:>14} {:>14} {:>8} {:>10} {:>10} {:>8}".format(
+                "benchmark",
+                "plain instrs",
+                "fused instrs",
+                "ratio",
+                "plain s",
+                "fused s",
+                "ratio",
+            )
+        )
+        for benchmark in benchmarks:
+            name = os.path.splitext(os.path.basename(benchmark))[0]
+            plain_count = count_instructions(counted["plain"], benchmark)
+            peephole_count = count_instructions(counted["peephole"], benchmark)
+            plain_time = best_time(timed["plain"], benchmark, args.runs)
+            peephole_time = best_time(timed["peephole"], benchmark, args.runs)
+            print(
+                "{:<12} {:>14} {:>14} {:>8.2f} {:>10.3f} {:>10.3f} {:>8.2f}".format(
+                    name,
+                    plain_count,
+                    peephole_count,
+                    peephole_count / plain_count,
+                    plain_time,
+                    peephole_time,
+                    peephole_time / plain_time,
+                )
+            )
+
+
+main()
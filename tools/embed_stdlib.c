@@ -0,0 +1,95 @@
+// Compiles standard library modules to bytecode, and writes them as a C header
+// that src/vm/oba_stdlib.c includes to embed them in the binary.
+//
+// Usage: embed_stdlib <output.h> <module.oba>...
+//
+// Each module is named after its file, without the directory or extension. The
+// bytecode depends on how the compiler was built, so this must be built with
+// the same flags as the binary that embeds its output.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <oba.h>
+
+#include "read_source.h"
+
+// Writes the name of the module at [path] to [name].
+static void moduleName(const char* path, char* name, size_t size) {
+  const char* base = strrchr(path, '/');
+  base = base == NULL ? path : base + 1;
+
+  size_t length = strcspn(base, ".");
+  if (length >= size) {
+    length = size - 1;
+  }
+  memcpy(name, base, length);
+  name[length] = '\0';
+}
+
+// Compiles the module at [path] and writes its bytecode to [output] as an array
+// named after the module. Returns false if it does not compile.
+static bool embedModule(FILE* output, const char* path, const char* name) {
+  char* source = readSource(path);
+  if (source == NULL) {
+    fprintf(stderr, "Could not read \"%s\".\n", path);
+    return false;
+  }
+
+  ObaVM* vm = obaNewVM(NULL, 0);
+  size_t length;
+  unsigned char* bytecode = obaCompileModule(vm, name, source, &length);
+  free(source);
+  obaFreeVM(vm);
+  if (bytecode == NULL) {
+    fprintf(stderr, "Could not compile \"%s\".\n", path);
+    return false;
+  }
+
+  fprintf(output, "static const uint8_t %sBytecode[] = {", name);
+  for (size_t i = 0; i < length; i++) {
+    fprintf(output, "%s0x%02x,", i % 12 == 0 ? "\n    " : " ", bytecode[i]);
+  }
+  fprintf(output, "\n};\n\n");
+
+  free(bytecode);
+  return true;
+}
+
+int main(int argc, char** argv) {
+  if (argc < 2) {
+    fprintf(stderr, "Usage: embed_stdlib <output.h> <module.oba>...\n");
+    return 1;
+  }
+
+  FILE* output = fopen(argv[1], "w");
+  if (output == NULL) {
+    fprintf(stderr, "Could not write \"%s\".\n", argv[1]);
+    return 1;
+  }
+
+  fprintf(output, "// Generated by tools/embed_stdlib.c. Do not edit.\n\n");
+
+  char name[64];
+  bool ok = true;
+  for (int i = 2; i < argc && ok; i++) {
+    moduleName(argv[i], name, sizeof(name));
+    ok = embedModule(output, argv[i], name);
+  }
+
+  fprintf(output, "static const EmbeddedModule stdlibModules[] = {\n");
+  for (int i = 2; i < argc && ok; i++) {
+    moduleName(argv[i], name, sizeof(name));
+    fprintf(output, "    {\"%s\", %sBytecode, sizeof(%sBytecode)},\n", name,
+            name, name);
+  }
+  fprintf(output, "    {NULL, NULL, 0},\n};\n");
+
+  ok = fclose(output) == 0 && ok;
+  if (!ok) {
+    remove(argv[1]);
+    return 1;
+  }
+  return 0;
+}
@@ -0,0 +1,122 @@
+// Measures how the number of scripts run per second scales with the number of
+// threads running them, each on a VM taken from a shared pool.
+//
+// Usage: pool_benchmark <script.oba> [max threads] [runs per thread]
+//
+// The script is run [runs per thread] times by each thread, for 1, 2, 4, ...
+// threads up to [max threads], which defaults to the number of cores. What the
+// script prints is discarded.
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <oba.h>
+
+#include "read_source.h"
+
+#define DEFAULT_RUNS 20
+
+typedef struct {
+  ObaVMPool* pool;
+  const char* source;
+  int runs;
+  int failures;
+} Worker;
+
+static double now(void) {
+  struct timespec time;
+  clock_gettime(CLOCK_MONOTONIC, &time);
+  return (double)time.tv_sec + (double)time.tv_nsec / 1e9;
+}
+
+static void* runWorker(void* arg) {
+  Worker* worker = (Worker*)arg;
+  for (int i = 0; i < worker->runs; i++) {
+    ObaVM* vm = obaAcquireVM(worker->pool);
+    if (obaInterpretCached(vm, worker->source) != OBA_RESULT_SUCCESS) {
+      worker->failures++;
+    }
+    obaReleaseVM(worker->pool, vm);
+  }
+  return NULL;
+}
+
+// Runs [source] [runs] times on each of [threads] threads, and returns the
+// number of runs per second, or -1 if a run failed.
+static double measure(const char* source, int threads, int runs) {
+  ObaVMPool* pool = obaNewVMPool(threads, NULL, 0, NULL);
+  pthread_t* ids = malloc(sizeof(pthread_t) * threads);
+  Worker* workers = malloc(sizeof(Worker) * threads);
+
+  double start = now();
+  for (int i = 0; i < threads; i++) {
+    workers[i] = (Worker){pool, source, runs, 0};
+    pthread_create(&ids[i], NULL, runWorker, &workers[i]);
+  }
+
+  int failures = 0;
+  for (int i = 0; i < threads; i++) {
+    pthread_join(ids[i], NULL);
+    failures += workers[i].failures;
+  }
+  double elapsed = now() - start;
+
+  free(workers);
+  free(ids);
+  obaFreeVMPool(pool);
+  return failures > 0 ? -1 : threads * runs / elapsed;
+}
+
+// Returns the number of threads to measure after [threads], doubling it up to
+// [maxThreads].
+static int nextThreadCount(int threads, int maxThreads) {
+  if (threads == maxThreads)
+    return maxThreads + 1;
+  return threads * 2 > maxThreads ? maxThreads : threads * 2;
+}
+
+int main(int argc, char** argv) {
+  if (argc < 2 || argc > 4) {
+    fprintf(stderr, "Usage: pool_benchmark <script.oba> [max threads] "
+                    "[runs per thread]\n");
+    return 1;
+  }
+
+  char* source = readSource(argv[1]);
+  if (source == NULL) {
+    fprintf(stderr, "Could not read %s\n", argv[1]);
+    return 1;
+  }
+  int maxThreads =
+      argc > 2 ? atoi(argv[2]) : (int)sysconf(_SC_NPROCESSORS_ONLN);
+  int runs = argc > 3 ? atoi(argv[3]) : DEFAULT_RUNS;
+
+  // Keep the results, and send everything the script prints to /dev/null.
+  FILE* out = fdopen(dup(fileno(stdout)), "w");
+  if (out == NULL || freopen("/dev/null", "w", stdout) == NULL) {
+    fprintf(stderr, "Could not redirect the script's output\n");
+    return 1;
+  }
+
+  fprintf(out, "%8s %12s %8s\n", "threads", "runs/s", "speedup");
+  double base = 0;
+  for (int threads = 1; threads <= maxThreads;
+       threads = nextThreadCount(threads, maxThreads)) {
+    double rate = measure(source, threads, runs);
+    if (rate < 0) {
+      fprintf(stderr, "%s failed\n", argv[1]);
+      return 1;
+    }
+    if (threads == 1)
+      base = rate;
+    fprintf(out, "%8d %12.1f %8.2f\n", threads, rate, rate / base);
+    fflush(out);
+  }
+
+  free(source);
+  fclose(out);
+  return 0;
+}
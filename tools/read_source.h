@@ -0,0 +1,32 @@
+#ifndef read_source_h
+#define read_source_h
+
+// The file reading shared by the tools, which each include this once.
+
+#include <stdio.h>
+#include <stdlib.h>
+
+// Returns the contents of the file at [path], or NULL if it cannot be read.
+static char* readSource(const char* path) {
+  FILE* file = fopen(path, "rb");
+  if (file == NULL)
+    return NULL;
+
+  char* source = NULL;
+  if (fseek(file, 0L, SEEK_END) == 0) {
+    long size = ftell(file);
+    rewind(file);
+    source = malloc(size + 1);
+    if (source != NULL && fread(source, 1, size, file) == (size_t)size) {
+      source[size] = '\0';
+    } else {
+      free(source);
+      source = NULL;
+    }
+  }
+
+  fclose(file);
+  return source;
+}
+
+#endif
@@ -0,0 +1,103 @@
+// Measures how the number of tasks run per second scales with the number of
+// threads a scheduler runs them on.
+//
+// Usage: scheduler_benchmark <script.oba> [max threads] [tasks]
+//
+// The script is spawned [tasks] times, all at once, on a scheduler with 1, 2,
+// 4, ... threads up to [max threads], which defaults to the number of cores.
+// One of the threads is the one that spawns them, which joins each in turn and
+// runs tasks meanwhile. What the script prints is discarded.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <oba.h>
+
+#include "read_source.h"
+
+#define DEFAULT_TASKS 1000
+
+static double now(void) {
+  struct timespec time;
+  clock_gettime(CLOCK_MONOTONIC, &time);
+  return (double)time.tv_sec + (double)time.tv_nsec / 1e9;
+}
+
+// Runs [source] as [count] tasks on [threads] threads, and returns the number
+// of tasks run per second, or -1 if a task failed.
+static double measure(const char* source, int threads, int count) {
+  // The calling thread runs tasks while it joins them, so it is one of the
+  // threads.
+  ObaScheduler* scheduler = obaNewScheduler(threads - 1, NULL, 0);
+  ObaTask** tasks = malloc(sizeof(ObaTask*) * count);
+
+  double start = now();
+  for (int i = 0; i < count; i++) {
+    tasks[i] = obaSpawn(scheduler, source);
+  }
+
+  int failures = 0;
+  for (int i = 0; i < count; i++) {
+    if (obaJoin(scheduler, tasks[i]) != OBA_RESULT_SUCCESS) {
+      failures++;
+    }
+  }
+  double elapsed = now() - start;
+
+  free(tasks);
+  obaFreeScheduler(scheduler);
+  return failures > 0 ? -1 : count / elapsed;
+}
+
+// Returns the number of threads to measure after [threads], doubling it up to
+// [maxThreads].
+static int nextThreadCount(int threads, int maxThreads) {
+  if (threads == maxThreads)
+    return maxThreads + 1;
+  return threads * 2 > maxThreads ? maxThreads : threads * 2;
+}
+
+int main(int argc, char** argv) {
+  if (argc < 2 || argc > 4) {
+    fprintf(stderr, "Usage: scheduler_benchmark <script.oba> [max threads] "
+                    "[tasks]\n");
+    return 1;
+  }
+
+  char* source = readSource(argv[1]);
+  if (source == NULL) {
+    fprintf(stderr, "Could not read %s\n", argv[1]);
+    return 1;
+  }
+  int maxThreads =
+      argc > 2 ? atoi(argv[2]) : (int)sysconf(_SC_NPROCESSORS_ONLN);
+  int count = argc > 3 ? atoi(argv[3]) : DEFAULT_TASKS;
+
+  // Keep the results, and send everything the script prints to /dev/null.
+  FILE* out = fdopen(dup(fileno(stdout)), "w");
+  if (out == NULL || freopen("/dev/null", "w", stdout) == NULL) {
+    fprintf(stderr, "Could not redirect the script's output\n");
+    return 1;
+  }
+
+  fprintf(out, "%8s %12s %8s\n", "threads", "tasks/s", "speedup");
+  double base = 0;
+  for (int threads = 1; threads <= maxThreads;
+       threads = nextThreadCount(threads, maxThreads)) {
+    double rate = measure(source, threads, count);
+    if (rate < 0) {
+      fprintf(stderr, "%s failed\n", argv[1]);
+      return 1;
+    }
+    if (threads == 1)
+      base = rate;
+    fprintf(out, "%8d %12.1f %8.2f\n", threads, rate, rate / base);
+    fflush(out);
+  }
+
+  free(source);
+  fclose(out);
+  return 0;
+}
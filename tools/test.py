@@ -3,12 +3,15 @@ import glob
 import os
 import re
 import sys
+import tempfile
+import threading
 
 from subprocess import PIPE, Popen
 
 TEST_DIR = "test"
 
 STDIN_RE = re.compile("// stdin: ?(.*)")
+SNAPSHOT_RE = re.compile("// snapshot: ?(.*)")
 EXPECT_OUTPUT_RE = re.compile("// expect: ?(.*)")
 EXPECT_RUNTIME_ERROR_RE = re.compile("// expect runtime error: ?(.*)")
 EXPECT_COMPILE_ERROR_RE = re.compile("// expect compile error: ?(.*)")
@@ -56,10 +59,38 @@ def verify_expectations(expectations, output_lines, output_name):
     return errors
 
 
+# Runs [prelude], a path relative to TEST_DIR, and saves the resulting heap as
+# a snapshot in the cache directory. Returns the path of the snapshot.
+def save_snapshot(oba, prelude):
+    snapshot = os.path.join(
+        os.environ["OBA_CACHE_DIR"], prelude.replace(os.sep, "_") + ".snapshot"
+    )
+    if not os.path.exists(snapshot):
+        prelude_file = os.path.join(TEST_DIR, prelude)
+        prelude_args = [oba, "--save-snapshot", snapshot, prelude_file]
+        proc = Popen(prelude_args, stdin=PIPE, stderr=PIPE, stdout=PIPE)
+        _, stderr = proc.communicate()
+        if proc.returncode != 0:
+            raise TestError(
+                "Could not save a snapshot of {}: {}".format(prelude, stderr.decode())
+            )
+    return snapshot
+
+
+# Writes the file at [path] to the pipe [fd] and closes it.
+def write_pipe(fd, path):
+    with open(path, "rb") as f, os.fdopen(fd, "wb") as pipe:
+        try:
+            pipe.write(f.read())
+        except BrokenPipeError:
+            pass
+
+
 def run_test(oba, test_file):
     expected_outs = []
     expected_errs = []
     stdin = ""
+    snapshot = None
 
     # Parse the test expectations.
     with open(test_file, "r") as f:
@@ -68,6 +99,10 @@ def run_test(oba, test_file):
             if match:
                 stdin += match.group(1) + "\n"
 
+            match = SNAPSHOT_RE.search(line)
+            if match:
+                snapshot = save_snapshot(oba, match.group(1))
+
             match = EXPECT_OUTPUT_RE.search(line)
             if match:
                 expected_outs.append(match.group(1))
@@ -85,20 +120,49 @@ def run_test(oba, test_file):
     if not expected_outs and not expected_errs:
         raise TestError("Test has no expectations")
 
-    # Get the test output.
-    test_args = [oba, test_file]
-    proc = Popen(test_args, stdin=PIPE, stderr=PIPE, stdout=PIPE)
-    stdout, stderr = proc.communicate(input=stdin.encode())
-
-    try:
-        stdout = stdout.decode("utf-8").replace("\r\n", "\n")
-        stderr = stderr.decode("utf-8").replace("\r\n", "\n")
-    except:
-        return ["failed decoding output"]
-
     if expected_outs:
-        return verify_expectations(expected_outs, stdout.splitlines(), "stdout")
-    return verify_expectations(expected_errs, stderr.splitlines(), "stderr")
+        expected, output_name = expected_outs, "stdout"
+    else:
+        expected, output_name = expected_errs, "stderr"
+
+    # Run the test three times: once compiling from source, once loading the
+    # bytecode cached by the first run, and once compiling the source as it is
+    # read from a pipe.
+    for run in ["cold cache", "warm cache", "streamed"]:
+        script, pipe = test_file, None
+        if run == "streamed":
+            pipe = os.pipe()
+            script = "/dev/fd/{}".format(pipe[0])
+
+        test_args = [oba, script]
+        if snapshot:
+            test_args = [oba, "--snapshot", snapshot, script]
+        proc = Popen(
+            test_args,
+            stdin=PIPE,
+            stderr=PIPE,
+            stdout=PIPE,
+            pass_fds=pipe[:1] if pipe else (),
+        )
+        if pipe:
+            os.close(pipe[0])
+            threading.Thread(target=write_pipe, args=(pipe[1], test_file)).start()
+        stdout, stderr = proc.communicate(input=stdin.encode())
+
+        try:
+            stdout = stdout.decode("utf-8").replace("\r\n", "\n")
+            stderr = stderr.decode("utf-8").replace("\r\n", "\n")
+        except:
+            return ["failed decoding output"]
+
+        output = stdout if expected_outs else stderr
+        errors = verify_expectations(
+            expected, output.splitlines(), "{} ({})".format(output_name, run)
+        )
+        if errors:
+            return errors
+
+    return []
 
 
 def run_test_file(oba, test_file):
@@ -135,7 +199,12 @@ def main():
 
     test_file_glob = os.path.join(TEST_DIR, args.glob)
     test_files = glob.glob(test_file_glob, recursive=True)
-    sys.exit(run_test_files(args.oba, test_files))
+
+    # Keep the tests from reading or filling the user's compile cache.
+    with tempfile.TemporaryDirectory() as cache_dir:
+        os.environ["OBA_CACHE_DIR"] = cache_dir
+        exit_code = run_test_files(args.oba, test_files)
+    sys.exit(exit_code)
 
 
 main()